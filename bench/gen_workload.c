@@ -0,0 +1,241 @@
+/* Program: gen_workload
+ * Description: Deterministic workload generator for smallsh benchmarks. Writes a command file
+ *              with a chosen mix of built-in and external commands, redirections, background
+ *              jobs, argument counts, and comment or blank lines. The same seed and options
+ *              always produce the same file.
+ *
+ * Usage: gen_workload [-n lines] [-S seed] [-b builtin_pct] [-r redirect_pct]
+ *                     [-g background_pct] [-c comment_pct] [-e blank_pct] [-a max_args]
+ *
+ * Build: gcc --std=gnu99 -Wall -O2 -o gen_workload bench/gen_workload.c
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// Limits of the shell's parser: 2048 byte lines with the newline and
+// terminator, and 512 arguments including the command name.
+#define LINE_LIMIT 2046
+#define ARG_LIMIT 511
+
+// Room kept at the end of external commands for redirection and &.
+#define SUFFIX_ROOM 16
+
+/*
+* Structure for the requested command mix. Percentages are of all lines.
+*/
+struct workload_mix {
+    int lines;
+    uint64_t seed;
+    int builtin_pct;
+    int redirect_pct;
+    int background_pct;
+    int comment_pct;
+    int blank_pct;
+    int max_args;
+};
+
+// Prototype functions.
+uint64_t next_random();
+int random_below(int bound);
+bool chance(int percent);
+int append_word(char* line, int length, int limit);
+void write_line(struct workload_mix* mix);
+
+// Global variables.
+uint64_t random_state = 0;
+char* builtins[] = { "status", "cd ." };
+char* externals[] = { "true", "false", "echo", "printf %s" };
+
+
+/*
+* Main program.
+* Parses the mix and writes the command file to standard output.
+*/
+int main(int argc, char** argv) {
+    struct workload_mix mix = {
+        .lines = 1000, .seed = 1, .builtin_pct = 20, .redirect_pct = 10,
+        .background_pct = 10, .comment_pct = 5, .blank_pct = 5, .max_args = 8
+    };
+    int option;
+
+    while ((option = getopt(argc, argv, "n:S:b:r:g:c:e:a:")) != -1) {
+        switch (option) {
+            case 'n': mix.lines = atoi(optarg); break;
+            case 'S': mix.seed = strtoull(optarg, NULL, 10); break;
+            case 'b': mix.builtin_pct = atoi(optarg); break;
+            case 'r': mix.redirect_pct = atoi(optarg); break;
+            case 'g': mix.background_pct = atoi(optarg); break;
+            case 'c': mix.comment_pct = atoi(optarg); break;
+            case 'e': mix.blank_pct = atoi(optarg); break;
+            case 'a': mix.max_args = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n lines] [-S seed] [-b builtin_pct] "
+                        "[-r redirect_pct] [-g background_pct] [-c comment_pct] "
+                        "[-e blank_pct] [-a max_args]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    // Arguments beyond the parser's limit would be rejected, not measured.
+    if (mix.max_args > ARG_LIMIT - 3) {
+        fprintf(stderr, "gen_workload: max_args clamped to %d\n", ARG_LIMIT - 3);
+        mix.max_args = ARG_LIMIT - 3;
+    }
+
+    if (mix.max_args < 0) {
+        mix.max_args = 0;
+    }
+
+    // Seed through splitmix64 so nearby seeds give unrelated streams.
+    random_state = mix.seed;
+
+    // Record the options so a file can be regenerated.
+    printf("# gen_workload -n %d -S %llu -b %d -r %d -g %d -c %d -e %d -a %d\n",
+           mix.lines, (unsigned long long) mix.seed, mix.builtin_pct, mix.redirect_pct,
+           mix.background_pct, mix.comment_pct, mix.blank_pct, mix.max_args);
+
+    for (int i = 0; i < mix.lines; i++) {
+        write_line(&mix);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+* Function: next_random.
+* splitmix64. Gives the same sequence on every platform and libc.
+*
+* Parameter: none.
+* Return: 64 random bits.
+*/
+uint64_t next_random() {
+    uint64_t value = (random_state += 0x9e3779b97f4a7c15ULL);
+
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+
+/*
+* Function: random_below.
+* Picks a number from 0 to bound - 1.
+*
+* Parameter: bound (positive)
+* Return: random number.
+*/
+int random_below(int bound) {
+    return bound > 0 ? (int) (next_random() % (uint64_t) bound) : 0;
+}
+
+
+/*
+* Function: chance.
+* Draws a yes or no with the given probability.
+*
+* Parameter: percent (0 to 100)
+* Return: true with probability percent / 100.
+*/
+bool chance(int percent) {
+    return random_below(100) < percent;
+}
+
+
+/*
+* Function: append_word.
+* Appends a space and a random argument: a number, an option, or a
+* lowercase word.
+*
+* Parameter: line (line being built)
+*            length (current length of line)
+*            limit (longest allowed line)
+* Return: new length. Unchanged if the word would not fit.
+*/
+int append_word(char* line, int length, int limit) {
+    char word[16];
+    int kind = random_below(4);
+
+    if (kind == 0) {
+        snprintf(word, sizeof(word), "%d", random_below(100000));
+    } else if (kind == 1) {
+        snprintf(word, sizeof(word), "-%c", 'a' + random_below(26));
+    } else {
+        int word_length = 1 + random_below(10);
+
+        for (int i = 0; i < word_length; i++) {
+            word[i] = 'a' + random_below(26);
+        }
+        word[word_length] = '\0';
+    }
+
+    int word_length = strlen(word);
+
+    if (length + 1 + word_length > limit) {
+        return length;
+    }
+
+    line[length] = ' ';
+    memcpy(line + length + 1, word, word_length + 1);
+    return length + 1 + word_length;
+}
+
+
+/*
+* Function: write_line.
+* Writes one line of the workload.
+*
+* Parameter: mix (command mix)
+* Return: none.
+*/
+void write_line(struct workload_mix* mix) {
+    char line[LINE_LIMIT + 1];
+    int length;
+    int kind = random_below(100);
+
+    // Comment and blank lines exercise only the read path.
+    if (kind < mix->comment_pct) {
+        length = snprintf(line, sizeof(line), "# comment");
+
+        for (int count = random_below(mix->max_args + 1); count > 0; count--) {
+            length = append_word(line, length, LINE_LIMIT);
+        }
+
+        printf("%s\n", line);
+        return;
+    }
+
+    if (kind < mix->comment_pct + mix->blank_pct) {
+        printf("\n");
+        return;
+    }
+
+    // Built-ins are parsed but never forked.
+    if (kind < mix->comment_pct + mix->blank_pct + mix->builtin_pct) {
+        printf("%s\n", builtins[random_below(2)]);
+        return;
+    }
+
+    // External commands with random arguments.
+    length = snprintf(line, sizeof(line), "%s", externals[random_below(4)]);
+
+    for (int count = random_below(mix->max_args + 1); count > 0; count--) {
+        length = append_word(line, length, LINE_LIMIT - SUFFIX_ROOM);
+    }
+
+    if (chance(mix->redirect_pct)) {
+        length += snprintf(line + length, sizeof(line) - length,
+                           chance(50) ? " < /dev/null" : " > /dev/null");
+    }
+
+    if (chance(mix->background_pct)) {
+        length += snprintf(line + length, sizeof(line) - length, " &");
+    }
+
+    printf("%s\n", line);
+}
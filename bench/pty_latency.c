@@ -0,0 +1,345 @@
+/* Program: pty_latency
+ * Description: Interactive latency benchmark for smallsh. Runs the shell on a pseudo-terminal,
+ *              types a command one key at a time, and measures keystroke-to-echo latency,
+ *              Enter-to-next-prompt latency, and how long the Ctrl+Z foreground-only toggle
+ *              takes to redraw the prompt.
+ *
+ * Usage: pty_latency [-s shell] [-n iterations] [-c command]
+ *
+ * Build: gcc --std=gnu99 -Wall -O2 -o pty_latency bench/pty_latency.c
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// Constants.
+#define OUTPUT_LENGTH 65536
+#define WAIT_TIMEOUT_MS 5000
+
+/*
+* Structure for the latencies of one kind of interaction.
+*/
+struct sample_set {
+    char* name;
+    double* values;
+    int count;
+    int capacity;
+    int timeouts;
+};
+
+/*
+* Structure for the shell running on the pseudo-terminal.
+*/
+struct pty_shell {
+    pid_t pid;
+    int master_fd;
+    char output[OUTPUT_LENGTH];
+    int output_length;
+};
+
+// Prototype functions.
+double now_ms();
+bool start_shell(struct pty_shell* shell, char* path);
+void send_bytes(struct pty_shell* shell, char* bytes, int length);
+double wait_for(struct pty_shell* shell, char* needle);
+void add_sample(struct sample_set* samples, double value);
+int compare_doubles(const void* left, const void* right);
+void report_samples(struct sample_set* samples);
+
+
+/*
+* Main program.
+* Types the command and toggles foreground-only mode for each iteration,
+* then reports the distributions.
+*/
+int main(int argc, char** argv) {
+    char* shell_path = "./smallsh";
+    char* command = "status";
+    int iterations = 200;
+    int option;
+
+    while ((option = getopt(argc, argv, "s:n:c:")) != -1) {
+        switch (option) {
+            case 's': shell_path = optarg; break;
+            case 'n': iterations = atoi(optarg); break;
+            case 'c': command = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-s shell] [-n iterations] [-c command]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    struct pty_shell shell;
+    struct sample_set echo = { "keystroke to echo" };
+    struct sample_set prompt = { "enter to prompt" };
+    struct sample_set toggle = { "ctrl+z to redraw" };
+
+    if (!start_shell(&shell, shell_path)) {
+        return EXIT_FAILURE;
+    }
+
+    if (wait_for(&shell, ": ") < 0) {
+        fprintf(stderr, "pty_latency: no prompt from %s\n", shell_path);
+        kill(shell.pid, SIGKILL);
+        return EXIT_FAILURE;
+    }
+
+    char interrupt = 0x1a;
+
+    for (int i = 0; i < iterations; i++) {
+
+        // Each typed key is echoed by the shell's line editor.
+        for (char* key = command; *key != '\0'; key++) {
+            char needle[2] = { *key, '\0' };
+
+            send_bytes(&shell, key, 1);
+            add_sample(&echo, wait_for(&shell, needle));
+        }
+
+        // Enter runs the command. Done when the next prompt is drawn.
+        send_bytes(&shell, "\r", 1);
+        add_sample(&prompt, wait_for(&shell, "\n: "));
+
+        // Ctrl+Z is delivered as SIGTSTP. Done when the prompt is redrawn.
+        // Sent twice so the shell leaves foreground-only mode again.
+        for (int j = 0; j < 2; j++) {
+            send_bytes(&shell, &interrupt, 1);
+            add_sample(&toggle, wait_for(&shell, "\033[K: "));
+        }
+    }
+
+    send_bytes(&shell, "exit\r", 5);
+    waitpid(shell.pid, NULL, 0);
+
+    report_samples(&echo);
+    report_samples(&prompt);
+    report_samples(&toggle);
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+* Function: now_ms.
+* Reads the monotonic clock.
+*
+* Parameter: none.
+* Return: milliseconds.
+*/
+double now_ms() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+
+/*
+* Function: start_shell.
+* Opens a pseudo-terminal and starts the shell on it as the session
+* leader with the terminal as its controlling terminal, so Ctrl+Z
+* raises SIGTSTP as it would for a user.
+*
+* Parameter: shell (filled in)
+*            path (shell program)
+* Return: false on error.
+*/
+bool start_shell(struct pty_shell* shell, char* path) {
+    memset(shell, 0, sizeof(*shell));
+
+    shell->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+
+    if (shell->master_fd == -1 || grantpt(shell->master_fd) == -1 ||
+        unlockpt(shell->master_fd) == -1) {
+        perror("posix_openpt");
+        return false;
+    }
+
+    char* terminal_path = ptsname(shell->master_fd);
+
+    shell->pid = fork();
+
+    if (shell->pid == -1) {
+        perror("fork");
+        return false;
+    }
+
+    if (shell->pid == 0) {
+        setsid();
+
+        int terminal_fd = open(terminal_path, O_RDWR);
+
+        if (terminal_fd == -1) {
+            perror(terminal_path);
+            exit(1);
+        }
+
+        ioctl(terminal_fd, TIOCSCTTY, 0);
+        dup2(terminal_fd, STDIN_FILENO);
+        dup2(terminal_fd, STDOUT_FILENO);
+        dup2(terminal_fd, STDERR_FILENO);
+        close(terminal_fd);
+
+        execl(path, path, (char*) NULL);
+        perror(path);
+        exit(1);
+    }
+
+    return true;
+}
+
+
+/*
+* Function: send_bytes.
+* Types bytes on the terminal.
+*
+* Parameter: shell (shell under test)
+*            bytes (keys to send)
+*            length (number of bytes)
+* Return: none.
+*/
+void send_bytes(struct pty_shell* shell, char* bytes, int length) {
+
+    while (length > 0) {
+        ssize_t written = write(shell->master_fd, bytes, length);
+
+        if (written == -1 && errno != EINTR) {
+            perror("write");
+            exit(1);
+        }
+
+        if (written > 0) {
+            bytes += written;
+            length -= written;
+        }
+    }
+}
+
+
+/*
+* Function: wait_for.
+* Reads terminal output until needle appears and discards output up to
+* and including it.
+*
+* Parameter: shell (shell under test)
+*            needle (text to wait for)
+* Return: milliseconds waited. -1 on timeout or end of output.
+*/
+double wait_for(struct pty_shell* shell, char* needle) {
+    double started = now_ms();
+    int needle_length = strlen(needle);
+
+    while (true) {
+        char* found = memmem(shell->output, shell->output_length, needle, needle_length);
+
+        if (found != NULL) {
+            double elapsed = now_ms() - started;
+            int consumed = found - shell->output + needle_length;
+
+            shell->output_length -= consumed;
+            memmove(shell->output, shell->output + consumed, shell->output_length);
+            return elapsed;
+        }
+
+        // Keep the tail in case the needle is split across reads.
+        if (shell->output_length > OUTPUT_LENGTH / 2) {
+            int kept = needle_length - 1;
+
+            memmove(shell->output, shell->output + shell->output_length - kept, kept);
+            shell->output_length = kept;
+        }
+
+        struct pollfd master = { .fd = shell->master_fd, .events = POLLIN };
+        int remaining = WAIT_TIMEOUT_MS - (int) (now_ms() - started);
+
+        if (remaining <= 0 || poll(&master, 1, remaining) <= 0) {
+            return -1;
+        }
+
+        ssize_t bytes_read = read(shell->master_fd, shell->output + shell->output_length,
+                                  OUTPUT_LENGTH - shell->output_length);
+
+        if (bytes_read <= 0) {
+            return -1;
+        }
+
+        shell->output_length += bytes_read;
+    }
+}
+
+
+/*
+* Function: add_sample.
+* Stores one latency. Timeouts are counted separately.
+*
+* Parameter: samples (sample set)
+*            value (milliseconds, or -1 for a timeout)
+* Return: none.
+*/
+void add_sample(struct sample_set* samples, double value) {
+
+    if (value < 0) {
+        samples->timeouts++;
+        return;
+    }
+
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 256;
+        samples->values = realloc(samples->values, samples->capacity * sizeof(double));
+    }
+
+    samples->values[samples->count++] = value;
+}
+
+
+/*
+* Function: compare_doubles.
+* qsort comparison for latencies.
+*
+* Parameter: left, right (pointers to double)
+* Return: negative, zero, or positive.
+*/
+int compare_doubles(const void* left, const void* right) {
+    double a = *(const double*) left;
+    double b = *(const double*) right;
+
+    return (a > b) - (a < b);
+}
+
+
+/*
+* Function: report_samples.
+* Prints percentiles of one sample set.
+*
+* Parameter: samples (sample set)
+* Return: none.
+*/
+void report_samples(struct sample_set* samples) {
+    int count = samples->count;
+
+    if (count == 0) {
+        printf("%s: no samples, %d timeouts\n", samples->name, samples->timeouts);
+        return;
+    }
+
+    qsort(samples->values, count, sizeof(double), compare_doubles);
+
+    printf("%s: ms p50 %.3f p90 %.3f p99 %.3f max %.3f (%d samples, %d timeouts)\n",
+           samples->name, samples->values[count / 2], samples->values[count * 9 / 10],
+           samples->values[count * 99 / 100], samples->values[count - 1], count,
+           samples->timeouts);
+}
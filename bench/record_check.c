@@ -0,0 +1,193 @@
+/* Program: record_check
+ * Description: Regression check for smallsh session recording. Records a session in which
+ *              foreground and background commands fail to exec, then checks that the
+ *              recording has one header and one row per input line, in order, with the
+ *              failed command's status. Forked children must not write to the recording.
+ *
+ * Usage: record_check [-s shell]
+ *
+ * Build: gcc --std=gnu99 -Wall -O2 -o record_check bench/record_check.c
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// Constants.
+#define LINE_LENGTH 4096
+#define FAILED_STATUS 256
+
+// Prototype functions.
+bool run_shell(char* shell_path, char* record_path);
+bool check_recording(char* record_path);
+
+// Global variables.
+char* session_lines[] = {
+    "echo hi",
+    "nosuchcmd_record_check",
+    "nosuchcmd_record_check &",
+    "echo bye",
+    "exit"
+};
+int session_count = sizeof(session_lines) / sizeof(session_lines[0]);
+
+
+/*
+* Main program.
+* Records the session and checks the recording.
+*/
+int main(int argc, char** argv) {
+    char* shell_path = "./smallsh";
+    char record_path[] = "/tmp/record_check.XXXXXX";
+    int option;
+
+    while ((option = getopt(argc, argv, "s:")) != -1) {
+        switch (option) {
+            case 's': shell_path = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-s shell]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    int record_fd = mkstemp(record_path);
+
+    if (record_fd == -1) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+
+    close(record_fd);
+
+    bool is_ok = run_shell(shell_path, record_path) && check_recording(record_path);
+
+    unlink(record_path);
+    printf("record_check: %s\n", is_ok ? "ok" : "FAILED");
+    return is_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/*
+* Function: run_shell.
+* Runs the shell with --record, feeding the session on standard input.
+*
+* Parameter: shell_path (shell program)
+*            record_path (recording to write)
+* Return: false if the shell could not be run.
+*/
+bool run_shell(char* shell_path, char* record_path) {
+    int input[2];
+
+    if (pipe(input) == -1) {
+        perror("pipe");
+        return false;
+    }
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("fork");
+        return false;
+    }
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+
+        dup2(input[0], STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        close(input[0]);
+        close(input[1]);
+        close(null_fd);
+
+        execl(shell_path, shell_path, "--record", record_path, (char*) NULL);
+        perror(shell_path);
+        _exit(1);
+    }
+
+    close(input[0]);
+
+    for (int i = 0; i < session_count; i++) {
+        dprintf(input[1], "%s\n", session_lines[i]);
+    }
+
+    close(input[1]);
+
+    // The background child may still be exiting. Give it time to write
+    // to the recording if it is going to.
+    waitpid(pid, NULL, 0);
+    usleep(200000);
+    return true;
+}
+
+
+/*
+* Function: check_recording.
+* Checks for one header and exactly the session lines, in order, and
+* that the failed foreground command has a failing status.
+*
+* Parameter: record_path (recording written by the shell)
+* Return: true if the recording is right.
+*/
+bool check_recording(char* record_path) {
+    FILE* record_file = fopen(record_path, "r");
+    char line[LINE_LENGTH];
+    int headers = 0;
+    int rows = 0;
+    bool is_ok = true;
+
+    if (record_file == NULL) {
+        perror(record_path);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), record_file) != NULL) {
+        long long delay_ms;
+        long long duration_ms;
+        int status;
+        int offset;
+
+        line[strcspn(line, "\n")] = '\0';
+
+        if (line[0] == '#') {
+            headers++;
+            continue;
+        }
+
+        if (sscanf(line, "%lld\t%lld\t%d\t%n", &delay_ms, &duration_ms, &status, &offset) != 3) {
+            printf("record_check: malformed row: %s\n", line);
+            is_ok = false;
+            continue;
+        }
+
+        if (rows >= session_count || strcmp(line + offset, session_lines[rows]) != 0) {
+            printf("record_check: unexpected row %d: %s\n", rows + 1, line + offset);
+            is_ok = false;
+        } else if (rows == 1 && status != FAILED_STATUS) {
+            printf("record_check: failed command recorded with status %d\n", status);
+            is_ok = false;
+        }
+
+        rows++;
+    }
+
+    fclose(record_file);
+
+    if (headers != 1) {
+        printf("record_check: %d headers, expected 1\n", headers);
+        is_ok = false;
+    }
+
+    if (rows != session_count) {
+        printf("record_check: %d rows, expected %d\n", rows, session_count);
+        is_ok = false;
+    }
+
+    return is_ok;
+}
@@ -0,0 +1,496 @@
+/* Program: stress_jobs
+ * Description: Stress benchmark for smallsh background job tracking. Launches large numbers
+ *              of short-lived and long-lived background jobs through the shell's standard
+ *              input and measures reap latency, shell CPU time, and shell memory per job.
+ *
+ * Usage: stress_jobs [-s shell] [-n short_jobs] [-l long_jobs] [-d long_seconds]
+ *
+ * Build: gcc --std=gnu99 -Wall -O2 -o stress_jobs bench/stress_jobs.c
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// Constants.
+#define READ_CHUNK 65536
+#define STALL_SECONDS 30
+
+/*
+* Structure for one benchmark phase.
+*/
+struct phase {
+    char* name;
+    char* command;
+    int jobs;
+    double expected_ms;
+    int started;
+    int done;
+    int failed;
+    double* latencies;
+};
+
+/*
+* Structure for the running shell under test.
+*/
+struct shell_process {
+    pid_t pid;
+    int input_fd;
+    int output_fd;
+    char* pending_input;
+    size_t pending_length;
+    size_t pending_offset;
+    char line[4096];
+    int line_length;
+};
+
+// Prototype functions.
+double now_ms();
+void start_shell(struct shell_process* shell, char* path);
+void queue_input(struct shell_process* shell, char* text);
+bool pump(struct shell_process* shell, struct phase* current, int timeout_ms);
+void handle_line(struct phase* current, char* line);
+void run_phase(struct shell_process* shell, struct phase* current);
+int compare_doubles(const void* left, const void* right);
+void report_phase(struct phase* current);
+bool read_shell_usage(pid_t pid, double* cpu_ms, long* peak_kb);
+
+// Global variables.
+double* start_times = NULL;
+int max_pid = 0;
+int stalled_phases = 0;
+
+
+/*
+* Main program.
+* Runs the short-lived phase, then the long-lived phase, then reports.
+*/
+int main(int argc, char** argv) {
+    char* shell_path = "./smallsh";
+    int short_jobs = 10000;
+    int long_jobs = 1000;
+    int long_seconds = 2;
+    int option;
+
+    while ((option = getopt(argc, argv, "s:n:l:d:")) != -1) {
+        switch (option) {
+            case 's': shell_path = optarg; break;
+            case 'n': short_jobs = atoi(optarg); break;
+            case 'l': long_jobs = atoi(optarg); break;
+            case 'd': long_seconds = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s shell] [-n short_jobs] [-l long_jobs] "
+                        "[-d long_seconds]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    // Start times are indexed by pid.
+    FILE* pid_file = fopen("/proc/sys/kernel/pid_max", "r");
+
+    if (pid_file == NULL || fscanf(pid_file, "%d", &max_pid) != 1) {
+        max_pid = 4194304;
+    }
+
+    if (pid_file != NULL) {
+        fclose(pid_file);
+    }
+
+    start_times = calloc(max_pid + 1, sizeof(double));
+
+    char long_command[64];
+    snprintf(long_command, sizeof(long_command), "sleep %d &\n", long_seconds);
+
+    struct phase phases[] = {
+        { "short-lived", "true &\n", short_jobs, 0 },
+        { "long-lived", long_command, long_jobs, long_seconds * 1000.0 }
+    };
+
+    struct shell_process shell;
+    start_shell(&shell, shell_path);
+
+    for (int i = 0; i < 2; i++) {
+        run_phase(&shell, &phases[i]);
+        report_phase(&phases[i]);
+    }
+
+    // The shell's own usage, excluding the jobs it reaped.
+    double cpu_ms = 0;
+    long peak_kb = 0;
+    bool has_usage = read_shell_usage(shell.pid, &cpu_ms, &peak_kb);
+
+    // Show the shell's own event loop counters, then end the session.
+    queue_input(&shell, "events\nexit\n");
+
+    while (pump(&shell, NULL, 1000)) {
+    }
+
+    int status;
+    waitpid(shell.pid, &status, 0);
+
+    int total_jobs = phases[0].started + phases[1].started;
+
+    // Memory per job is taken against the concurrent long-lived jobs.
+    if (has_usage) {
+        printf("shell cpu %.1f ms (%.2f us per job), peak rss %ld KB (%.1f bytes per "
+               "concurrent job)\n", cpu_ms, total_jobs ? cpu_ms * 1000.0 / total_jobs : 0.0,
+               peak_kb, phases[1].started ? peak_kb * 1024.0 / phases[1].started : 0.0);
+    }
+
+    return stalled_phases ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/*
+* Function: now_ms.
+* Reads the monotonic clock.
+*
+* Parameter: none.
+* Return: milliseconds as a double.
+*/
+double now_ms() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+
+/*
+* Function: start_shell.
+* Starts the shell with pipes on standard input and output. Standard
+* error shares the output pipe so fork failures are seen.
+*
+* Parameter: shell (pointer to the structure to fill)
+*            path (shell executable)
+* Return: none.
+*/
+void start_shell(struct shell_process* shell, char* path) {
+    int input_pipe[2];
+    int output_pipe[2];
+
+    memset(shell, 0, sizeof(struct shell_process));
+
+    if (pipe(input_pipe) == -1 || pipe(output_pipe) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+
+    shell->pid = fork();
+
+    if (shell->pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+
+    if (shell->pid == 0) {
+        dup2(input_pipe[0], STDIN_FILENO);
+        dup2(output_pipe[1], STDOUT_FILENO);
+        dup2(output_pipe[1], STDERR_FILENO);
+        close(input_pipe[1]);
+        close(output_pipe[0]);
+
+        execl(path, path, (char*) NULL);
+        perror(path);
+        exit(1);
+    }
+
+    close(input_pipe[0]);
+    close(output_pipe[1]);
+
+    shell->input_fd = input_pipe[1];
+    shell->output_fd = output_pipe[0];
+
+    fcntl(shell->input_fd, F_SETFL, O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN);
+}
+
+
+/*
+* Function: queue_input.
+* Appends text to the input still to be written to the shell.
+*
+* Parameter: shell (pointer to the structure)
+*            text (text to send)
+* Return: none.
+*/
+void queue_input(struct shell_process* shell, char* text) {
+    size_t length = strlen(text);
+
+    shell->pending_input = realloc(shell->pending_input, shell->pending_length + length);
+    memcpy(shell->pending_input + shell->pending_length, text, length);
+    shell->pending_length += length;
+}
+
+
+/*
+* Function: pump.
+* Writes pending input and reads shell output once.
+*
+* Parameter: shell (pointer to the structure)
+*            current (phase receiving output lines. NULL to discard)
+*            timeout_ms (poll limit)
+* Return: false once the shell has closed its output. true otherwise.
+*/
+bool pump(struct shell_process* shell, struct phase* current, int timeout_ms) {
+    char buffer[READ_CHUNK];
+    struct pollfd poll_fds[2] = {
+        { .fd = shell->output_fd, .events = POLLIN },
+        { .fd = shell->input_fd, .events = POLLOUT }
+    };
+    bool has_input = shell->pending_offset < shell->pending_length;
+
+    if (poll(poll_fds, has_input ? 2 : 1, timeout_ms) <= 0) {
+        return true;
+    }
+
+    // Feed the shell.
+    if (has_input && (poll_fds[1].revents & POLLOUT)) {
+        ssize_t written = write(shell->input_fd, shell->pending_input + shell->pending_offset,
+                                shell->pending_length - shell->pending_offset);
+
+        if (written > 0) {
+            shell->pending_offset += written;
+        }
+    }
+
+    if (!(poll_fds[0].revents & (POLLIN | POLLHUP))) {
+        return true;
+    }
+
+    ssize_t bytes_read = read(shell->output_fd, buffer, sizeof(buffer));
+
+    if (bytes_read <= 0) {
+        return false;
+    }
+
+    // Split output into lines. Prompts are stripped from line starts.
+    for (ssize_t i = 0; i < bytes_read; i++) {
+        if (buffer[i] != '\n') {
+            if (shell->line_length < (int) sizeof(shell->line) - 1) {
+                shell->line[shell->line_length++] = buffer[i];
+            }
+            continue;
+        }
+
+        shell->line[shell->line_length] = '\0';
+
+        char* line = shell->line;
+
+        while (strncmp(line, ": ", 2) == 0) {
+            line += 2;
+        }
+
+        if (current != NULL) {
+            handle_line(current, line);
+        } else if (*line != '\0') {
+            printf("%s\n", line);
+        }
+
+        shell->line_length = 0;
+    }
+
+    return true;
+}
+
+
+/*
+* Function: handle_line.
+* Records job starts and completions reported by the shell.
+*
+* Parameter: current (phase being measured)
+*            line (one line of shell output)
+* Return: none.
+*/
+void handle_line(struct phase* current, char* line) {
+    int pid;
+    int summarized;
+
+    if (sscanf(line, "background pid is %d", &pid) == 1) {
+        if (pid > 0 && pid <= max_pid) {
+            start_times[pid] = now_ms();
+        }
+        current->started++;
+        return;
+    }
+
+    // Completion. Latency runs from start plus expected run time.
+    if (sscanf(line, "background pid %d is done", &pid) == 1) {
+        if (pid > 0 && pid <= max_pid && start_times[pid] > 0) {
+            double latency = now_ms() - start_times[pid] - current->expected_ms;
+
+            current->latencies[current->done] = latency > 0 ? latency : 0;
+            start_times[pid] = 0;
+        }
+
+        current->done++;
+        return;
+    }
+
+    // Summarized burst. No per-job latency is available.
+    if (sscanf(line, "%d more background jobs are done", &summarized) == 1) {
+        for (int i = 0; i < summarized; i++) {
+            current->latencies[current->done++] = -1;
+        }
+        return;
+    }
+
+    if (strncmp(line, "fork:", 5) == 0) {
+        current->failed++;
+    }
+}
+
+
+/*
+* Function: run_phase.
+* Sends every job of a phase and waits until all started jobs are done.
+*
+* Parameter: shell (pointer to the structure)
+*            current (phase to run)
+* Return: none.
+*/
+void run_phase(struct shell_process* shell, struct phase* current) {
+    double started_at = now_ms();
+    double progress_at = started_at;
+    int last_done = 0;
+
+    current->latencies = calloc(current->jobs + 1, sizeof(double));
+
+    for (int i = 0; i < current->jobs; i++) {
+        queue_input(shell, current->command);
+    }
+
+    while (current->done + current->failed < current->jobs ||
+           current->done < current->started) {
+
+        if (!pump(shell, current, 100)) {
+            break;
+        }
+
+        if (current->done != last_done) {
+            last_done = current->done;
+            progress_at = now_ms();
+        }
+
+        if (now_ms() - progress_at > STALL_SECONDS * 1000.0) {
+            printf("%s: stalled with %d of %d jobs done\n", current->name,
+                   current->done, current->started);
+            stalled_phases++;
+            break;
+        }
+    }
+
+    printf("%s: %d jobs in %.1f ms\n", current->name, current->jobs,
+           now_ms() - started_at);
+}
+
+
+/*
+* Function: compare_doubles.
+* qsort comparator for doubles.
+*/
+int compare_doubles(const void* left, const void* right) {
+    double a = *(const double*) left;
+    double b = *(const double*) right;
+
+    return (a > b) - (a < b);
+}
+
+
+/*
+* Function: report_phase.
+* Prints the reap latency distribution of a phase.
+*
+* Parameter: current (phase to report)
+* Return: none.
+*/
+void report_phase(struct phase* current) {
+    int measured = 0;
+
+    // Drop summarized jobs, which carry no latency.
+    for (int i = 0; i < current->done; i++) {
+        if (current->latencies[i] >= 0) {
+            current->latencies[measured++] = current->latencies[i];
+        }
+    }
+
+    qsort(current->latencies, measured, sizeof(double), compare_doubles);
+
+    printf("%s: started %d, done %d, fork failures %d\n", current->name,
+           current->started, current->done, current->failed);
+
+    if (measured > 0) {
+        printf("%s: reap latency ms p50 %.2f p90 %.2f p99 %.2f max %.2f (%d measured)\n",
+               current->name, current->latencies[measured / 2],
+               current->latencies[measured * 9 / 10], current->latencies[measured * 99 / 100],
+               current->latencies[measured - 1], measured);
+    }
+}
+
+
+/*
+* Function: read_shell_usage.
+* Reads CPU time and peak resident memory of the shell from /proc.
+* Unlike wait4, this excludes the children the shell has reaped.
+*
+* Parameter: pid (process id of the shell)
+*            cpu_ms (output user plus system time)
+*            peak_kb (output peak resident set size)
+* Return: true if both values were read. false otherwise.
+*/
+bool read_shell_usage(pid_t pid, double* cpu_ms, long* peak_kb) {
+    char path[64];
+    char buffer[4096];
+    unsigned long user_ticks;
+    unsigned long system_ticks;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* stat_file = fopen(path, "r");
+
+    if (stat_file == NULL) {
+        return false;
+    }
+
+    bool is_read = fgets(buffer, sizeof(buffer), stat_file) != NULL;
+
+    fclose(stat_file);
+
+    if (!is_read) {
+        return false;
+    }
+
+    // Fields after the command name, which may contain spaces.
+    char* fields = strrchr(buffer, ')');
+
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                                 "%lu %lu", &user_ticks, &system_ticks) != 2) {
+        return false;
+    }
+
+    *cpu_ms = (user_ticks + system_ticks) * 1000.0 / sysconf(_SC_CLK_TCK);
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE* status_file = fopen(path, "r");
+
+    if (status_file == NULL) {
+        return false;
+    }
+
+    while (fgets(buffer, sizeof(buffer), status_file) != NULL) {
+        sscanf(buffer, "VmHWM: %ld", peak_kb);
+    }
+
+    fclose(status_file);
+    return true;
+}
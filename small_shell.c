@@ -5,6 +5,8 @@
  *              and a toggle for running commands in either foreground or background.                           
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>      
 #include <stdbool.h>    
 #include <stdlib.h>     
@@ -14,11 +16,383 @@
 #include <sys/wait.h>   
 #include <fcntl.h>      
 #include <signal.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#include <sys/signalfd.h>
+#include <termios.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
 
 // Constants.
 #define INPUT_LENGTH 2048
 #define MAX_ARGS 512
 
+// CPU placement policies for spawned jobs.
+#define AFFINITY_UNSET 0
+#define AFFINITY_OFF 1
+#define AFFINITY_CORE 2
+#define AFFINITY_NODE 3
+
+// Pressure resources watched by admission control.
+#define PRESSURE_CPU 0
+#define PRESSURE_MEMORY 1
+#define PRESSURE_IO 2
+#define PRESSURE_COUNT 3
+
+// PSI trigger window and admission recheck interval in milliseconds.
+#define PRESSURE_WINDOW_MS 2000
+#define ADMISSION_TICK_MS 250
+
+// Event loop backends, event sources, and limits.
+#define EVENTS_EPOLL 0
+#define EVENTS_URING 1
+#define EVENT_INPUT 1
+#define EVENT_PRESSURE 2
+#define EVENT_CHILD 3
+#define MAX_WATCHES 64
+#define MAX_EVENTS 64
+#define URING_ENTRIES 256
+
+// Completions shown one per line before the rest are summarized, and
+// the shortest gap between notices so bursts share one redraw.
+#define NOTICE_LIMIT 16
+#define NOTICE_INTERVAL_MS 50
+
+// Background job states and the arena size kept before compaction.
+#define JOB_RUNNING 0
+#define JOB_PREDICTED 0x01
+#define JOB_DISOWNED 0x02
+#define JOB_DETACHED 0x04
+#define ARENA_MINIMUM 65536
+
+// Write-behind: default flush window and how often output is checked.
+#define WRITE_BEHIND_WINDOW (8 << 20)
+#define WRITE_BEHIND_TICK_MS 100
+#define READAHEAD_CHUNK (2 << 20)
+
+// Compressed redirections: file magic, block size, blocks compressed
+// at once, and the hash table size of the LZ matcher.
+#define CODEC_MAGIC "SLZ1"
+#define CODEC_BLOCK (1 << 20)
+#define CODEC_MAX_THREADS 16
+#define CODEC_HASH_BITS 14
+
+// Checksum algorithms, the largest digest, and the default tree chunk.
+#define HASH_CRC32C 0
+#define HASH_XXH64 1
+#define HASH_MURMUR3 2
+#define HASH_SHA256 3
+#define HASH_COUNT 4
+#define HASH_MAX_DIGEST 32
+#define TREE_CHUNK (4 << 20)
+#define TREE_MAX_THREADS 64
+
+// Directory reads and parallel file tree operations.
+#define DIRENT_BUFFER (64 << 10)
+#define COPY_MAX_THREADS 64
+#define WALK_MAX_THREADS 64
+#define DIR_CACHE_SIZE 8
+
+// File commands with more arguments than the threshold submit them to
+// io_uring, with at most BATCH_DEPTH operations in flight.
+#define BATCH_THRESHOLD 32
+#define BATCH_DEPTH 128
+#define FILE_RING_ENTRIES 256
+#define BATCH_CLOSE BATCH_DEPTH
+
+// ls: initial directory buffer, and owner names remembered.
+#define LISTING_BUFFER (256 << 10)
+#define OWNER_CACHE_SIZE 16
+
+// Shell message buffer: text bytes and writev segments per flush.
+#define OUTPUT_BYTES 65536
+#define OUTPUT_SEGMENTS 64
+
+// Job queues for background submissions.
+#define DEFAULT_QUEUE 0
+#define MAX_QUEUES 32
+
+// Order in which queued jobs leave their queue.
+#define ORDER_FIFO 0
+#define ORDER_SHORTEST 1
+#define ORDER_LONGEST 2
+
+// Duration model size and smoothing. The mean becomes a moving
+// average over roughly the last DURATION_WINDOW runs.
+#define MAX_DURATION_ENTRIES 4096
+#define DURATION_WINDOW 10
+#define DURATION_BUCKETS 8192
+
+/*
+* Structure for scheduling priorities applied to a job before exec.
+*/
+struct job_priority {
+    bool has_nice;
+    int nice;
+    int ioprio_class;
+    int ioprio_level;
+    bool has_sched;
+    int sched_policy;
+};
+
+/*
+* Structure for resource limits applied to a job before exec.
+*/
+struct job_limits {
+    bool is_set[RLIM_NLIMITS];
+    rlim_t values[RLIM_NLIMITS];
+};
+
+/*
+* Structure describing one limit for ulimit and the limits= prefix.
+*/
+struct limit_name {
+    char option;
+    char* name;
+    int resource;
+    rlim_t unit;
+    char* description;
+};
+
+/*
+* Structure for a compressed redirection. A shell thread moves data
+* between the job's pipe and the file, compressing or decompressing
+* blocks on several threads.
+*/
+struct codec_stream {
+    pid_t pid;
+    bool is_compressing;
+    int pipe_fd;
+    int child_fd;
+    int file_fd;
+    char* path;
+    bool is_failed;
+    pthread_t thread;
+    struct codec_stream* next;
+};
+
+/*
+* Structure for one block handed to a codec worker thread.
+*/
+struct codec_block {
+    unsigned char* input;
+    size_t input_length;
+    unsigned char* output;
+    size_t output_length;
+    size_t output_capacity;
+    bool is_valid;
+};
+
+/*
+* Structure for a tree hash: chunks of one mapped file hashed by
+* several threads, each taking the next unclaimed chunk.
+*/
+struct tree_hash {
+    int algorithm;
+    const unsigned char* data;
+    size_t length;
+    size_t chunk_size;
+    size_t chunk_count;
+    size_t next_chunk;
+    unsigned char* digests;
+};
+
+/*
+* Structure for a directory entry as returned by getdents64.
+*/
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+* Structure for a copied directory. Its mode and times are set after
+* everything inside it has been copied.
+*/
+struct copy_directory {
+    char* target;
+    mode_t mode;
+    struct timespec times[2];
+};
+
+/*
+* Structure for a parallel copy. The shell thread walks the sources,
+* creates directories, and queues files. Workers copy the files.
+*/
+struct copy_pool {
+    char** sources;
+    char** targets;
+    size_t count;
+    size_t capacity;
+    size_t next;
+    bool is_walked;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct copy_directory* directories;
+    size_t directory_count;
+    size_t directory_capacity;
+    size_t files;
+    size_t reflinked;
+    unsigned long long bytes;
+    size_t errors;
+};
+
+/*
+* Structure for a directory waiting to be walked by prm or pdu. It is
+* opened by name relative to its parent's descriptor, which stays open
+* until pending, its own scan and its unfinished subdirectories, reaches
+* zero. prm then removes it. The path is only for messages.
+*/
+struct walk_directory {
+    char* path;
+    char* name;
+    int parent_fd;
+    int fd;
+    struct walk_directory* parent;
+    int pending;
+    int root;
+};
+
+/*
+* Structure for one worker's directories. The owner takes the newest,
+* so it walks depth first, and idle workers steal the oldest.
+*/
+struct walk_queue {
+    struct walk_directory** items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+    pthread_mutex_t lock;
+};
+
+/*
+* Structure for a parallel walk. Outstanding counts directories queued
+* or being scanned, and the walk ends when it reaches zero. Files with
+* several links are counted once, by device and inode.
+*/
+struct walk_pool {
+    char* name;
+    bool is_removing;
+    bool is_forced;
+    int threads;
+    struct walk_queue queues[WALK_MAX_THREADS];
+    size_t outstanding;
+    size_t files;
+    size_t directories;
+    size_t errors;
+    unsigned long long* blocks;
+    pthread_mutex_t link_lock;
+    uint64_t* links;
+    size_t link_count;
+    size_t link_capacity;
+};
+
+/*
+* Structure for a walk worker.
+*/
+struct walk_worker {
+    struct walk_pool* pool;
+    int index;
+};
+
+/*
+* Structure for one batched operation: the argument it is for, the
+* directory and name it works on, and room for a statx result.
+*/
+struct batch_slot {
+    int argument;
+    int dir_fd;
+    int target_fd;
+    char name[INPUT_LENGTH];
+    struct statx status;
+};
+
+/*
+* Structure for a file command running on io_uring. Completions are
+* handled as they arrive, and follow-up work such as setting times on
+* a file that already existed is done then.
+*/
+struct file_batch {
+    char* command;
+    int opcode;
+    bool* flags;
+    mode_t mode;
+    bool is_exact;
+    char* mode_text;
+    struct command_line* current_command;
+    struct dir_cache* cache;
+    struct batch_slot* slots;
+    int free_slots[BATCH_DEPTH];
+    int free_count;
+    int in_flight;
+    bool* retry;
+    bool is_ok;
+};
+
+/*
+* Structure for ls output, built up and written at once.
+*/
+struct listing_output {
+    char* data;
+    size_t length;
+    size_t capacity;
+};
+
+/*
+* Structure for directories opened by one file command, so arguments
+* in the same directory share one descriptor. Dropped when the command
+* ends, so a directory renamed in between is never used by mistake.
+* The entry returned last is never the one replaced, so a source and a
+* target directory can be held at once. Batched operations still in
+* flight finish before any entry is closed.
+*/
+struct dir_cache {
+    char* paths[DIR_CACHE_SIZE];
+    int fds[DIR_CACHE_SIZE];
+    int count;
+    int next;
+    int last;
+    struct file_batch* batch;
+};
+
+/*
+* Structure for redirection hints. Output: space to preallocate, the
+* write-behind window, and whether written pages are dropped. Input:
+* bytes to read ahead, and whether consumed pages are dropped.
+*/
+struct io_hints {
+    off_t prealloc;
+    off_t window;
+    bool is_dropping;
+    off_t readahead;
+    bool is_uncached;
+};
+
 /* 
 * Structure for command line inputs.
 */
@@ -26,8 +400,260 @@ struct command_line {
     char* arg_variables[MAX_ARGS + 1];
     int arg_count;
     char* input_file;
+    struct io_hints input_hints;
+    bool is_input_open;
+    int input_fd;
     char* output_file;
+    bool is_compressed_input;
+    bool is_compressed_output;
+    struct codec_stream* input_codec;
+    struct codec_stream* output_codec;
+    bool is_atomic_output;
+    int atomic_fd;
+    char* atomic_temp;
+    struct io_hints output_hints;
     bool is_background;
+    bool is_detached;
+    int affinity_policy;
+    struct job_priority priority;
+    struct job_limits limits;
+    char* queue_name;
+    bool is_invalid;
+    int queue_index;
+    bool is_admitted;
+    int model_index;
+    double predicted_ms;
+    bool is_predicted;
+    long long started_at;
+    struct command_line* next;
+};
+
+/*
+* Structure for session recording and replay. Each recorded line holds
+* the think time before it, the time until the next prompt, the wait
+* status afterwards, and the input line, separated by tabs.
+*/
+struct session_log {
+    FILE* record_file;
+    FILE* replay_file;
+    double speed;
+    long long prompt_at;
+    long long line_at;
+    bool has_line;
+    char line[INPUT_LENGTH];
+    bool has_expected;
+    long long expected_ms;
+    int expected_status;
+    long long* deltas;
+    int delta_count;
+    int delta_capacity;
+    int status_mismatches;
+    long long recorded_total;
+    long long replayed_total;
+};
+
+/*
+* Structure for a redirected file that the shell works on while a job
+* runs: flushing and dropping output behind the writer, or dropping
+* input pages the reader has consumed.
+*/
+struct io_stream {
+    pid_t pid;
+    int fd;
+    bool is_input;
+    struct io_hints hints;
+    off_t flushed;
+    off_t dropped;
+    struct io_stream* next;
+};
+
+/*
+* Structure for atomic output held open until its background job ends.
+*/
+struct atomic_output {
+    pid_t pid;
+    int fd;
+    char* temp_path;
+    char* target_path;
+    struct atomic_output* next;
+};
+
+/*
+* Structure for a detached job record read from the state directory.
+*/
+struct detached_record {
+    pid_t pid;
+    unsigned long long start_time;
+    char command[INPUT_LENGTH];
+    bool has_status;
+    int status;
+};
+
+/*
+* Structure for running background jobs, stored as parallel arrays so
+* scans over thousands of jobs touch only the fields they need. Job i
+* is element i of every array. Command text lives in one arena.
+*/
+struct job_table {
+    int count;
+    int capacity;
+    pid_t* pids;
+    unsigned char* states;
+    long long* started_at;
+    int* queue_indexes;
+    int* model_indexes;
+    double* predicted_ms;
+    unsigned* text_offsets;
+    unsigned* text_lengths;
+    char* arena;
+    unsigned arena_length;
+    unsigned arena_capacity;
+    unsigned arena_garbage;
+    int* index;
+    int index_size;
+};
+
+/*
+* Structure for one entry of the learned duration model.
+* Keyed by argv[0] and the shape of the remaining arguments.
+*/
+struct duration_entry {
+    char* key;
+    long runs;
+    double mean_ms;
+    long predictions;
+    double error_ms;
+    double actual_ms;
+    int hash_next;
+};
+
+/*
+* Structure for a named job queue. Queues share launch slots by
+* deficit round-robin in proportion to their weights.
+*/
+struct job_queue {
+    char* name;
+    int weight;
+    int max_running;
+    int running;
+    int deficit;
+    struct command_line* head;
+    struct command_line* tail;
+    int depth;
+};
+
+/*
+* Structure for an io_uring instance mapped into the shell.
+* Set up with raw system calls so the shell needs no extra library.
+*/
+struct uring {
+    int ring_fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned entries;
+    unsigned queued;
+    unsigned features;
+};
+
+/*
+* Structure for a file descriptor watched by the event loop. The
+* generation tells its io_uring completions from those of an earlier
+* watch on a reused descriptor number. A failed poll is reported once
+* and not armed again until the watch is removed or added again.
+*/
+struct event_watch {
+    int fd;
+    int events;
+    int tag;
+    unsigned generation;
+    bool is_armed;
+    bool is_failed;
+};
+
+/*
+* Structure for an event returned by the event loop.
+*/
+struct shell_event {
+    int fd;
+    int tag;
+    int revents;
+};
+
+/*
+* Structure for the shell's event loop. Watches are level-triggered in
+* both backends. With io_uring, one-shot polls are re-armed and the wait
+* is entered in the same system call.
+*/
+struct event_loop {
+    int backend;
+    int epoll_fd;
+    struct uring ring;
+    struct event_watch watches[MAX_WATCHES];
+    int watch_count;
+    unsigned generation;
+    long long waits;
+    long long delivered;
+};
+
+/*
+* Structure for the prompt's line editor. On a terminal the shell reads
+* keys itself so it can redraw the prompt and the partly typed line
+* after printing job notifications.
+*/
+struct line_editor {
+    bool is_terminal;
+    bool is_raw;
+    struct termios saved_mode;
+    char line[INPUT_LENGTH];
+    int length;
+    int escape_state;
+    bool prompt_active;
+    bool notice_open;
+};
+
+/*
+* Structure for shell-generated messages. Messages produced in one loop
+* iteration are collected here and written with a single writev.
+*/
+struct output_buffer {
+    char text[OUTPUT_BYTES];
+    int text_length;
+    struct iovec segments[OUTPUT_SEGMENTS];
+    int segment_count;
+};
+
+/*
+* Structure for pressure-based admission of background jobs.
+* Jobs wait in a FIFO queue while any PSI average exceeds its limit.
+*/
+struct admission_control {
+    bool enabled;
+    double limits[PRESSURE_COUNT];
+    int trigger_fds[PRESSURE_COUNT];
+    long long triggered_at;
+    int burst;
+};
+
+/*
+* Structure for CPU topology used by job placement.
+*/
+struct cpu_topology {
+    bool loaded;
+    cpu_set_t shell_mask;
+    int cpus[CPU_SETSIZE];
+    int cpu_count;
+    cpu_set_t node_masks[64];
+    int node_count;
+    int reserved_cpu;
+    int next_cpu;
+    int next_node;
 };
 
 // Prototype functions.
@@ -39,19 +665,279 @@ void file_redirection(struct command_line* current_command);
 void manage_child_process(struct command_line* current_command, pid_t spawnpid);
 void background_tracker();
 void handle_signal_tstp(int signo); 
+bool parse_prefix(struct command_line* current_command, char* token);
+char* redirect_target(struct command_line* current_command, char* operator);
+int parse_affinity_policy(char* name);
+void load_cpu_topology();
+bool parse_cpu_list(char* path, cpu_set_t* mask);
+bool job_placement(struct command_line* current_command, cpu_set_t* mask);
+void affinity_command(struct command_line* current_command);
+bool parse_priority(struct job_priority* priority, char* token);
+bool is_priority_setting(char* token);
+void apply_priority(struct command_line* current_command);
+void bgpolicy_command(struct command_line* current_command);
+bool read_line(char* buffer, int size);
+void wait_for_input(long long deadline);
+bool parse_options(int argc, char* argv[]);
+bool replay_line(char* buffer, int size);
+void session_line(char* line);
+void session_outcome();
+int compare_deltas(const void* left, const void* right);
+void session_finish();
+long long monotonic_ms();
+bool start_thread(pthread_t* thread, void* (*body)(void*), void* argument);
+char* command_text(struct command_line* current_command);
+void add_background_job(pid_t pid, struct command_line* current_command);
+int remove_background_job(pid_t pid, int child_status);
+unsigned hash_pid(pid_t pid);
+unsigned hash_text(char* text);
+int find_background_job(pid_t pid);
+void index_background_job(pid_t pid, int job_index);
+void unindex_background_job(pid_t pid);
+void grow_job_table();
+void store_job_text(int job_index, struct command_line* current_command);
+void compact_job_arena();
+void terminate_background_jobs();
+char* state_directory();
+unsigned long long process_start_time(pid_t pid);
+void open_capture_file();
+void write_detached_record(pid_t pid, struct command_line* current_command);
+void finish_detached_record(pid_t pid, int child_status);
+bool read_detached_record(pid_t pid, struct detached_record* record);
+bool detached_is_running(struct detached_record* record);
+void list_detached_jobs(bool is_cleaning);
+void disown_command(struct command_line* current_command);
+bool copy_capture(int capture_fd);
+void attach_command(struct command_line* current_command);
+bool open_atomic_output(struct command_line* current_command);
+void publish_atomic_output(int fd, char* temp_path, char* target_path, int child_status);
+void hold_atomic_output(pid_t pid, struct command_line* current_command);
+void finish_atomic_output(pid_t pid, int child_status);
+bool parse_io_hints(struct command_line* current_command, char* token);
+void apply_output_hints(struct command_line* current_command, int fd);
+struct io_stream* open_output_stream(struct command_line* current_command);
+void write_behind(struct io_stream* stream, bool is_final);
+void io_streams_tick();
+void finish_io_streams(pid_t pid);
+struct io_stream* open_input_stream(struct command_line* current_command);
+void drop_behind_reader(struct io_stream* stream, bool is_final);
+size_t lz_compress(const unsigned char* input, size_t length, unsigned char* output);
+bool lz_decompress(const unsigned char* input, size_t length, unsigned char* output,
+                   size_t expected);
+void* codec_worker(void* argument);
+void run_codec_blocks(struct codec_block* blocks, int count, bool is_compressing);
+bool read_full(int fd, void* buffer, size_t length, size_t* done);
+bool write_full(int fd, const void* buffer, size_t length);
+void* compress_stream(void* argument);
+void* decompress_stream(void* argument);
+struct codec_stream* open_codec_stream(char* path, bool is_compressing);
+bool open_codec_streams(struct command_line* current_command);
+void start_codec_streams(struct command_line* current_command, pid_t pid);
+bool finish_codec_streams(pid_t pid);
+void detect_hash_acceleration();
+uint32_t crc32c_software(uint32_t crc, const unsigned char* data, size_t length);
+uint32_t crc32c_hardware(uint32_t crc, const unsigned char* data, size_t length);
+uint64_t xxh64(const unsigned char* data, size_t length);
+void murmur3_128(const unsigned char* data, size_t length, uint64_t* high, uint64_t* low);
+void sha256_blocks_software(uint32_t* state, const unsigned char* data, size_t blocks);
+void sha256_blocks_hardware(uint32_t* state, const unsigned char* data, size_t blocks);
+void sha256(const unsigned char* data, size_t length, unsigned char* digest);
+int hash_buffer(int algorithm, const unsigned char* data, size_t length,
+                unsigned char* digest);
+void* tree_hash_worker(void* argument);
+int tree_hash(int algorithm, const unsigned char* data, size_t length, size_t chunk_size,
+              int threads, unsigned char* digest);
+bool checksum_file(char* path, int algorithm, bool is_tree, size_t chunk_size, int threads);
+void checksum_command(struct command_line* current_command);
+int read_directory(int dir_fd, char* buffer, size_t size);
+int entry_type(int dir_fd, struct linux_dirent64* entry);
+char* join_path(const char* directory, const char* name);
+bool copy_file_data(int source_fd, int target_fd);
+void copy_error(struct copy_pool* pool, const char* path);
+void copy_file(struct copy_pool* pool, char* source, char* target);
+void* copy_worker(void* argument);
+void queue_copy(struct copy_pool* pool, char* source, char* target);
+void copy_tree(struct copy_pool* pool, char* source, char* target, int type);
+void pcp_command(struct command_line* current_command);
+void walk_push(struct walk_queue* queue, struct walk_directory* directory);
+struct walk_directory* walk_take(struct walk_queue* queue, bool is_stealing);
+void walk_error(struct walk_pool* pool, const char* path, const char* name);
+bool first_link(struct walk_pool* pool, uint64_t device, uint64_t inode);
+void finish_walk_directory(struct walk_pool* pool, struct walk_directory* directory);
+void walk_scan(struct walk_worker* worker, struct walk_directory* directory);
+void* walk_worker(void* argument);
+void walk_command(struct command_line* current_command, bool is_removing);
+size_t walk_paths(char* name, char** paths, int path_count, int threads, bool is_removing,
+                  bool is_quiet, bool is_forced);
+void last_component(const char* path, char* name);
+int cached_directory(struct dir_cache* cache, const char* path);
+int parent_directory(struct dir_cache* cache, const char* path, char* name);
+void close_dir_cache(struct dir_cache* cache);
+bool parse_file_options(struct command_line* current_command, const char* options,
+                        bool* flags, char** value, int* first);
+bool parse_mode(const char* text, mode_t old_mode, bool is_directory, mode_t* mode);
+void file_error(const char* command, const char* path);
+bool make_directory(struct dir_cache* cache, const char* path, mode_t mode, bool is_exact,
+                    bool is_parents);
+bool mkdir_command(struct command_line* current_command);
+bool touch_command(struct command_line* current_command);
+bool mv_command(struct command_line* current_command);
+bool ln_command(struct command_line* current_command);
+bool chmod_command(struct command_line* current_command);
+bool rm_command(struct command_line* current_command);
+bool file_command(struct command_line* current_command);
+bool file_ring_ready(int opcode);
+bool batch_begin(struct file_batch* batch, struct dir_cache* cache,
+                 struct command_line* current_command, char* command, int opcode, bool* flags,
+                 int count);
+struct batch_slot* batch_slot(struct file_batch* batch, int argument);
+struct io_uring_sqe* batch_prepare(struct file_batch* batch, struct batch_slot* slot);
+void batch_complete(struct file_batch* batch, int slot_index, int result);
+void batch_reap(struct file_batch* batch, unsigned wait_count);
+bool batch_finish(struct file_batch* batch);
+void listing_printf(struct listing_output* output, const char* format, ...);
+void radix_sort(char** names, char** scratch, size_t count, size_t depth);
+char** read_entries(int dir_fd, bool is_all, bool is_almost_all, size_t* count,
+                    char** storage);
+void stat_entries(int dir_fd, char** names, size_t count, struct statx* status, bool* has_status);
+char* owner_name(unsigned id, bool is_group);
+int display_width(const char* name);
+void format_long(struct listing_output* output, int dir_fd, char** names, size_t count,
+                 bool is_total);
+void format_columns(struct listing_output* output, char** names, size_t count, bool is_columns);
+bool ls_command(struct command_line* current_command);
+char* duration_key(struct command_line* current_command);
+int find_duration_entry(char* key, bool create);
+void predict_duration(struct command_line* current_command);
+void record_duration(int model_index, double predicted_ms, bool is_predicted,
+                     long long started_at, int child_status);
+char* duration_file_path();
+void load_duration_model();
+void save_duration_model();
+void durations_command(struct command_line* current_command);
+bool parse_limit_value(char* text, rlim_t unit, rlim_t* value);
+bool parse_limits(struct job_limits* limits, char* list);
+void apply_limits(struct command_line* current_command);
+void ulimit_command(struct command_line* current_command);
+void jobs_command(struct command_line* current_command);
+bool read_pressure(int resource, double* average);
+bool under_pressure();
+void schedule_jobs();
+int find_queue(char* name, bool create);
+bool queue_has_room(int queue_index);
+void enqueue_command(struct command_line* current_command);
+struct command_line* dequeue_command(int queue_index);
+void queue_command(struct command_line* current_command);
+void open_pressure_triggers();
+void close_pressure_triggers();
+void admission_command(struct command_line* current_command);
+bool uring_setup(struct uring* ring, unsigned entries);
+struct io_uring_sqe* uring_get_sqe(struct uring* ring);
+int uring_enter(struct uring* ring, unsigned wait_count, int timeout_ms);
+struct io_uring_cqe* uring_peek_cqe(struct uring* ring);
+void uring_advance_cqe(struct uring* ring);
+void events_init();
+void events_watch(int fd, int events, int tag);
+void events_unwatch(int fd);
+int events_wait(struct shell_event* ready, int max_events, int timeout_ms);
+void events_command();
+void child_events_init();
+void drain_child_events(int signal_fd);
+void editor_init();
+void editor_raw_mode(bool is_raw);
+void editor_restore();
+bool editor_key(char key);
+void begin_notice();
+void end_notice();
+void shell_printf(const char* format, ...);
+void shell_append(const char* data, int length, bool is_copied);
+void shell_flush();
 
 // Global variables. 
 int latest_status = 0;
 int foreground_only = 0;
+int default_affinity = AFFINITY_OFF;
+struct cpu_topology topology = { .reserved_cpu = -1 };
+struct job_priority background_priority = {0};
+bool input_closed = false;
+struct job_table background_jobs = {0};
+struct admission_control admission = {
+    .limits = { 80.0, 20.0, 40.0 },
+    .trigger_fds = { -1, -1, -1 },
+    .burst = 4
+};
+char* pressure_names[PRESSURE_COUNT] = { "cpu", "memory", "io" };
+struct job_queue job_queues[MAX_QUEUES] = {
+    { .name = "default", .weight = 1 }
+};
+int job_queue_count = 1;
+int queued_job_count = 0;
+int max_background_jobs = 0;
+int next_queue = 0;
+int queue_order = ORDER_FIFO;
+struct event_loop event_loop = { .epoll_fd = -1, .ring = { .ring_fd = -1 } };
+struct line_editor editor = {0};
+bool children_pending = false;
+struct output_buffer shell_output = {0};
+struct session_log session = { .speed = 1.0 };
+struct atomic_output* pending_outputs = NULL;
+struct io_stream* io_streams = NULL;
+struct codec_stream* codec_streams = NULL;
+int codec_threads = 0;
+char* hash_names[HASH_COUNT] = { "crc32c", "xxh64", "murmur3", "sha256" };
+bool has_crc32c_instruction = false;
+bool has_sha_instructions = false;
+bool is_hash_detected = false;
+struct uring file_ring = { .ring_fd = -1 };
+int file_ring_state = 0;
+bool file_ring_ops[256];
+uint32_t crc32c_table[256];
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+long long last_notice_at = 0;
+struct duration_entry* duration_entries = NULL;
+int duration_entry_count = 0;
+int duration_entry_capacity = 0;
+bool duration_model_loaded = false;
+bool duration_model_changed = false;
+int duration_buckets[DURATION_BUCKETS];
+double duration_mean_total = 0;
+int duration_known_count = 0;
+struct job_limits default_limits = {0};
+struct limit_name limit_names[] = {
+    { 'c', "core", RLIMIT_CORE, 1024, "core file size (KB)" },
+    { 'd', "data", RLIMIT_DATA, 1024, "data segment size (KB)" },
+    { 'f', "fsize", RLIMIT_FSIZE, 1024, "file size (KB)" },
+    { 'l', "memlock", RLIMIT_MEMLOCK, 1024, "locked memory (KB)" },
+    { 'n', "nofile", RLIMIT_NOFILE, 1, "open files" },
+    { 's', "stack", RLIMIT_STACK, 1024, "stack size (KB)" },
+    { 't', "cpu", RLIMIT_CPU, 1, "cpu time (seconds)" },
+    { 'u', "nproc", RLIMIT_NPROC, 1, "processes" },
+    { 'v', "as", RLIMIT_AS, 1024, "virtual memory (KB)" },
+    { 0, NULL, 0, 0, NULL }
+};
 
 
 /*
 * Main program.
 * Prompts user for shell commands.
+* Options: --record FILE, --replay FILE, --speed X.
 */
-int main() {
+int main(int argc, char* argv[]) {
     struct command_line* current_command;
 
+    if (!parse_options(argc, argv)) {
+        return EXIT_FAILURE;
+    }
+
     // Ignore SIGINT in the shell.
     struct sigaction SIGINT_action = {0};
     SIGINT_action.sa_handler = SIG_IGN;
@@ -66,6 +952,21 @@ int main() {
     SIGTSTP_action.sa_flags = SA_RESTART;
     sigaction(SIGTSTP, &SIGTSTP_action, NULL);
 
+    // Persist learned durations however the shell exits.
+    atexit(save_duration_model);
+    atexit(shell_flush);
+    atexit(session_finish);
+
+    // Set up the event loop used at the prompt.
+    events_init();
+    child_events_init();
+    editor_init();
+
+    // Replayed lines do not come from standard input.
+    if (session.replay_file != NULL) {
+        events_unwatch(STDIN_FILENO);
+    }
+
     while(true) {
         
         // Checks for completed background child processes.
@@ -76,6 +977,11 @@ int main() {
 
         // Handle null from parser.  
         if (current_command == NULL) {
+
+            // End of input. Leave the shell.
+            if (input_closed) {
+                break;
+            }
             continue;   
         }
 
@@ -88,6 +994,13 @@ int main() {
         exec_commands(current_command);
     }
 
+    // Input ended. Launch jobs still waiting in queues.
+    while (queued_job_count > 0) {
+        poll(NULL, 0, ADMISSION_TICK_MS);
+        background_tracker();
+        schedule_jobs();
+    }
+
     return EXIT_SUCCESS;
 }
 
@@ -102,12 +1015,36 @@ int main() {
 struct command_line* parse_input() {
     char input_buffer[INPUT_LENGTH]; 
 
-    // Print shell command prompt. 
-    printf(": ");
-    fflush(stdout);
+    // The previous line is complete. Log how it went.
+    session_outcome();
+
+    // Hold SIGTSTP until the prompt is drawn and marked active, so a
+    // Ctrl+Z typed the moment the prompt appears still redraws it.
+    sigset_t tstp_signal;
+    sigemptyset(&tstp_signal);
+    sigaddset(&tstp_signal, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &tstp_signal, NULL);
+
+    if (session.replay_file == NULL) {
+        editor_raw_mode(true);
+    }
+
+    // Print shell command prompt with any pending messages.
+    shell_printf(": ");
+    shell_flush();
 
     // Get user input.
-    fgets(input_buffer, INPUT_LENGTH, stdin);
+    editor.prompt_active = true;
+    sigprocmask(SIG_UNBLOCK, &tstp_signal, NULL);
+
+    bool has_line = read_line(input_buffer, INPUT_LENGTH);
+    editor.prompt_active = false;
+
+    if (!has_line) {
+        return NULL;
+    }
+
+    session_line(input_buffer);
 
     // Handle blank and comment inputs.
     if (input_buffer[0] == '\n' || input_buffer[0] == '#') {
@@ -130,6 +1067,23 @@ struct command_line* parse_input() {
         } else if (!strcmp(token, ">")) {
         current_command->output_file = strdup(strtok(NULL," \n"));
 
+        // Compressed output and input, handled by shell threads.
+        } else if (!strcmp(token, ">z")) {
+        free(current_command->output_file);
+        current_command->output_file = redirect_target(current_command, token);
+        current_command->is_compressed_output = true;
+
+        } else if (!strcmp(token, "<z")) {
+        free(current_command->input_file);
+        current_command->input_file = redirect_target(current_command, token);
+        current_command->is_compressed_input = true;
+
+        // Output appears at the target only if the command succeeds.
+        } else if (!strcmp(token, ">~")) {
+        free(current_command->output_file);
+        current_command->output_file = redirect_target(current_command, token);
+        current_command->is_atomic_output = true;
+
         } else if (!strcmp(token, "&")) {
 
             // Check if foreground only mode is toggled.
@@ -137,6 +1091,10 @@ struct command_line* parse_input() {
                 current_command->is_background = true;
             }
 
+        // Job prefixes such as affinity=core precede the command name.
+        } else if (current_command->arg_count == 0 &&
+                   parse_prefix(current_command, token)) {
+
         } else {
         current_command->arg_variables[current_command->arg_count++] = strdup(token);
         }   
@@ -146,10 +1104,126 @@ struct command_line* parse_input() {
 
         token=strtok(NULL," \n");
     }
+
+    // A job prefix with a bad value, or a redirection without a file,
+    // rejects the whole line.
+    if (current_command->is_invalid) {
+        latest_status = 1 << 8;
+        empty_heap_memory(current_command);
+        return NULL;
+    }
+
+    // Handle lines with no command name.
+    if (current_command->arg_count == 0) {
+        empty_heap_memory(current_command);
+        return NULL;
+    }
+
     return current_command;
 }
 
 
+/*
+* Function: redirect_target.
+* Takes the file name after a redirection operator. A missing name is
+* reported and marks the command invalid.
+*
+* Parameter: current_command (pointer to the structure)
+*            operator (redirection operator)
+* Return: copy of the file name, or NULL if there is none.
+*/
+char* redirect_target(struct command_line* current_command, char* operator) {
+    char* name = strtok(NULL, " \n");
+
+    if (name == NULL) {
+        printf("%s: missing file name\n", operator);
+        fflush(stdout);
+        current_command->is_invalid = true;
+        return NULL;
+    }
+
+    return strdup(name);
+}
+
+
+/*
+* Function: parse_prefix.
+* Parses a key=value job prefix written before the command name. A known
+* key with a bad value is reported and marks the command invalid.
+*
+* Parameter: current_command (pointer to the structure)
+*            token (prefix candidate)
+* Return: true if the token was a job prefix. false otherwise.
+*/
+bool parse_prefix(struct command_line* current_command, char* token) {
+
+    // CPU placement for this job only.
+    if (strncmp(token, "affinity=", 9) == 0) {
+        int policy = parse_affinity_policy(token + 9);
+
+        if (policy == AFFINITY_UNSET) {
+            printf("affinity: unknown policy %s\n", token + 9);
+            fflush(stdout);
+            current_command->is_invalid = true;
+            return true;
+        }
+
+        current_command->affinity_policy = policy;
+        return true;
+    }
+
+    // Resource limits for this job only.
+    if (strncmp(token, "limits=", 7) == 0) {
+        if (!parse_limits(&current_command->limits, token + 7)) {
+            current_command->is_invalid = true;
+        }
+        return true;
+    }
+
+    // Detached jobs run in the background in their own session.
+    if (strncmp(token, "detach=", 7) == 0) {
+        if (strcmp(token + 7, "on") == 0) {
+            current_command->is_detached = true;
+            current_command->is_background = true;
+        } else if (strcmp(token + 7, "off") != 0) {
+            printf("detach: invalid value %s\n", token + 7);
+            fflush(stdout);
+            current_command->is_invalid = true;
+        }
+        return true;
+    }
+
+    // Job queue for background submissions.
+    if (strncmp(token, "queue=", 6) == 0) {
+        if (token[6] == '\0') {
+            printf("queue: missing name\n");
+            fflush(stdout);
+            current_command->is_invalid = true;
+            return true;
+        }
+
+        free(current_command->queue_name);
+        current_command->queue_name = strdup(token + 6);
+        return true;
+    }
+
+    // Preallocation and page cache hints for redirections.
+    if (parse_io_hints(current_command, token)) {
+        return true;
+    }
+
+    // Nice value, I/O priority, and scheduling class.
+    if (is_priority_setting(token)) {
+        if (!parse_priority(&current_command->priority, token)) {
+            current_command->is_invalid = true;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+
 /* 
 * Function: empty_heap_memory.
 * Frees up heap memory used by parser. Pervents memory leaks.
@@ -167,6 +1241,7 @@ void empty_heap_memory(struct command_line* current_command) {
     // Empty filename string.
     free(current_command->input_file);
     free(current_command->output_file);
+    free(current_command->queue_name);
 
     // Empty command line structure.
     free(current_command);
@@ -175,7 +1250,10 @@ void empty_heap_memory(struct command_line* current_command) {
 
 /* 
 * Function: built_in_commands.
-* Support three built-in commands: exit, cd, and status.
+* Support built-in commands: exit, cd, status, affinity, bgpolicy, jobs,
+* admission, queue, durations, ulimit, checksum, pcp, prm, pdu, events,
+* disown, and attach, and mkdir, touch, mv, ln, chmod, rm, and ls in
+* their common forms.
 *
 * Parameter: current_command (pointer to the structure)
 * Return: 0 if command is built-in. -1 otherwise.
@@ -184,6 +1262,7 @@ int built_in_commands(struct command_line* current_command) {
 
     // Handles exit command.
     if (strcmp(current_command->arg_variables[0], "exit") == 0) {
+        terminate_background_jobs();
         empty_heap_memory(current_command);
         exit(0);
     }
@@ -234,31 +1313,211 @@ int built_in_commands(struct command_line* current_command) {
         return 0;
 
     }
-    return -1;
-}
 
+    // Affinity command.
+    if (strcmp(current_command->arg_variables[0], "affinity") == 0) {
+        affinity_command(current_command);
+        empty_heap_memory(current_command);
+        return 0;
+    }
 
-/* 
-* Function: exec_commands.
-* Support non built-in commands using fork and exec.
-*
-* Parameter: current_command (pointer to the structure)
-* Return: 0 if successful. 1 on error.
-*/
-int exec_commands(struct command_line* current_command) {
-    
-    // Signal settings for child.
-    struct sigaction child_SIGINT = {0};
-    struct sigaction child_SIGTSTP = {0};
-
-    // Create child process. 
-    pid_t spawnpid = fork();
+    // Background priority policy command.
+    if (strcmp(current_command->arg_variables[0], "bgpolicy") == 0) {
+        bgpolicy_command(current_command);
+        empty_heap_memory(current_command);
+        return 0;
+    }
 
-    switch(spawnpid){
+    // Jobs command.
+    if (strcmp(current_command->arg_variables[0], "jobs") == 0) {
+        jobs_command(current_command);
+        empty_heap_memory(current_command);
+        return 0;
+    }
 
-        // Catch fork errors.
+    // Admission control command.
+    if (strcmp(current_command->arg_variables[0], "admission") == 0) {
+        admission_command(current_command);
+        empty_heap_memory(current_command);
+        return 0;
+    }
+
+    // Job queue command.
+    if (strcmp(current_command->arg_variables[0], "queue") == 0) {
+        queue_command(current_command);
+        empty_heap_memory(current_command);
+        return 0;
+    }
+
+    // Duration model command.
+    if (strcmp(current_command->arg_variables[0], "durations") == 0) {
+        durations_command(current_command);
+        empty_heap_memory(current_command);
+        return 0;
+    }
+
+    // Resource limit command.
+    if (strcmp(current_command->arg_variables[0], "ulimit") == 0) {
+        ulimit_command(current_command);
+        empty_heap_memory(current_command);
+        return 0;
+    }
+
+    // Checksum command.
+    if (strcmp(current_command->arg_variables[0], "checksum") == 0) {
+        checksum_command(current_command);
+        empty_heap_memory(current_command);
+        return 0;
+    }
+
+    // Parallel copy command.
+    if (strcmp(current_command->arg_variables[0], "pcp") == 0) {
+        pcp_command(current_command);
+        empty_heap_memory(current_command);
+        return 0;
+    }
+
+    // File commands. Forms they do not cover run externally.
+    if (file_command(current_command)) {
+        empty_heap_memory(current_command);
+        return 0;
+    }
+
+    // Parallel remove and disk usage commands.
+    if (strcmp(current_command->arg_variables[0], "prm") == 0 ||
+        strcmp(current_command->arg_variables[0], "pdu") == 0) {
+        walk_command(current_command, current_command->arg_variables[0][1] == 'r');
+        empty_heap_memory(current_command);
+        return 0;
+    }
+
+    // Event loop statistics command.
+    if (strcmp(current_command->arg_variables[0], "events") == 0) {
+        events_command();
+        empty_heap_memory(current_command);
+        return 0;
+    }
+
+    // Disown command.
+    if (strcmp(current_command->arg_variables[0], "disown") == 0) {
+        disown_command(current_command);
+        empty_heap_memory(current_command);
+        return 0;
+    }
+
+    // Attach command.
+    if (strcmp(current_command->arg_variables[0], "attach") == 0) {
+        attach_command(current_command);
+        empty_heap_memory(current_command);
+        return 0;
+    }
+
+    return -1;
+}
+
+
+/* 
+* Function: exec_commands.
+* Support non built-in commands using fork and exec.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: 0 if successful. 1 on error.
+*/
+int exec_commands(struct command_line* current_command) {
+    
+    // Signal settings for child.
+    struct sigaction child_SIGINT = {0};
+    struct sigaction child_SIGTSTP = {0};
+
+    // Predict run time for scheduling and accuracy reports.
+    if (!current_command->is_admitted) {
+        predict_duration(current_command);
+    }
+
+    // Background jobs wait in their queue for a slot and for low pressure.
+    if (current_command->is_background && !current_command->is_admitted) {
+        int queue_index = find_queue(current_command->queue_name, true);
+        struct job_queue* queue = &job_queues[queue_index];
+
+        current_command->queue_index = queue_index;
+
+        if (queue->depth > 0 || !queue_has_room(queue_index) ||
+            (admission.enabled && under_pressure())) {
+
+            enqueue_command(current_command);
+
+            shell_printf("background job queued on %s (depth %d)\n", queue->name, queue->depth);
+            return 0;
+        }
+    }
+
+    // Pick CPU placement before forking so round-robin state advances.
+    cpu_set_t placement;
+    bool is_placed = job_placement(current_command, &placement);
+
+    current_command->started_at = monotonic_ms();
+
+    // Atomic output is created by the shell, which publishes it later.
+    if (current_command->is_atomic_output && !open_atomic_output(current_command)) {
+        if (!current_command->is_background) {
+            latest_status = 1 << 8;
+        }
+        empty_heap_memory(current_command);
+        return 1;
+    }
+
+    // Compressed redirections go through pipes to shell threads.
+    if (!open_codec_streams(current_command)) {
+        if (!current_command->is_background) {
+            latest_status = 1 << 8;
+        }
+        empty_heap_memory(current_command);
+        return 1;
+    }
+
+    // The shell flushes and drops written pages behind the job.
+    struct io_stream* stream = open_output_stream(current_command);
+
+    // The shell warms or drops the input file around the job.
+    struct io_stream* input_stream = open_input_stream(current_command);
+
+    // Queued messages go out before the fork. A child leaving through
+    // exit() would otherwise write them again.
+    shell_flush();
+
+    // The child must not hold a copy of unwritten recording rows.
+    if (session.record_file != NULL) {
+        fflush(session.record_file);
+    }
+
+    // Create child process. 
+    pid_t spawnpid = fork();
+
+    if (stream != NULL) {
+        stream->pid = spawnpid;
+    }
+
+    if (input_stream != NULL) {
+        input_stream->pid = spawnpid;
+    }
+
+    if (spawnpid != 0) {
+        start_codec_streams(current_command, spawnpid);
+    }
+
+    switch(spawnpid){
+
+        // Catch fork errors.
         case -1:
             perror("fork");
+
+            finish_io_streams(-1);
+            finish_codec_streams(-1);
+
+            if (current_command->is_atomic_output) {
+                publish_atomic_output(current_command->atomic_fd, current_command->atomic_temp,
+                                      current_command->output_file, -1);
+            }
             return 1;
 
         // Child process.
@@ -283,6 +1542,33 @@ int exec_commands(struct command_line* current_command) {
             child_SIGTSTP.sa_flags = 0;
             sigaction(SIGTSTP, &child_SIGTSTP, NULL);
 
+            // Children do not inherit the shell's blocked SIGCHLD.
+            sigset_t child_signals;
+            sigemptyset(&child_signals);
+            sigaddset(&child_signals, SIGCHLD);
+            sigprocmask(SIG_UNBLOCK, &child_signals, NULL);
+
+            // Pin child to its assigned CPUs.
+            if (is_placed) {
+                sched_setaffinity(0, sizeof(cpu_set_t), &placement);
+            }
+
+            // Lower priority without a nice or ionice wrapper.
+            apply_priority(current_command);
+
+            // Bound the job by kernel resource limits.
+            apply_limits(current_command);
+
+            // Detached jobs leave the terminal session and survive hangup.
+            if (current_command->is_detached) {
+                struct sigaction child_SIGHUP = {0};
+
+                child_SIGHUP.sa_handler = SIG_IGN;
+                sigaction(SIGHUP, &child_SIGHUP, NULL);
+                setsid();
+                open_capture_file();
+            }
+
             // Redirect input/output files.
             file_redirection(current_command);
 
@@ -291,7 +1577,8 @@ int exec_commands(struct command_line* current_command) {
 
             // Handle error if new program not found.
             printf("%s: no such file or directory\n", current_command->arg_variables[0]);
-            exit(1);
+            fflush(stdout);
+            _exit(1);
 
         // Parent process.
         default:
@@ -314,8 +1601,16 @@ int exec_commands(struct command_line* current_command) {
 */
 void file_redirection(struct command_line* current_command) {
 
+    // Compressed input arrives through a pipe from the shell.
+    if (current_command->is_compressed_input) {
+        dup2(current_command->input_codec->child_fd, STDIN_FILENO);
+
+    // Input file opened and warmed by the shell.
+    } else if (current_command->is_input_open) {
+        dup2(current_command->input_fd, STDIN_FILENO);
+
     // Input file provided. Standard input goes to file.
-    if (current_command->input_file != NULL) {
+    } else if (current_command->input_file != NULL) {
 
         // Open selected file.
         int input_descriptor = open(current_command->input_file, O_RDONLY);
@@ -324,7 +1619,7 @@ void file_redirection(struct command_line* current_command) {
         if (input_descriptor == -1) {
             printf("cannot open %s for input\n", current_command->input_file);
             fflush(stdout);
-            exit(1);
+            _exit(1);
         }
         
         // Redirect input.
@@ -343,7 +1638,7 @@ void file_redirection(struct command_line* current_command) {
         if (input_descriptor == -1) {
             printf("open error\n");
             fflush(stdout);
-            exit(1);
+            _exit(1);
         }
 
         // Redirect input.
@@ -353,8 +1648,17 @@ void file_redirection(struct command_line* current_command) {
         close(input_descriptor);
     }
     
+    // Compressed output leaves through a pipe to the shell.
+    if (current_command->is_compressed_output) {
+        dup2(current_command->output_codec->child_fd, STDOUT_FILENO);
+
+    // Atomic output. The shell already opened the unnamed file.
+    } else if (current_command->is_atomic_output) {
+        dup2(current_command->atomic_fd, STDOUT_FILENO);
+        apply_output_hints(current_command, STDOUT_FILENO);
+
     // Output file provided. Standard output goes to file.
-    if (current_command->output_file != NULL) {
+    } else if (current_command->output_file != NULL) {
 
         // Open selected file. Create if missing. Truncate if exists.
         int output_descriptor = open(
@@ -367,17 +1671,19 @@ void file_redirection(struct command_line* current_command) {
         if (output_descriptor == -1) {
             printf("cannot open %s for output\n", current_command->output_file);
             fflush(stdout);
-            exit(1); 
+            _exit(1);
         }
 
+        apply_output_hints(current_command, output_descriptor);
+
         // Redirect output.
         dup2(output_descriptor, STDOUT_FILENO);
 
         // Close file.
         close(output_descriptor);
 
-    // No output file. Standard output goes to /dev/null.
-    } else if (current_command->is_background) {
+    // No output file. Standard output goes to /dev/null unless captured.
+    } else if (current_command->is_background && !current_command->is_detached) {
        
         // Open dev/null file.
         int output_descriptor = open("/dev/null", O_WRONLY);
@@ -386,7 +1692,7 @@ void file_redirection(struct command_line* current_command) {
         if (output_descriptor == -1) {
             printf("open error\n");
             fflush(stdout);
-            exit(1);
+            _exit(1);
         }
 
         // Redirect output.
@@ -398,109 +1704,8331 @@ void file_redirection(struct command_line* current_command) {
 }
 
 
-/* 
-* Function: manage_child_process.
-* Handles foreground and background child processes.
+/*
+* Function: open_atomic_output.
+* Opens an unnamed O_TMPFILE in the target's directory for a >~
+* redirection. Falls back to a hidden mkstemp file where the file
+* system does not support O_TMPFILE.
 *
 * Parameter: current_command (pointer to the structure)
-*            spawnpid (process id of the child)
-* Return: none.
+* Return: false if no file could be created.
 */
-void manage_child_process(struct command_line* current_command, pid_t spawnpid) {
+bool open_atomic_output(struct command_line* current_command) {
+    char directory[4096];
+    char* target = current_command->output_file;
+    char* slash = strrchr(target, '/');
 
-    int child_status;
+    if (slash == NULL) {
+        snprintf(directory, sizeof(directory), ".");
+    } else if (slash == target) {
+        snprintf(directory, sizeof(directory), "/");
+    } else {
+        snprintf(directory, sizeof(directory), "%.*s", (int) (slash - target), target);
+    }
 
-    // Background command.
-    if (current_command->is_background) {
+    current_command->atomic_temp = NULL;
+    current_command->atomic_fd = open(directory, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
 
-        // Print background PID when process begins.
-        printf("background pid is %d\n", spawnpid);
-        fflush(stdout);
-        return;
+    if (current_command->atomic_fd != -1) {
+        return true;
     }
 
-    // Foreground command. Wait for child process to complete.
-    waitpid(spawnpid, &child_status, 0);
+    // Named temporary file next to the target.
+    char temp_path[4200];
 
-    // Save status.
-    latest_status = child_status;
+    snprintf(temp_path, sizeof(temp_path), "%s/.%s.XXXXXX", directory,
+             slash != NULL ? slash + 1 : target);
 
-    // Check if child was terminated by signal.
-    if (WIFSIGNALED(child_status)) {
+    current_command->atomic_fd = mkostemp(temp_path, O_CLOEXEC);
 
-        int signal_number = WTERMSIG(child_status);
-        
-        // Print PID termination message.
-        printf("terminated by signal %d\n", signal_number);
-        fflush(stdout);
+    if (current_command->atomic_fd == -1) {
+        shell_printf("cannot open %s for output\n", target);
+        return false;
     }
+
+    fchmod(current_command->atomic_fd, 0644);
+    current_command->atomic_temp = strdup(temp_path);
+    return true;
 }
 
 
-/* 
-* Function: background_tracker.
-* Checks if background child processes have finished.
+/*
+* Function: publish_atomic_output.
+* Moves finished output into place with rename, so readers see either
+* the old file or the complete new one. An unnamed file is first linked
+* under a temporary name through /proc/self/fd. Output of failed
+* commands is discarded and the old file is kept.
 *
-* Parameter: none.
+* Parameter: fd (output file, closed here)
+*            temp_path (named temporary file. NULL for O_TMPFILE. Freed here)
+*            target_path (redirection target)
+*            child_status (wait status. -1 if the command never ran)
 * Return: none.
 */
-void background_tracker() {
-    int child_status;
-    pid_t completed_pid;
+void publish_atomic_output(int fd, char* temp_path, char* target_path, int child_status) {
+    bool is_success = child_status != -1 && WIFEXITED(child_status) &&
+                      WEXITSTATUS(child_status) == 0;
 
-    // Check for completed child processes without block. 
-    completed_pid = waitpid(-1, &child_status, WNOHANG);
+    if (is_success && temp_path == NULL) {
+        char fd_path[64];
+        char link_path[4200];
 
-    while (completed_pid > 0) {
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+        snprintf(link_path, sizeof(link_path), "%s.%d.tmp", target_path, getpid());
 
-        // Child process exited normally.
-        if (WIFEXITED(child_status)) {
+        // A stale name from an earlier crash would block the link.
+        if (linkat(AT_FDCWD, fd_path, AT_FDCWD, link_path, AT_SYMLINK_FOLLOW) == -1 &&
+            (errno != EEXIST || unlink(link_path) == -1 ||
+             linkat(AT_FDCWD, fd_path, AT_FDCWD, link_path, AT_SYMLINK_FOLLOW) == -1)) {
+            shell_printf("cannot publish %s: %s\n", target_path, strerror(errno));
+        } else {
+            temp_path = strdup(link_path);
+        }
+    }
 
-            int exit_value = WEXITSTATUS(child_status);
-            
-            // Print PID completion message.
-            printf("background pid %d is done: exit value %d\n",
-                   completed_pid, exit_value);
-        
-        // Child process killed by signal. 
-        } else if (WIFSIGNALED(child_status)) {
+    if (temp_path != NULL) {
+        if (!is_success) {
+            unlink(temp_path);
+        } else if (rename(temp_path, target_path) == -1) {
+            shell_printf("cannot publish %s: %s\n", target_path, strerror(errno));
+            unlink(temp_path);
+        }
+    }
 
-            int signal_number = WTERMSIG(child_status);
+    free(temp_path);
+    close(fd);
+}
 
-            // Print PID termination message.
-            printf("background pid %d is done: terminated by signal %d\n",
-                   completed_pid, signal_number);
+
+/*
+* Function: hold_atomic_output.
+* Keeps a background job's atomic output open until the job is reaped.
+*
+* Parameter: pid (process id of the job)
+*            current_command (pointer to the structure)
+* Return: none.
+*/
+void hold_atomic_output(pid_t pid, struct command_line* current_command) {
+    struct atomic_output* output = malloc(sizeof(struct atomic_output));
+
+    output->pid = pid;
+    output->fd = current_command->atomic_fd;
+    output->temp_path = current_command->atomic_temp;
+    output->target_path = strdup(current_command->output_file);
+    output->next = pending_outputs;
+    pending_outputs = output;
+
+    current_command->atomic_temp = NULL;
+}
+
+
+/*
+* Function: finish_atomic_output.
+* Publishes or discards the atomic output of a reaped background job.
+*
+* Parameter: pid (process id of the job)
+*            child_status (wait status)
+* Return: none.
+*/
+void finish_atomic_output(pid_t pid, int child_status) {
+
+    for (struct atomic_output** link = &pending_outputs; *link != NULL;
+         link = &(*link)->next) {
+        struct atomic_output* output = *link;
+
+        if (output->pid == pid) {
+            publish_atomic_output(output->fd, output->temp_path, output->target_path,
+                                  child_status);
+            *link = output->next;
+            free(output->target_path);
+            free(output);
+            return;
+        }
+    }
+}
+
+
+/*
+* Function: parse_io_hints.
+* Parses redirection hint prefixes: prealloc=SIZE, writebehind=SIZE,
+* and dropbehind=on for output, readahead=SIZE and nocache=on for input.
+* Bad values are reported and mark the command invalid.
+*
+* Parameter: current_command (pointer to the structure)
+*            token (prefix candidate)
+* Return: true if the token was a hint prefix.
+*/
+bool parse_io_hints(struct command_line* current_command, char* token) {
+    struct io_hints* hints = &current_command->output_hints;
+    char* value = strchr(token, '=');
+    rlim_t size;
+
+    if (value == NULL) {
+        return false;
+    }
+    value++;
+
+    bool is_dropbehind = strncmp(token, "dropbehind=", 11) == 0;
+    bool is_nocache = strncmp(token, "nocache=", 8) == 0;
+
+    if (is_dropbehind || is_nocache) {
+        bool is_on = strcmp(value, "on") == 0;
+
+        if (!is_on && strcmp(value, "off") != 0) {
+            printf("%.*s: invalid value %s\n", (int) (value - token - 1), token, value);
+            fflush(stdout);
+            current_command->is_invalid = true;
+        } else if (is_dropbehind) {
+            hints->is_dropping = is_on;
+        } else {
+            current_command->input_hints.is_uncached = is_on;
         }
+        return true;
+    }
 
+    bool is_prealloc = strncmp(token, "prealloc=", 9) == 0;
+    bool is_window = strncmp(token, "writebehind=", 12) == 0;
+    bool is_readahead = strncmp(token, "readahead=", 10) == 0;
+
+    if (!is_prealloc && !is_window && !is_readahead) {
+        return false;
+    }
+
+    if (!parse_limit_value(value, 1, &size) || size == 0 || size == RLIM_INFINITY) {
+        printf("%.*s: bad size %s\n", (int) (value - token - 1), token, value);
         fflush(stdout);
+        current_command->is_invalid = true;
+        return true;
+    }
 
-        // Check for completed processes.
-        completed_pid = waitpid(-1, &child_status, WNOHANG);
+    if (is_prealloc) {
+        hints->prealloc = size;
+    } else if (is_window) {
+        hints->window = size;
+    } else {
+        current_command->input_hints.readahead = size;
     }
-} 
+
+    return true;
+}
 
 
 /*
-* Function: handle_sigtstp.
-* Handler for SIGTSTP. Toggle to foreground only, ignoring & operator.
+* Function: apply_output_hints.
+* Runs in the child before exec. Reserves the expected size without
+* changing the file length, so the job's writes land in one extent.
 *
-* Parameter: signo (integer).
+* Parameter: current_command (pointer to the structure)
+*            fd (output file)
 * Return: none.
 */
-void handle_signal_tstp(int signo) {
+void apply_output_hints(struct command_line* current_command, int fd) {
 
-    char* start_message = "\nEntering foreground-only mode (& is now ignored)\n ";
-    char* exit_message = "\nExiting foreground-only mode\n ";
+    // Not every file system can preallocate. The job runs anyway.
+    if (current_command->output_hints.prealloc > 0) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, current_command->output_hints.prealloc);
+    }
+}
 
-    // Enters foreground only mode.
-    if (foreground_only == 0) {
 
-        foreground_only = 1;
-        write(STDOUT_FILENO, start_message, strlen(start_message));
+/*
+* Function: open_output_stream.
+* Opens the shell's own descriptor on a redirected output file that has
+* write-behind or drop-behind set, or that was preallocated.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: new stream. NULL if there is nothing to do.
+*/
+struct io_stream* open_output_stream(struct command_line* current_command) {
+    struct io_hints* hints = &current_command->output_hints;
 
-    // Exits foreground only mode.
-    } else {
-        foreground_only = 0;
-        write(STDOUT_FILENO, exit_message, strlen(exit_message));
+    if (current_command->output_file == NULL ||
+        (hints->window == 0 && !hints->is_dropping && hints->prealloc == 0)) {
+        return NULL;
+    }
+
+    // The child opens the same file and truncates it. Create it first.
+    int fd = current_command->is_atomic_output ?
+             fcntl(current_command->atomic_fd, F_DUPFD_CLOEXEC, 0) :
+             open(current_command->output_file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct io_stream* stream = calloc(1, sizeof(struct io_stream));
+
+    stream->fd = fd;
+    stream->hints = *hints;
+    stream->next = io_streams;
+    io_streams = stream;
+
+    // Drop-behind without a window uses the default window.
+    if (stream->hints.window == 0 && stream->hints.is_dropping) {
+        stream->hints.window = WRITE_BEHIND_WINDOW;
+    }
+
+    return stream;
+}
+
+
+/*
+* Function: write_behind.
+* Starts writeback of each full window as the job fills it. With
+* drop-behind, waits for the window before the newest one to reach disk
+* and drops its pages, so dirty and cached data stay near two windows.
+*
+* Parameter: stream (output stream)
+*            is_final (the job has ended. Handle the partial window too)
+* Return: none.
+*/
+void write_behind(struct io_stream* stream, bool is_final) {
+    off_t window = stream->hints.window;
+    struct stat status;
+
+    if (window == 0 || fstat(stream->fd, &status) == -1) {
+        return;
+    }
+
+    // The job truncated the file when it opened it.
+    if (status.st_size < stream->flushed) {
+        stream->flushed = 0;
+        stream->dropped = 0;
+    }
+
+    while (status.st_size - stream->flushed >= window) {
+        sync_file_range(stream->fd, stream->flushed, window, SYNC_FILE_RANGE_WRITE);
+        stream->flushed += window;
     }
-}
\ No newline at end of file
+
+    if (!stream->hints.is_dropping) {
+        if (is_final && status.st_size > stream->flushed) {
+            sync_file_range(stream->fd, stream->flushed, 0, SYNC_FILE_RANGE_WRITE);
+        }
+        return;
+    }
+
+    off_t keep = is_final ? 0 : window;
+    unsigned wait_flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER;
+
+    while (stream->flushed - stream->dropped > keep) {
+        off_t length = stream->flushed - stream->dropped - keep;
+
+        length = length < window ? length : window;
+        sync_file_range(stream->fd, stream->dropped, length, wait_flags);
+        posix_fadvise(stream->fd, stream->dropped, length, POSIX_FADV_DONTNEED);
+        stream->dropped += length;
+    }
+
+    if (is_final && status.st_size > stream->dropped) {
+        sync_file_range(stream->fd, stream->dropped, 0, wait_flags);
+        posix_fadvise(stream->fd, stream->dropped, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+
+/*
+* Function: io_streams_tick.
+* Advances write-behind and drop-behind on every open stream.
+*
+* Parameter: none.
+* Return: none.
+*/
+void io_streams_tick() {
+
+    for (struct io_stream* stream = io_streams; stream != NULL;
+         stream = stream->next) {
+
+        if (stream->is_input) {
+            drop_behind_reader(stream, false);
+        } else {
+            write_behind(stream, false);
+        }
+    }
+}
+
+
+/*
+* Function: finish_io_streams.
+* Flushes the rest of a finished job's output, releases preallocated
+* space past the end of what it wrote, drops the rest of its input if
+* asked, and closes its streams.
+*
+* Parameter: pid (process id of the job)
+* Return: none.
+*/
+void finish_io_streams(pid_t pid) {
+    struct io_stream** link = &io_streams;
+
+    while (*link != NULL) {
+        struct io_stream* stream = *link;
+        struct stat status;
+
+        if (stream->pid != pid) {
+            link = &stream->next;
+            continue;
+        }
+
+        if (stream->is_input) {
+            drop_behind_reader(stream, true);
+        } else {
+            write_behind(stream, true);
+        }
+
+        // Truncating to the current length frees blocks past the end.
+        if (stream->hints.prealloc > 0 && fstat(stream->fd, &status) == 0 &&
+            status.st_size < stream->hints.prealloc) {
+            ftruncate(stream->fd, status.st_size);
+        }
+
+        *link = stream->next;
+        close(stream->fd);
+        free(stream);
+    }
+}
+
+
+/*
+* Function: open_input_stream.
+* Opens a regular input file in the shell when readahead or nocache is
+* set. The child gets the same open file, so sequential read-ahead set
+* here applies to its reads, and its file offset shows the shell how
+* far it has read. Pipes and devices are left to the child.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: new stream. NULL if there is nothing to do.
+*/
+struct io_stream* open_input_stream(struct command_line* current_command) {
+    struct io_hints* hints = &current_command->input_hints;
+    struct stat status;
+
+    if (current_command->input_file == NULL ||
+        (hints->readahead == 0 && !hints->is_uncached)) {
+        return NULL;
+    }
+
+    // Do not block on a FIFO without a writer.
+    int fd = open(current_command->input_file, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (fstat(fd, &status) == -1 || !S_ISREG(status.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    fcntl(fd, F_SETFL, 0);
+
+    // Double the read-ahead window and start reading the head of the file
+    // so the job's first reads find it in cache.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // The kernel caps one readahead call at the device's read-ahead
+    // size, so submit the range in pieces.
+    for (off_t offset = 0; offset < hints->readahead && offset < status.st_size;
+         offset += READAHEAD_CHUNK) {
+        readahead(fd, offset, READAHEAD_CHUNK);
+    }
+
+    current_command->is_input_open = true;
+    current_command->input_fd = fd;
+
+    struct io_stream* stream = calloc(1, sizeof(struct io_stream));
+
+    stream->fd = fd;
+    stream->is_input = true;
+    stream->hints = *hints;
+    stream->hints.window = WRITE_BEHIND_WINDOW;
+    stream->next = io_streams;
+    io_streams = stream;
+
+    return stream;
+}
+
+
+/*
+* Function: drop_behind_reader.
+* With nocache, drops the input pages before the job's read offset,
+* a window at a time, so a one-pass scan of a large file leaves the
+* page cache as it was.
+*
+* Parameter: stream (input stream)
+*            is_final (the job has ended. Drop the whole file)
+* Return: none.
+*/
+void drop_behind_reader(struct io_stream* stream, bool is_final) {
+
+    if (!stream->hints.is_uncached) {
+        return;
+    }
+
+    if (is_final) {
+        posix_fadvise(stream->fd, 0, 0, POSIX_FADV_DONTNEED);
+        return;
+    }
+
+    off_t offset = lseek(stream->fd, 0, SEEK_CUR);
+
+    if (offset - stream->dropped >= stream->hints.window) {
+        posix_fadvise(stream->fd, stream->dropped, offset - stream->dropped,
+                      POSIX_FADV_DONTNEED);
+        stream->dropped = offset;
+    }
+}
+
+
+/*
+* Function: lz_compress.
+* Compresses one block with a greedy LZ77 matcher. Sequences use the
+* LZ4 block layout: a token with literal and match length nibbles,
+* literals, a 2 byte offset, and extra length bytes. The last 5 bytes
+* are always literals.
+*
+* Parameter: input (block to compress)
+*            length (bytes in input)
+*            output (room for length + length / 255 + 16 bytes)
+* Return: compressed length.
+*/
+size_t lz_compress(const unsigned char* input, size_t length, unsigned char* output) {
+    uint32_t table[1 << CODEC_HASH_BITS];
+    size_t position = 0;
+    size_t anchor = 0;
+    size_t written = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (length >= 13 && position + 12 < length) {
+        uint32_t sequence;
+
+        memcpy(&sequence, input + position, 4);
+
+        uint32_t slot = (sequence * 2654435761u) >> (32 - CODEC_HASH_BITS);
+        size_t candidate = table[slot];
+        uint32_t found;
+
+        table[slot] = position;
+        memcpy(&found, input + candidate, 4);
+
+        // No match. Step faster through data that does not compress.
+        if (candidate >= position || position - candidate > 65535 || found != sequence) {
+            position += 1 + ((position - anchor) >> 6);
+            continue;
+        }
+
+        size_t match_length = 4;
+        size_t longest = length - 5 - position;
+
+        while (match_length < longest &&
+               input[candidate + match_length] == input[position + match_length]) {
+            match_length++;
+        }
+
+        // Token, then literal length, literals, offset, and match length.
+        size_t literals = position - anchor;
+        size_t extra = match_length - 4;
+        unsigned char* token = &output[written++];
+
+        *token = (literals < 15 ? literals : 15) << 4 | (extra < 15 ? extra : 15);
+
+        if (literals >= 15) {
+            for (literals -= 15; literals >= 255; literals -= 255) {
+                output[written++] = 255;
+            }
+            output[written++] = literals;
+        }
+
+        memcpy(output + written, input + anchor, position - anchor);
+        written += position - anchor;
+
+        output[written++] = (position - candidate) & 0xff;
+        output[written++] = (position - candidate) >> 8;
+
+        if (extra >= 15) {
+            for (extra -= 15; extra >= 255; extra -= 255) {
+                output[written++] = 255;
+            }
+            output[written++] = extra;
+        }
+
+        position += match_length;
+        anchor = position;
+    }
+
+    // Final sequence: literals only.
+    size_t literals = length - anchor;
+
+    output[written++] = (literals < 15 ? literals : 15) << 4;
+
+    if (literals >= 15) {
+        for (literals -= 15; literals >= 255; literals -= 255) {
+            output[written++] = 255;
+        }
+        output[written++] = literals;
+    }
+
+    memcpy(output + written, input + anchor, length - anchor);
+    return written + length - anchor;
+}
+
+
+/*
+* Function: lz_decompress.
+* Decompresses one block made by lz_compress. Every length and offset
+* is checked, so a corrupt file cannot write outside the output.
+*
+* Parameter: input (compressed block)
+*            length (bytes in input)
+*            output (room for expected bytes)
+*            expected (uncompressed length)
+* Return: false if the block is corrupt.
+*/
+bool lz_decompress(const unsigned char* input, size_t length, unsigned char* output,
+                   size_t expected) {
+    size_t position = 0;
+    size_t written = 0;
+
+    while (position < length) {
+        unsigned token = input[position++];
+        size_t literals = token >> 4;
+
+        if (literals == 15) {
+            unsigned char byte;
+
+            do {
+                if (position >= length) {
+                    return false;
+                }
+                byte = input[position++];
+                literals += byte;
+            } while (byte == 255);
+        }
+
+        if (literals > length - position || literals > expected - written) {
+            return false;
+        }
+
+        memcpy(output + written, input + position, literals);
+        position += literals;
+        written += literals;
+
+        // The last sequence has no match.
+        if (position == length) {
+            break;
+        }
+
+        if (length - position < 2) {
+            return false;
+        }
+
+        size_t offset = input[position] | input[position + 1] << 8;
+        size_t match_length = token & 15;
+
+        position += 2;
+
+        if (match_length == 15) {
+            unsigned char byte;
+
+            do {
+                if (position >= length) {
+                    return false;
+                }
+                byte = input[position++];
+                match_length += byte;
+            } while (byte == 255);
+        }
+
+        match_length += 4;
+
+        if (offset == 0 || offset > written || match_length > expected - written) {
+            return false;
+        }
+
+        // Overlapping matches repeat recent bytes and must go forward.
+        if (offset >= match_length) {
+            memcpy(output + written, output + written - offset, match_length);
+        } else {
+            for (size_t i = 0; i < match_length; i++) {
+                output[written + i] = output[written - offset + i];
+            }
+        }
+
+        written += match_length;
+    }
+
+    return written == expected;
+}
+
+
+/*
+* Function: codec_worker.
+* Thread body. Compresses or decompresses one block.
+*
+* Parameter: argument (struct codec_block, with output_length set to
+*                      the expected size when decompressing)
+* Return: NULL.
+*/
+void* codec_worker(void* argument) {
+    struct codec_block* block = argument;
+
+    // Stored blocks are copied as they are.
+    if (block->output_capacity == 0) {
+        block->output_length = lz_compress(block->input, block->input_length, block->output);
+    } else if (block->input_length == block->output_length) {
+        memcpy(block->output, block->input, block->input_length);
+        block->is_valid = true;
+    } else {
+        block->is_valid = lz_decompress(block->input, block->input_length, block->output,
+                                        block->output_length);
+    }
+
+    return NULL;
+}
+
+
+/*
+* Function: run_codec_blocks.
+* Runs codec_worker on each block, one thread per block, with the
+* first block on the calling thread.
+*
+* Parameter: blocks (blocks to process)
+*            count (number of blocks)
+*            is_compressing (compress rather than decompress)
+* Return: none.
+*/
+void run_codec_blocks(struct codec_block* blocks, int count, bool is_compressing) {
+    pthread_t threads[CODEC_MAX_THREADS];
+    bool is_started[CODEC_MAX_THREADS] = { false };
+
+    for (int i = 0; i < count; i++) {
+        blocks[i].output_capacity = is_compressing ? 0 : CODEC_BLOCK;
+        blocks[i].is_valid = false;
+    }
+
+    for (int i = 1; i < count; i++) {
+        is_started[i] = pthread_create(&threads[i], NULL, codec_worker, &blocks[i]) == 0;
+
+        if (!is_started[i]) {
+            codec_worker(&blocks[i]);
+        }
+    }
+
+    if (count > 0) {
+        codec_worker(&blocks[0]);
+    }
+
+    for (int i = 1; i < count; i++) {
+        if (is_started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+
+/*
+* Function: read_full.
+* Reads until length bytes arrive or the input ends.
+*
+* Parameter: fd (descriptor)
+*            buffer (destination)
+*            length (bytes wanted)
+*            done (bytes read)
+* Return: false on a read error.
+*/
+bool read_full(int fd, void* buffer, size_t length, size_t* done) {
+    *done = 0;
+
+    while (*done < length) {
+        ssize_t bytes_read = read(fd, (char*) buffer + *done, length - *done);
+
+        if (bytes_read == 0) {
+            break;
+        }
+
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        *done += bytes_read;
+    }
+
+    return true;
+}
+
+
+/*
+* Function: write_full.
+* Writes all of a buffer.
+*
+* Parameter: fd (descriptor)
+*            buffer (data)
+*            length (bytes to write)
+* Return: false on a write error, such as a closed pipe.
+*/
+bool write_full(int fd, const void* buffer, size_t length) {
+
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        buffer = (const char*) buffer + written;
+        length -= written;
+    }
+
+    return true;
+}
+
+
+/*
+* Function: compress_stream.
+* Thread body for >z. Reads the job's output in blocks, compresses a
+* batch of blocks in parallel, and writes them in order. Each block is
+* stored as its raw length, its stored length, and the data. Blocks
+* that do not shrink are stored as they are.
+*
+* Parameter: argument (struct codec_stream)
+* Return: NULL.
+*/
+void* compress_stream(void* argument) {
+    struct codec_stream* stream = argument;
+    struct codec_block blocks[CODEC_MAX_THREADS];
+    bool is_end = false;
+
+    for (int i = 0; i < codec_threads; i++) {
+        blocks[i].input = malloc(CODEC_BLOCK);
+        blocks[i].output = malloc(CODEC_BLOCK + CODEC_BLOCK / 255 + 16);
+    }
+
+    if (!write_full(stream->file_fd, CODEC_MAGIC, 4)) {
+        stream->is_failed = true;
+        is_end = true;
+    }
+
+    while (!is_end) {
+        int count = 0;
+
+        // Fill a batch. A short block means the job closed its output.
+        while (count < codec_threads && !is_end) {
+            size_t done;
+
+            is_end = !read_full(stream->pipe_fd, blocks[count].input, CODEC_BLOCK, &done) ||
+                     done < CODEC_BLOCK;
+            blocks[count].input_length = done;
+
+            if (done > 0) {
+                count++;
+            }
+        }
+
+        run_codec_blocks(blocks, count, true);
+
+        for (int i = 0; i < count; i++) {
+            struct codec_block* block = &blocks[i];
+            bool is_stored = block->output_length >= block->input_length;
+            uint32_t stored = is_stored ? block->input_length : block->output_length;
+            unsigned char header[8];
+
+            for (int j = 0; j < 4; j++) {
+                header[j] = block->input_length >> (8 * j);
+                header[4 + j] = stored >> (8 * j);
+            }
+
+            if (!write_full(stream->file_fd, header, 8) ||
+                !write_full(stream->file_fd, is_stored ? block->input : block->output, stored)) {
+                stream->is_failed = true;
+                is_end = true;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < codec_threads; i++) {
+        free(blocks[i].input);
+        free(blocks[i].output);
+    }
+
+    // A job still writing gets EPIPE.
+    close(stream->pipe_fd);
+    return NULL;
+}
+
+
+/*
+* Function: decompress_stream.
+* Thread body for <z. Reads a batch of blocks, decompresses them in
+* parallel, and writes them to the job's input in order.
+*
+* Parameter: argument (struct codec_stream)
+* Return: NULL.
+*/
+void* decompress_stream(void* argument) {
+    struct codec_stream* stream = argument;
+    struct codec_block blocks[CODEC_MAX_THREADS];
+    size_t capacity = CODEC_BLOCK + CODEC_BLOCK / 255 + 16;
+    char magic[4];
+    size_t done;
+    bool is_end = false;
+
+    for (int i = 0; i < codec_threads; i++) {
+        blocks[i].input = malloc(capacity);
+        blocks[i].output = malloc(CODEC_BLOCK);
+    }
+
+    if (!read_full(stream->file_fd, magic, 4, &done) || done != 4 ||
+        memcmp(magic, CODEC_MAGIC, 4) != 0) {
+        stream->is_failed = true;
+        is_end = true;
+    }
+
+    while (!is_end) {
+        int count = 0;
+
+        while (count < codec_threads) {
+            unsigned char header[8];
+            uint32_t raw = 0;
+            uint32_t stored = 0;
+
+            if (!read_full(stream->file_fd, header, 8, &done) || done == 0) {
+                is_end = true;
+                break;
+            }
+
+            for (int j = 0; j < 4; j++) {
+                raw |= (uint32_t) header[j] << (8 * j);
+                stored |= (uint32_t) header[4 + j] << (8 * j);
+            }
+
+            // Truncated header or lengths no block can have.
+            if (done != 8 || raw == 0 || raw > CODEC_BLOCK || stored > capacity ||
+                !read_full(stream->file_fd, blocks[count].input, stored, &done) ||
+                done != stored) {
+                stream->is_failed = true;
+                is_end = true;
+                break;
+            }
+
+            blocks[count].input_length = stored;
+            blocks[count].output_length = raw;
+            count++;
+        }
+
+        run_codec_blocks(blocks, count, false);
+
+        for (int i = 0; i < count; i++) {
+            if (!blocks[i].is_valid) {
+                stream->is_failed = true;
+                is_end = true;
+                break;
+            }
+
+            // The job stopped reading.
+            if (!write_full(stream->pipe_fd, blocks[i].output, blocks[i].output_length)) {
+                is_end = true;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < codec_threads; i++) {
+        free(blocks[i].input);
+        free(blocks[i].output);
+    }
+
+    // The job sees end of input.
+    close(stream->pipe_fd);
+    return NULL;
+}
+
+
+/*
+* Function: open_codec_stream.
+* Opens the file and pipe of one compressed redirection.
+*
+* Parameter: path (file to write or read)
+*            is_compressing (true for >z, false for <z)
+* Return: new stream. NULL if the file could not be opened.
+*/
+struct codec_stream* open_codec_stream(char* path, bool is_compressing) {
+    int pipe_fds[2];
+    int file_fd = is_compressing ?
+                  open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) :
+                  open(path, O_RDONLY | O_CLOEXEC);
+
+    if (file_fd == -1) {
+        shell_printf("cannot open %s for %s\n", path, is_compressing ? "output" : "input");
+        return NULL;
+    }
+
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+        close(file_fd);
+        return NULL;
+    }
+
+    struct codec_stream* stream = calloc(1, sizeof(struct codec_stream));
+
+    stream->is_compressing = is_compressing;
+    stream->file_fd = file_fd;
+    stream->path = strdup(path);
+    stream->pipe_fd = is_compressing ? pipe_fds[0] : pipe_fds[1];
+    stream->child_fd = is_compressing ? pipe_fds[1] : pipe_fds[0];
+
+    return stream;
+}
+
+
+/*
+* Function: open_codec_streams.
+* Opens the compressed redirections of a command before it forks.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: false if a file could not be opened.
+*/
+bool open_codec_streams(struct command_line* current_command) {
+
+    if (!current_command->is_compressed_input && !current_command->is_compressed_output) {
+        return true;
+    }
+
+    // One block per core, decided once.
+    if (codec_threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+        codec_threads = cores < 1 ? 1 : cores > CODEC_MAX_THREADS ? CODEC_MAX_THREADS : cores;
+    }
+
+    if (current_command->is_compressed_input) {
+        current_command->input_codec = open_codec_stream(current_command->input_file, false);
+
+        if (current_command->input_codec == NULL) {
+            return false;
+        }
+    }
+
+    if (current_command->is_compressed_output) {
+        current_command->output_codec = open_codec_stream(current_command->output_file, true);
+
+        if (current_command->output_codec == NULL) {
+            struct codec_stream* input = current_command->input_codec;
+
+            if (input != NULL) {
+                close(input->pipe_fd);
+                close(input->child_fd);
+                close(input->file_fd);
+                free(input->path);
+                free(input);
+            }
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+* Function: start_codec_streams.
+* Runs in the shell after fork. Closes the job's pipe ends and starts a
+* thread per compressed redirection.
+*
+* Parameter: current_command (pointer to the structure)
+*            pid (process id of the job. -1 if fork failed)
+* Return: none.
+*/
+void start_codec_streams(struct command_line* current_command, pid_t pid) {
+    struct codec_stream* streams[2] = {
+        current_command->input_codec, current_command->output_codec
+    };
+
+    for (int i = 0; i < 2; i++) {
+        struct codec_stream* stream = streams[i];
+
+        if (stream == NULL) {
+            continue;
+        }
+
+        close(stream->child_fd);
+        stream->pid = pid;
+        stream->next = codec_streams;
+        codec_streams = stream;
+
+        start_thread(&stream->thread, stream->is_compressing ? compress_stream : decompress_stream,
+                     stream);
+    }
+}
+
+
+/*
+* Function: finish_codec_streams.
+* Waits for the threads of a finished job, so its compressed output is
+* complete before the job is reported, and reports corrupt input.
+*
+* Parameter: pid (process id of the job)
+* Return: false if any stream of the job failed.
+*/
+bool finish_codec_streams(pid_t pid) {
+    struct codec_stream** link = &codec_streams;
+    bool is_ok = true;
+
+    while (*link != NULL) {
+        struct codec_stream* stream = *link;
+
+        if (stream->pid != pid) {
+            link = &stream->next;
+            continue;
+        }
+
+        pthread_join(stream->thread, NULL);
+
+        if (stream->is_failed) {
+            shell_printf(stream->is_compressing ? "cannot write %s\n" :
+                         "%s is not valid compressed input\n", stream->path);
+            is_ok = false;
+        }
+
+        *link = stream->next;
+        close(stream->file_fd);
+        free(stream->path);
+        free(stream);
+    }
+
+    return is_ok;
+}
+
+
+/* 
+* Function: manage_child_process.
+* Handles foreground and background child processes.
+*
+* Parameter: current_command (pointer to the structure)
+*            spawnpid (process id of the child)
+* Return: none.
+*/
+void manage_child_process(struct command_line* current_command, pid_t spawnpid) {
+
+    int child_status;
+
+    // Background command.
+    if (current_command->is_background) {
+
+        // Print background PID when process begins.
+        begin_notice();
+
+        if (current_command->is_detached) {
+            write_detached_record(spawnpid, current_command);
+            shell_printf("detached pid is %d\n", spawnpid);
+        } else {
+            shell_printf("background pid is %d\n", spawnpid);
+        }
+
+        add_background_job(spawnpid, current_command);
+
+        if (current_command->is_atomic_output) {
+            hold_atomic_output(spawnpid, current_command);
+        }
+        return;
+    }
+
+    // Foreground command. Keep working on redirected files while it runs.
+    if (io_streams != NULL) {
+        int pid_fd = syscall(SYS_pidfd_open, spawnpid, 0);
+        struct pollfd child = { .fd = pid_fd, .events = POLLIN };
+
+        while (pid_fd != -1) {
+            int result = poll(&child, 1, WRITE_BEHIND_TICK_MS);
+
+            // Exited, or poll failed. waitpid below does the waiting.
+            if (result == 1 || (result == -1 && errno != EINTR)) {
+                break;
+            }
+
+            io_streams_tick();
+        }
+
+        if (pid_fd != -1) {
+            close(pid_fd);
+        }
+    }
+
+    // Wait for child process to complete.
+    waitpid(spawnpid, &child_status, 0);
+    finish_io_streams(spawnpid);
+
+    // A job fed corrupt input, or whose output could not be written, failed.
+    if (!finish_codec_streams(spawnpid) && WIFEXITED(child_status) &&
+        WEXITSTATUS(child_status) == 0) {
+        child_status = 1 << 8;
+    }
+
+    // Save status.
+    latest_status = child_status;
+
+    // Publish atomic output on success. Discard it otherwise.
+    if (current_command->is_atomic_output) {
+        publish_atomic_output(current_command->atomic_fd, current_command->atomic_temp,
+                              current_command->output_file, child_status);
+    }
+
+    record_duration(current_command->model_index, current_command->predicted_ms,
+                    current_command->is_predicted, current_command->started_at,
+                    child_status);
+
+    // Check if child was terminated by signal.
+    if (WIFSIGNALED(child_status)) {
+
+        int signal_number = WTERMSIG(child_status);
+        
+        // Print PID termination message.
+        shell_printf("terminated by signal %d\n", signal_number);
+    }
+}
+
+
+/* 
+* Function: background_tracker.
+* Checks if background child processes have finished.
+*
+* Parameter: none.
+* Return: none.
+*/
+void background_tracker() {
+    int child_status;
+    pid_t completed_pid;
+    int reaped = 0;
+    int summarized = 0;
+    int summarized_failed = 0;
+
+    // Check for completed child processes without block. 
+    completed_pid = waitpid(-1, &child_status, WNOHANG);
+
+    while (completed_pid > 0) {
+
+        child_status = remove_background_job(completed_pid, child_status);
+        begin_notice();
+        reaped++;
+
+        // Burst of completions. Count the rest for one summary line.
+        if (reaped > NOTICE_LIMIT) {
+            summarized++;
+
+            if (!WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+                summarized_failed++;
+            }
+
+        // Child process exited normally.
+        } else if (WIFEXITED(child_status)) {
+
+            int exit_value = WEXITSTATUS(child_status);
+            
+            // Print PID completion message.
+            shell_printf("background pid %d is done: exit value %d\n",
+                         completed_pid, exit_value);
+        
+        // Child process killed by signal. 
+        } else if (WIFSIGNALED(child_status)) {
+
+            int signal_number = WTERMSIG(child_status);
+
+            // Print PID termination message.
+            shell_printf("background pid %d is done: terminated by signal %d\n",
+                         completed_pid, signal_number);
+        }
+
+        // Check for completed processes.
+        completed_pid = waitpid(-1, &child_status, WNOHANG);
+    }
+
+    if (summarized > 0) {
+        shell_printf("%d more background jobs are done: %d failed\n",
+                     summarized, summarized_failed);
+    }
+} 
+
+
+/*
+* Function: handle_sigtstp.
+* Handler for SIGTSTP. Toggle to foreground only, ignoring & operator.
+*
+* Parameter: signo (integer).
+* Return: none.
+*/
+void handle_signal_tstp(int signo) {
+
+    char* start_message = "\nEntering foreground-only mode (& is now ignored)\n ";
+    char* exit_message = "\nExiting foreground-only mode\n ";
+
+    // Enters foreground only mode.
+    if (foreground_only == 0) {
+
+        foreground_only = 1;
+        write(STDOUT_FILENO, start_message, strlen(start_message));
+
+    // Exits foreground only mode.
+    } else {
+        foreground_only = 0;
+        write(STDOUT_FILENO, exit_message, strlen(exit_message));
+    }
+
+    // Redraw the prompt and partly typed line.
+    if (editor.prompt_active && editor.is_terminal) {
+        write(STDOUT_FILENO, "\r\033[K: ", 6);
+        write(STDOUT_FILENO, editor.line, editor.length);
+    }
+}
+
+
+/*
+* Function: parse_affinity_policy.
+* Converts a policy name into an affinity constant.
+*
+* Parameter: name (policy name: off, core, or node).
+* Return: policy constant. AFFINITY_UNSET if name is unknown.
+*/
+int parse_affinity_policy(char* name) {
+
+    if (strcmp(name, "off") == 0) {
+        return AFFINITY_OFF;
+    }
+
+    if (strcmp(name, "core") == 0) {
+        return AFFINITY_CORE;
+    }
+
+    if (strcmp(name, "node") == 0) {
+        return AFFINITY_NODE;
+    }
+
+    return AFFINITY_UNSET;
+}
+
+
+/*
+* Function: parse_cpu_list.
+* Reads a sysfs CPU list such as "0-3,8-11" into a CPU mask.
+*
+* Parameter: path (sysfs file to read)
+*            mask (output CPU mask)
+* Return: true if the file was read. false otherwise.
+*/
+bool parse_cpu_list(char* path, cpu_set_t* mask) {
+    char buffer[1024];
+
+    FILE* list_file = fopen(path, "r");
+
+    if (list_file == NULL) {
+        return false;
+    }
+
+    if (fgets(buffer, sizeof(buffer), list_file) == NULL) {
+        fclose(list_file);
+        return false;
+    }
+
+    fclose(list_file);
+    CPU_ZERO(mask);
+
+    // Each comma separated item is a single CPU or a range.
+    char* range = strtok(buffer, ",\n");
+
+    while (range) {
+        int first = 0;
+        int last = 0;
+        int matched = sscanf(range, "%d-%d", &first, &last);
+
+        if (matched == 1) {
+            last = first;
+        }
+
+        for (int cpu = first; matched > 0 && cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, mask);
+        }
+
+        range = strtok(NULL, ",\n");
+    }
+
+    return true;
+}
+
+
+/*
+* Function: load_cpu_topology.
+* Reads online CPUs and NUMA nodes from /sys/devices/system.
+* CPUs outside the shell's starting affinity mask are never used.
+*
+* Parameter: none.
+* Return: none.
+*/
+void load_cpu_topology() {
+    cpu_set_t online;
+
+    if (topology.loaded) {
+        return;
+    }
+
+    topology.loaded = true;
+    sched_getaffinity(0, sizeof(cpu_set_t), &topology.shell_mask);
+
+    // Restrict online CPUs to the ones the shell may run on.
+    if (parse_cpu_list("/sys/devices/system/cpu/online", &online)) {
+        CPU_AND(&online, &online, &topology.shell_mask);
+    } else {
+        online = topology.shell_mask;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &online)) {
+            topology.cpus[topology.cpu_count++] = cpu;
+        }
+    }
+
+    // Read the CPU list of each NUMA node.
+    DIR* node_dir = opendir("/sys/devices/system/node");
+    struct dirent* entry;
+
+    while (node_dir != NULL && (entry = readdir(node_dir)) != NULL &&
+           topology.node_count < 64) {
+        char path[512];
+        cpu_set_t node_mask;
+        int node_id;
+
+        if (sscanf(entry->d_name, "node%d", &node_id) != 1) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+                 entry->d_name);
+
+        if (parse_cpu_list(path, &node_mask)) {
+            CPU_AND(&node_mask, &node_mask, &online);
+
+            if (CPU_COUNT(&node_mask) > 0) {
+                topology.node_masks[topology.node_count++] = node_mask;
+            }
+        }
+    }
+
+    if (node_dir != NULL) {
+        closedir(node_dir);
+    }
+
+    // No NUMA information. Treat all CPUs as one node.
+    if (topology.node_count == 0) {
+        topology.node_masks[topology.node_count++] = online;
+    }
+}
+
+
+/*
+* Function: job_placement.
+* Chooses the CPUs a new job runs on. Jobs are spread round-robin
+* over cores or NUMA nodes, and never share the shell's reserved core.
+*
+* Parameter: current_command (pointer to the structure)
+*            mask (output CPU mask)
+* Return: true if the child should set its affinity. false otherwise.
+*/
+bool job_placement(struct command_line* current_command, cpu_set_t* mask) {
+    int policy = current_command->affinity_policy;
+
+    // Background jobs fall back to the shell's default policy.
+    if (policy == AFFINITY_UNSET) {
+        policy = current_command->is_background ? default_affinity : AFFINITY_OFF;
+    }
+
+    if (policy == AFFINITY_OFF && topology.reserved_cpu == -1) {
+        return false;
+    }
+
+    load_cpu_topology();
+
+    // Every usable CPU except the reserved one.
+    CPU_ZERO(mask);
+
+    for (int i = 0; i < topology.cpu_count; i++) {
+        CPU_SET(topology.cpus[i], mask);
+    }
+
+    if (topology.reserved_cpu != -1 && CPU_COUNT(mask) > 1) {
+        CPU_CLR(topology.reserved_cpu, mask);
+    }
+
+    cpu_set_t allowed = *mask;
+
+    // Pin to the next core in turn.
+    if (policy == AFFINITY_CORE) {
+        for (int tries = 0; tries < topology.cpu_count; tries++) {
+            int cpu = topology.cpus[topology.next_cpu++ % topology.cpu_count];
+
+            if (CPU_ISSET(cpu, &allowed)) {
+                CPU_ZERO(mask);
+                CPU_SET(cpu, mask);
+                break;
+            }
+        }
+
+    // Pin to all cores of the next node in turn.
+    } else if (policy == AFFINITY_NODE) {
+        for (int tries = 0; tries < topology.node_count; tries++) {
+            cpu_set_t node_mask = topology.node_masks[topology.next_node++ %
+                                                      topology.node_count];
+            CPU_AND(&node_mask, &node_mask, &allowed);
+
+            if (CPU_COUNT(&node_mask) > 0) {
+                *mask = node_mask;
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/*
+* Function: affinity_command.
+* Built-in affinity command. Sets the default placement policy for
+* background jobs, or reserves a core for the shell itself.
+*
+* Usage: affinity [off | core | node]
+*        affinity reserve [cpu | off]
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void affinity_command(struct command_line* current_command) {
+    char* names[] = { "unset", "off", "core", "node" };
+
+    load_cpu_topology();
+
+    // No arguments. Show current settings.
+    if (current_command->arg_count == 1) {
+        printf("affinity %s, %d cpus on %d nodes", names[default_affinity],
+               topology.cpu_count, topology.node_count);
+
+        if (topology.reserved_cpu != -1) {
+            printf(", shell reserved on cpu %d", topology.reserved_cpu);
+        }
+
+        printf("\n");
+        fflush(stdout);
+        return;
+    }
+
+    // Keep the shell on its own core.
+    if (strcmp(current_command->arg_variables[1], "reserve") == 0) {
+        char* target = current_command->arg_variables[2];
+
+        // Release the reserved core.
+        if (target == NULL || strcmp(target, "off") == 0) {
+            topology.reserved_cpu = -1;
+            sched_setaffinity(0, sizeof(cpu_set_t), &topology.shell_mask);
+            return;
+        }
+
+        char* end;
+        long cpu = strtol(target, &end, 10);
+
+        if (*end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE ||
+            !CPU_ISSET(cpu, &topology.shell_mask)) {
+            printf("affinity: cpu %s is not available\n", target);
+            fflush(stdout);
+            return;
+        }
+
+        cpu_set_t shell_cpu;
+        CPU_ZERO(&shell_cpu);
+        CPU_SET(cpu, &shell_cpu);
+
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &shell_cpu) == -1) {
+            perror("affinity");
+            return;
+        }
+
+        topology.reserved_cpu = cpu;
+        return;
+    }
+
+    // Set the default policy.
+    int policy = parse_affinity_policy(current_command->arg_variables[1]);
+
+    if (policy == AFFINITY_UNSET) {
+        printf("affinity: unknown policy %s\n", current_command->arg_variables[1]);
+        fflush(stdout);
+        return;
+    }
+
+    default_affinity = policy;
+}
+
+
+/*
+* Function: parse_priority.
+* Parses a nice=, ionice=, or sched= token into a priority structure.
+*
+* Parameter: priority (pointer to the structure to fill)
+*            token (priority candidate)
+* Return: true if the token was a valid priority setting. false otherwise.
+*/
+bool parse_priority(struct job_priority* priority, char* token) {
+    char* end;
+
+    // Nice value between -20 and 19.
+    if (strncmp(token, "nice=", 5) == 0) {
+        long nice_value = strtol(token + 5, &end, 10);
+
+        if (token[5] == '\0' || *end != '\0' || nice_value < -20 || nice_value > 19) {
+            printf("nice: invalid value %s\n", token + 5);
+            fflush(stdout);
+            return false;
+        }
+
+        priority->has_nice = true;
+        priority->nice = nice_value;
+        return true;
+    }
+
+    // I/O class with optional level: idle, be[:0-7], or rt[:0-7].
+    if (strncmp(token, "ionice=", 7) == 0) {
+        char* class_name = token + 7;
+        char* level = strchr(class_name, ':');
+        int class_length = level ? level - class_name : (int) strlen(class_name);
+        int io_class = 0;
+        long io_level = 4;
+
+        if (class_length == 4 && strncmp(class_name, "idle", 4) == 0) {
+            io_class = IOPRIO_CLASS_IDLE;
+            io_level = 0;
+        } else if (class_length == 2 && strncmp(class_name, "be", 2) == 0) {
+            io_class = IOPRIO_CLASS_BE;
+        } else if (class_length == 2 && strncmp(class_name, "rt", 2) == 0) {
+            io_class = IOPRIO_CLASS_RT;
+        }
+
+        if (level != NULL && io_class != IOPRIO_CLASS_IDLE) {
+            io_level = strtol(level + 1, &end, 10);
+
+            if (level[1] == '\0' || *end != '\0') {
+                io_class = 0;
+            }
+        }
+
+        if (io_class == 0 || io_level < 0 || io_level > 7) {
+            printf("ionice: invalid class %s\n", class_name);
+            fflush(stdout);
+            return false;
+        }
+
+        priority->ioprio_class = io_class;
+        priority->ioprio_level = io_level;
+        return true;
+    }
+
+    // CPU scheduling class: other, batch, or idle.
+    if (strncmp(token, "sched=", 6) == 0) {
+        char* policy_name = token + 6;
+
+        if (strcmp(policy_name, "other") == 0) {
+            priority->sched_policy = SCHED_OTHER;
+        } else if (strcmp(policy_name, "batch") == 0) {
+            priority->sched_policy = SCHED_BATCH;
+        } else if (strcmp(policy_name, "idle") == 0) {
+            priority->sched_policy = SCHED_IDLE;
+        } else {
+            printf("sched: unknown class %s\n", policy_name);
+            fflush(stdout);
+            return false;
+        }
+
+        priority->has_sched = true;
+        return true;
+    }
+
+    return false;
+}
+
+
+/*
+* Function: is_priority_setting.
+* Checks whether a token names a priority key, whatever its value.
+*
+* Parameter: token (setting candidate)
+* Return: true for nice=, ionice=, and sched= tokens.
+*/
+bool is_priority_setting(char* token) {
+    return strncmp(token, "nice=", 5) == 0 || strncmp(token, "ionice=", 7) == 0 ||
+           strncmp(token, "sched=", 6) == 0;
+}
+
+
+/*
+* Function: apply_priority.
+* Applies nice, I/O priority, and scheduling class in the child before exec.
+* Settings from the command's prefixes win over the background defaults.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void apply_priority(struct command_line* current_command) {
+    struct job_priority* own = &current_command->priority;
+    struct job_priority none = {0};
+    struct job_priority* fallback = current_command->is_background ?
+                                    &background_priority : &none;
+
+    // Scheduling class. Set first since it resets nothing else.
+    if (own->has_sched || fallback->has_sched) {
+        struct sched_param param = {0};
+        int policy = own->has_sched ? own->sched_policy : fallback->sched_policy;
+
+        if (sched_setscheduler(0, policy, &param) == -1) {
+            perror("sched");
+        }
+    }
+
+    // Nice value.
+    if (own->has_nice || fallback->has_nice) {
+        int nice_value = own->has_nice ? own->nice : fallback->nice;
+
+        if (setpriority(PRIO_PROCESS, 0, nice_value) == -1) {
+            perror("nice");
+        }
+    }
+
+    // I/O priority.
+    if (own->ioprio_class != 0 || fallback->ioprio_class != 0) {
+        struct job_priority* io = own->ioprio_class != 0 ? own : fallback;
+
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                    IOPRIO_PRIO_VALUE(io->ioprio_class, io->ioprio_level)) == -1) {
+            perror("ionice");
+        }
+    }
+}
+
+
+/*
+* Function: bgpolicy_command.
+* Built-in bgpolicy command. Sets the priorities applied to every
+* background job that does not override them with a prefix.
+*
+* Usage: bgpolicy [nice=N] [ionice=CLASS[:LEVEL]] [sched=CLASS]
+*        bgpolicy reset
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void bgpolicy_command(struct command_line* current_command) {
+    char* io_names[] = { "none", "rt", "be", "idle" };
+    char* sched_names[] = { "other", "fifo", "rr", "batch", "iso", "idle" };
+
+    // No arguments. Show current policy.
+    if (current_command->arg_count == 1) {
+        printf("bgpolicy");
+
+        if (background_priority.has_nice) {
+            printf(" nice=%d", background_priority.nice);
+        }
+
+        if (background_priority.ioprio_class != 0) {
+            printf(" ionice=%s:%d", io_names[background_priority.ioprio_class],
+                   background_priority.ioprio_level);
+        }
+
+        if (background_priority.has_sched) {
+            printf(" sched=%s", sched_names[background_priority.sched_policy]);
+        }
+
+        printf("\n");
+        fflush(stdout);
+        return;
+    }
+
+    // Clear the policy.
+    if (strcmp(current_command->arg_variables[1], "reset") == 0) {
+        memset(&background_priority, 0, sizeof(background_priority));
+        return;
+    }
+
+    // Apply all settings or none of them.
+    struct job_priority updated = background_priority;
+
+    for (int i = 1; i < current_command->arg_count; i++) {
+        char* setting = current_command->arg_variables[i];
+
+        // Unknown keys are reported here. Bad values by parse_priority.
+        if (!is_priority_setting(setting)) {
+            printf("bgpolicy: unknown setting %s\n", setting);
+            fflush(stdout);
+            return;
+        }
+
+        if (!parse_priority(&updated, setting)) {
+            return;
+        }
+    }
+
+    background_priority = updated;
+}
+
+
+/*
+* Function: read_line.
+* Reads one line of input into buffer. Waits on the event loop rather
+* than blocking in read, so queued jobs can launch while the user types.
+*
+* Parameter: buffer (destination for the line)
+*            size (size of buffer)
+* Return: true if a line was read. false on a blank read or end of input.
+*/
+bool read_line(char* buffer, int size) {
+    static char pending[INPUT_LENGTH * 2];
+    static int pending_length = 0;
+
+    // Replay. Lines come from the recording at its pace.
+    if (session.replay_file != NULL) {
+        return replay_line(buffer, size);
+    }
+
+    editor_raw_mode(true);
+
+    while (true) {
+
+        // Terminal. Feed typed keys to the line editor.
+        if (editor.is_terminal) {
+            int used = 0;
+            bool is_done = false;
+
+            while (used < pending_length && !is_done && !input_closed) {
+                is_done = editor_key(pending[used++]);
+            }
+
+            pending_length -= used;
+            memmove(pending, pending + used, pending_length);
+
+            if (is_done || (input_closed && editor.length > 0)) {
+                int copy_length = editor.length < size - 2 ? editor.length : size - 2;
+
+                memcpy(buffer, editor.line, copy_length);
+                buffer[copy_length] = '\n';
+                buffer[copy_length + 1] = '\0';
+                editor.length = 0;
+
+                editor_raw_mode(false);
+                return true;
+            }
+
+        // Script or pipe. Return a complete line if one is buffered.
+        } else {
+            char* newline = memchr(pending, '\n', pending_length);
+
+            if (newline != NULL || pending_length >= size - 1 ||
+                (input_closed && pending_length > 0)) {
+
+                int line_length = newline ? newline - pending + 1 : pending_length;
+                int copy_length = line_length < size - 1 ? line_length : size - 1;
+
+                memcpy(buffer, pending, copy_length);
+                buffer[copy_length] = '\0';
+
+                pending_length -= line_length;
+                memmove(pending, pending + line_length, pending_length);
+                return true;
+            }
+        }
+
+        if (input_closed) {
+            editor_raw_mode(false);
+            return false;
+        }
+
+        wait_for_input(-1);
+
+        // Read whatever is available.
+        ssize_t bytes_read = read(STDIN_FILENO, pending + pending_length,
+                                  sizeof(pending) - pending_length);
+
+        if (bytes_read == 0) {
+            input_closed = true;
+        } else if (bytes_read > 0) {
+            pending_length += bytes_read;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            input_closed = true;
+        }
+    }
+}
+
+
+/*
+* Function: parse_options.
+* Parses command line options for session recording and replay.
+*
+* Parameter: argc (argument count)
+*            argv (arguments)
+* Return: false on a bad option.
+*/
+bool parse_options(int argc, char* argv[]) {
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+
+        if (strcmp(argv[i], "--record") == 0 && has_value) {
+            session.record_file = fopen(argv[++i], "w");
+
+            if (session.record_file == NULL) {
+                perror(argv[i]);
+                return false;
+            }
+
+            fprintf(session.record_file, "# smallsh session: delay_ms duration_ms status line\n");
+
+        } else if (strcmp(argv[i], "--replay") == 0 && has_value) {
+            session.replay_file = fopen(argv[++i], "r");
+
+            if (session.replay_file == NULL) {
+                perror(argv[i]);
+                return false;
+            }
+
+        } else if (strcmp(argv[i], "--speed") == 0 && has_value) {
+            session.speed = atof(argv[++i]);
+
+            if (session.speed <= 0) {
+                printf("smallsh: speed must be positive\n");
+                return false;
+            }
+
+        } else {
+            printf("usage: smallsh [--record FILE] [--replay FILE [--speed X]]\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+* Function: replay_line.
+* Reads the next recorded line and waits until it is due: the recorded
+* think time, divided by the speed, after the prompt. The event loop
+* keeps running meanwhile.
+*
+* Parameter: buffer (destination for the line)
+*            size (size of buffer)
+* Return: true if a line was read. false at the end of the recording.
+*/
+bool replay_line(char* buffer, int size) {
+    char row[INPUT_LENGTH + 128];
+
+    while (fgets(row, sizeof(row), session.replay_file) != NULL) {
+        char* fields[4] = { row };
+
+        // Split off the three numbers. The line itself may hold tabs.
+        for (int i = 1; i < 4 && fields[i - 1] != NULL; i++) {
+            fields[i] = strchr(fields[i - 1], '\t');
+
+            if (fields[i] != NULL) {
+                *fields[i]++ = '\0';
+            }
+        }
+
+        if (row[0] == '#' || fields[3] == NULL) {
+            continue;
+        }
+
+        long long delay_ms = atoll(fields[0]);
+
+        wait_for_input(session.prompt_at + (long long) (delay_ms / session.speed));
+
+        snprintf(buffer, size, "%s", fields[3]);
+
+        // Echo the line as if it had been typed.
+        shell_printf("%s", buffer);
+        shell_flush();
+
+        session.has_expected = true;
+        session.expected_ms = atoll(fields[1]);
+        session.expected_status = atoi(fields[2]);
+        return true;
+    }
+
+    input_closed = true;
+    return false;
+}
+
+
+/*
+* Function: session_line.
+* Notes an input line and when it arrived.
+*
+* Parameter: line (input line with its newline)
+* Return: none.
+*/
+void session_line(char* line) {
+
+    if (session.record_file == NULL && session.replay_file == NULL) {
+        return;
+    }
+
+    session.line_at = monotonic_ms();
+    session.has_line = true;
+    snprintf(session.line, sizeof(session.line), "%s", line);
+    session.line[strcspn(session.line, "\n")] = '\0';
+}
+
+
+/*
+* Function: session_outcome.
+* Called when the shell is about to prompt again. Records the previous
+* line and, when replaying, compares its latency with the recording.
+*
+* Parameter: none.
+* Return: none.
+*/
+void session_outcome() {
+    long long now = monotonic_ms();
+
+    if (session.has_line) {
+        long long duration_ms = now - session.line_at;
+
+        if (session.record_file != NULL) {
+            fprintf(session.record_file, "%lld\t%lld\t%d\t%s\n",
+                    session.line_at - session.prompt_at, duration_ms,
+                    latest_status, session.line);
+        }
+
+        if (session.has_expected) {
+            if (session.delta_count == session.delta_capacity) {
+                session.delta_capacity = session.delta_capacity ? session.delta_capacity * 2 : 256;
+                session.deltas = realloc(session.deltas,
+                                         session.delta_capacity * sizeof(long long));
+            }
+
+            session.deltas[session.delta_count++] = duration_ms - session.expected_ms;
+            session.recorded_total += session.expected_ms;
+            session.replayed_total += duration_ms;
+
+            if (session.expected_status != latest_status) {
+                session.status_mismatches++;
+            }
+        }
+    }
+
+    session.has_line = false;
+    session.has_expected = false;
+    session.prompt_at = now;
+}
+
+
+/*
+* Function: compare_deltas.
+* qsort comparison for latency deltas.
+*
+* Parameter: left, right (pointers to long long)
+* Return: negative, zero, or positive.
+*/
+int compare_deltas(const void* left, const void* right) {
+    long long a = *(const long long*) left;
+    long long b = *(const long long*) right;
+
+    return (a > b) - (a < b);
+}
+
+
+/*
+* Function: session_finish.
+* Logs the last line, closes the recording, and prints the replay report.
+*
+* Parameter: none.
+* Return: none.
+*/
+void session_finish() {
+
+    session_outcome();
+
+    if (session.record_file != NULL) {
+        fclose(session.record_file);
+        session.record_file = NULL;
+    }
+
+    if (session.replay_file == NULL || session.delta_count == 0) {
+        return;
+    }
+
+    int count = session.delta_count;
+
+    qsort(session.deltas, count, sizeof(long long), compare_deltas);
+
+    shell_printf("replay: %d lines at %.2fx, recorded %lld ms, replayed %lld ms\n",
+                 count, session.speed, session.recorded_total, session.replayed_total);
+    shell_printf("replay: latency delta ms p50 %lld p90 %lld p99 %lld max %lld\n",
+                 session.deltas[count / 2], session.deltas[count * 9 / 10],
+                 session.deltas[count * 99 / 100], session.deltas[count - 1]);
+    shell_printf("replay: %d status mismatches\n", session.status_mismatches);
+}
+
+
+/*
+* Function: wait_for_input.
+* Event loop used while the shell is idle at the prompt. Waits for
+* standard input, PSI triggers, and the admission recheck timer.
+*
+* Parameter: deadline (monotonic ms to return at. -1 for none)
+* Return: none.
+*/
+void wait_for_input(long long deadline) {
+    struct shell_event ready[MAX_EVENTS];
+
+    while (true) {
+
+        // Wake periodically only while jobs are waiting in queues.
+        int timeout = queued_job_count > 0 ? ADMISSION_TICK_MS : -1;
+
+        // Work on redirected files behind running jobs.
+        if (io_streams != NULL) {
+            io_streams_tick();
+            timeout = (timeout == -1 || WRITE_BEHIND_TICK_MS < timeout) ?
+                      WRITE_BEHIND_TICK_MS : timeout;
+        }
+
+        // Wake when the next replayed line is due.
+        if (deadline != -1) {
+            long long due = deadline - monotonic_ms();
+
+            if (due <= 0) {
+                return;
+            }
+            timeout = (timeout == -1 || due < timeout) ? due : timeout;
+        }
+
+        // Wake when held back exits are due to be reported.
+        if (children_pending) {
+            long long due = last_notice_at + NOTICE_INTERVAL_MS - monotonic_ms();
+
+            due = due > 0 ? due : 0;
+            timeout = (timeout == -1 || due < timeout) ? due : timeout;
+        }
+
+        int ready_count = events_wait(ready, MAX_EVENTS, timeout);
+        bool has_input = false;
+
+        if (ready_count == -1 && errno != EINTR) {
+            return;
+        }
+
+        for (int i = 0; i < ready_count; i++) {
+
+            // A PSI trigger fired. Hold launches for one window.
+            if (ready[i].tag == EVENT_PRESSURE) {
+                admission.triggered_at = monotonic_ms();
+            }
+
+            if (ready[i].tag == EVENT_INPUT) {
+                has_input = true;
+            }
+
+            // A child changed state.
+            if (ready[i].tag == EVENT_CHILD) {
+                drain_child_events(ready[i].fd);
+                children_pending = true;
+            }
+        }
+
+        // Reap and report at once, unless a notice was just printed.
+        // Exits arriving within the interval are reported together.
+        if (children_pending && monotonic_ms() - last_notice_at >= NOTICE_INTERVAL_MS) {
+            background_tracker();
+            children_pending = false;
+            last_notice_at = monotonic_ms();
+        }
+
+        schedule_jobs();
+        end_notice();
+
+        // One write for everything printed in this iteration.
+        shell_flush();
+
+        if (has_input) {
+            return;
+        }
+    }
+}
+
+
+/*
+* Function: monotonic_ms.
+* Reads the monotonic clock.
+*
+* Parameter: none.
+* Return: milliseconds since an arbitrary starting point.
+*/
+long long monotonic_ms() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+
+/*
+* Function: start_thread.
+* Starts a shell worker thread with every signal blocked, so signals
+* such as SIGCHLD and SIGTSTP stay with the shell's main thread, and a
+* closed pipe gives the worker EPIPE instead of SIGPIPE.
+*
+* Parameter: thread (receives the thread)
+*            body (thread function)
+*            argument (passed to body)
+* Return: false if the thread could not be started.
+*/
+bool start_thread(pthread_t* thread, void* (*body)(void*), void* argument) {
+    sigset_t all_signals;
+    sigset_t saved_signals;
+
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &saved_signals);
+
+    bool is_started = pthread_create(thread, NULL, body, argument) == 0;
+
+    pthread_sigmask(SIG_SETMASK, &saved_signals, NULL);
+    return is_started;
+}
+
+
+/*
+* Function: command_text.
+* Joins the arguments of a command into one string.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: heap allocated string. Caller frees.
+*/
+char* command_text(struct command_line* current_command) {
+    size_t length = 1;
+
+    for (int i = 0; i < current_command->arg_count; i++) {
+        length += strlen(current_command->arg_variables[i]) + 1;
+    }
+
+    char* text = calloc(1, length);
+
+    for (int i = 0; i < current_command->arg_count; i++) {
+        if (i > 0) {
+            strcat(text, " ");
+        }
+        strcat(text, current_command->arg_variables[i]);
+    }
+
+    return text;
+}
+
+
+/*
+* Function: add_background_job.
+* Records a running background job for the jobs command.
+*
+* Parameter: pid (process id of the job)
+*            current_command (pointer to the structure)
+* Return: none.
+*/
+void add_background_job(pid_t pid, struct command_line* current_command) {
+    struct job_table* jobs = &background_jobs;
+
+    if (jobs->count == jobs->capacity) {
+        grow_job_table();
+    }
+
+    int i = jobs->count++;
+
+    jobs->pids[i] = pid;
+    jobs->states[i] = JOB_RUNNING | (current_command->is_predicted ? JOB_PREDICTED : 0) |
+                      (current_command->is_detached ? JOB_DETACHED : 0);
+    jobs->started_at[i] = current_command->started_at;
+    jobs->queue_indexes[i] = current_command->queue_index;
+    jobs->model_indexes[i] = current_command->model_index;
+    jobs->predicted_ms[i] = current_command->predicted_ms;
+    store_job_text(i, current_command);
+    index_background_job(pid, i);
+
+    job_queues[current_command->queue_index].running++;
+}
+
+
+/*
+* Function: grow_job_table.
+* Doubles every array of the job table. The pid index is rebuilt at
+* twice the table size so it stays at most half full.
+*
+* Parameter: none.
+* Return: none.
+*/
+void grow_job_table() {
+    struct job_table* jobs = &background_jobs;
+    int capacity = jobs->capacity ? jobs->capacity * 2 : 16;
+
+    jobs->pids = realloc(jobs->pids, capacity * sizeof(pid_t));
+    jobs->states = realloc(jobs->states, capacity * sizeof(unsigned char));
+    jobs->started_at = realloc(jobs->started_at, capacity * sizeof(long long));
+    jobs->queue_indexes = realloc(jobs->queue_indexes, capacity * sizeof(int));
+    jobs->model_indexes = realloc(jobs->model_indexes, capacity * sizeof(int));
+    jobs->predicted_ms = realloc(jobs->predicted_ms, capacity * sizeof(double));
+    jobs->text_offsets = realloc(jobs->text_offsets, capacity * sizeof(unsigned));
+    jobs->text_lengths = realloc(jobs->text_lengths, capacity * sizeof(unsigned));
+    jobs->capacity = capacity;
+
+    free(jobs->index);
+    jobs->index_size = capacity * 2;
+    jobs->index = malloc(jobs->index_size * sizeof(int));
+    memset(jobs->index, -1, jobs->index_size * sizeof(int));
+
+    for (int i = 0; i < jobs->count; i++) {
+        index_background_job(jobs->pids[i], i);
+    }
+}
+
+
+/*
+* Function: store_job_text.
+* Appends a job's command text to the arena. The text is not null
+* terminated; use its offset and length.
+*
+* Parameter: job_index (index of the job)
+*            current_command (pointer to the structure)
+* Return: none.
+*/
+void store_job_text(int job_index, struct command_line* current_command) {
+    struct job_table* jobs = &background_jobs;
+    char* text = command_text(current_command);
+    unsigned length = strlen(text);
+
+    // Reclaim space from finished jobs before growing.
+    if (jobs->arena_length + length > jobs->arena_capacity &&
+        jobs->arena_garbage > jobs->arena_length / 2) {
+        compact_job_arena();
+    }
+
+    if (jobs->arena_length + length > jobs->arena_capacity) {
+        unsigned capacity = jobs->arena_capacity ? jobs->arena_capacity : ARENA_MINIMUM;
+
+        while (jobs->arena_length + length > capacity) {
+            capacity *= 2;
+        }
+
+        jobs->arena = realloc(jobs->arena, capacity);
+        jobs->arena_capacity = capacity;
+    }
+
+    memcpy(jobs->arena + jobs->arena_length, text, length);
+    jobs->text_offsets[job_index] = jobs->arena_length;
+    jobs->text_lengths[job_index] = length;
+    jobs->arena_length += length;
+
+    free(text);
+}
+
+
+/*
+* Function: compact_job_arena.
+* Copies the text of running jobs to the front of a fresh arena,
+* dropping the text of finished jobs.
+*
+* Parameter: none.
+* Return: none.
+*/
+void compact_job_arena() {
+    struct job_table* jobs = &background_jobs;
+    char* arena = malloc(jobs->arena_capacity);
+    unsigned length = 0;
+
+    for (int i = 0; i < jobs->count; i++) {
+        memcpy(arena + length, jobs->arena + jobs->text_offsets[i], jobs->text_lengths[i]);
+        jobs->text_offsets[i] = length;
+        length += jobs->text_lengths[i];
+    }
+
+    free(jobs->arena);
+    jobs->arena = arena;
+    jobs->arena_length = length;
+    jobs->arena_garbage = 0;
+}
+
+
+/*
+* Function: remove_background_job.
+* Forgets a background job once it has been reaped, and feeds its
+* run time to the duration model. Constant time: the job is found
+* through the pid index and the last job moves into its slot.
+*
+* Parameter: pid (process id of the job)
+*            child_status (wait status of the job)
+* Return: wait status to report. Failing if a compressed stream failed.
+*/
+int remove_background_job(pid_t pid, int child_status) {
+    struct job_table* jobs = &background_jobs;
+    int i = find_background_job(pid);
+
+    if (i == -1) {
+        return child_status;
+    }
+
+    if (codec_streams != NULL && !finish_codec_streams(pid) &&
+        WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0) {
+        child_status = 1 << 8;
+    }
+
+    record_duration(jobs->model_indexes[i], jobs->predicted_ms[i],
+                    (jobs->states[i] & JOB_PREDICTED) != 0,
+                    jobs->started_at[i], child_status);
+
+    // Leave the exit status for shells that attach later.
+    if (jobs->states[i] & JOB_DETACHED) {
+        finish_detached_record(pid, child_status);
+    }
+
+    finish_io_streams(pid);
+
+    if (pending_outputs != NULL) {
+        finish_atomic_output(pid, child_status);
+    }
+
+    job_queues[jobs->queue_indexes[i]].running--;
+    jobs->arena_garbage += jobs->text_lengths[i];
+    unindex_background_job(pid);
+
+    // Fill the hole with the last job.
+    int last = --jobs->count;
+
+    if (i != last) {
+        unindex_background_job(jobs->pids[last]);
+
+        jobs->pids[i] = jobs->pids[last];
+        jobs->states[i] = jobs->states[last];
+        jobs->started_at[i] = jobs->started_at[last];
+        jobs->queue_indexes[i] = jobs->queue_indexes[last];
+        jobs->model_indexes[i] = jobs->model_indexes[last];
+        jobs->predicted_ms[i] = jobs->predicted_ms[last];
+        jobs->text_offsets[i] = jobs->text_offsets[last];
+        jobs->text_lengths[i] = jobs->text_lengths[last];
+
+        index_background_job(jobs->pids[i], i);
+    }
+
+    // No jobs left. Start the arena over.
+    if (jobs->count == 0) {
+        jobs->arena_length = 0;
+        jobs->arena_garbage = 0;
+    }
+
+    return child_status;
+}
+
+
+/*
+* Function: terminate_background_jobs.
+* Sends SIGTERM to every running background job that was not disowned
+* or detached.
+*
+* Parameter: none.
+* Return: none.
+*/
+void terminate_background_jobs() {
+
+    for (int i = 0; i < background_jobs.count; i++) {
+        if (!(background_jobs.states[i] & (JOB_DISOWNED | JOB_DETACHED))) {
+            kill(background_jobs.pids[i], SIGTERM);
+        }
+    }
+}
+
+
+/*
+* Function: hash_pid.
+* Mixes a pid into a hash value. Pids are sequential, so the bits are
+* spread before masking.
+*
+* Parameter: pid (process id)
+* Return: hash value.
+*/
+unsigned hash_pid(pid_t pid) {
+    unsigned hash = (unsigned) pid;
+
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bU;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+
+/*
+* Function: hash_text.
+* FNV-1a hash of a string.
+*
+* Parameter: text (string to hash)
+* Return: hash value.
+*/
+unsigned hash_text(char* text) {
+    unsigned hash = 2166136261U;
+
+    while (*text) {
+        hash ^= (unsigned char) *text++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+
+/*
+* Function: find_background_job.
+* Looks up a background job by pid in the open addressing pid index.
+*
+* Parameter: pid (process id of the job)
+* Return: index into the job table. -1 if not found.
+*/
+int find_background_job(pid_t pid) {
+
+    if (background_jobs.index_size == 0) {
+        return -1;
+    }
+
+    unsigned mask = background_jobs.index_size - 1;
+
+    for (unsigned slot = hash_pid(pid) & mask; background_jobs.index[slot] != -1;
+         slot = (slot + 1) & mask) {
+        if (background_jobs.pids[background_jobs.index[slot]] == pid) {
+            return background_jobs.index[slot];
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+* Function: index_background_job.
+* Adds a pid to the pid index.
+*
+* Parameter: pid (process id of the job)
+*            job_index (index into the job table)
+* Return: none.
+*/
+void index_background_job(pid_t pid, int job_index) {
+    unsigned mask = background_jobs.index_size - 1;
+    unsigned slot = hash_pid(pid) & mask;
+
+    while (background_jobs.index[slot] != -1) {
+        slot = (slot + 1) & mask;
+    }
+
+    background_jobs.index[slot] = job_index;
+}
+
+
+/*
+* Function: unindex_background_job.
+* Removes a pid from the pid index. Later entries of the probe chain
+* are shifted back so lookups need no tombstones.
+*
+* Parameter: pid (process id of the job)
+* Return: none.
+*/
+void unindex_background_job(pid_t pid) {
+    unsigned mask = background_jobs.index_size - 1;
+    unsigned slot = hash_pid(pid) & mask;
+
+    while (background_jobs.index[slot] != -1 &&
+           background_jobs.pids[background_jobs.index[slot]] != pid) {
+        slot = (slot + 1) & mask;
+    }
+
+    if (background_jobs.index[slot] == -1) {
+        return;
+    }
+
+    // Backward shift deletion.
+    unsigned hole = slot;
+
+    for (unsigned next = (slot + 1) & mask; background_jobs.index[next] != -1;
+         next = (next + 1) & mask) {
+        unsigned home = hash_pid(background_jobs.pids[background_jobs.index[next]]) & mask;
+
+        // Move the entry back if its home is not between the hole and it.
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            background_jobs.index[hole] = background_jobs.index[next];
+            hole = next;
+        }
+    }
+
+    background_jobs.index[hole] = -1;
+}
+
+
+/*
+* Function: jobs_command.
+* Built-in jobs command. Lists running and queued background jobs.
+* jobs -d lists detached jobs of any shell; jobs -d clean also removes
+* the records of finished ones.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void jobs_command(struct command_line* current_command) {
+
+    struct job_table* jobs = &background_jobs;
+
+    // Detached jobs from the state directory.
+    if (current_command->arg_count > 1 &&
+        strcmp(current_command->arg_variables[1], "-d") == 0) {
+        bool is_cleaning = current_command->arg_count > 2 &&
+                           strcmp(current_command->arg_variables[2], "clean") == 0;
+
+        list_detached_jobs(is_cleaning);
+        return;
+    }
+
+    // Running jobs.
+    for (int i = 0; i < jobs->count; i++) {
+        char* state = "running";
+
+        if (jobs->states[i] & JOB_DETACHED) {
+            state = "detach ";
+        } else if (jobs->states[i] & JOB_DISOWNED) {
+            state = "disown ";
+        }
+
+        printf("%s %d  [%s]  %.*s\n", state, jobs->pids[i],
+               job_queues[jobs->queue_indexes[i]].name, (int) jobs->text_lengths[i],
+               jobs->arena + jobs->text_offsets[i]);
+    }
+
+    // Jobs waiting in each queue, in launch order.
+    for (int i = 0; i < job_queue_count; i++) {
+        int position = 1;
+
+        for (struct command_line* queued = job_queues[i].head; queued != NULL;
+             queued = queued->next) {
+            char* text = command_text(queued);
+
+            printf("queued  #%d  [%s]  %s\n", position++, job_queues[i].name, text);
+            free(text);
+        }
+    }
+
+    if (admission.enabled || queued_job_count > 0) {
+        printf("queue depth %d", queued_job_count);
+
+        for (int i = 0; i < PRESSURE_COUNT; i++) {
+            double average;
+
+            if (read_pressure(i, &average)) {
+                printf(", %s %.1f%%", pressure_names[i], average);
+            }
+        }
+
+        printf("\n");
+    }
+
+    fflush(stdout);
+}
+
+
+/*
+* Function: state_directory.
+* Directory for detached job records and output. Uses
+* $XDG_STATE_HOME/smallsh or ~/.local/state/smallsh and creates it.
+*
+* Parameter: none.
+* Return: path string. NULL if no location is known.
+*/
+char* state_directory() {
+    static char path[4096];
+    char* state_home = getenv("XDG_STATE_HOME");
+    char* home = getenv("HOME");
+
+    if (state_home != NULL && state_home[0] != '\0') {
+        snprintf(path, sizeof(path), "%s/smallsh", state_home);
+    } else if (home != NULL) {
+        snprintf(path, sizeof(path), "%s/.local/state/smallsh", home);
+    } else {
+        return NULL;
+    }
+
+    // Create each missing level.
+    for (char* slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0700);
+        *slash = '/';
+    }
+
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        return NULL;
+    }
+
+    return path;
+}
+
+
+/*
+* Function: process_start_time.
+* Reads when a process started, in clock ticks since boot. Together
+* with the pid this tells a detached job from a later process that
+* reused its pid.
+*
+* Parameter: pid (process id)
+* Return: start time. 0 if the process does not exist or has exited.
+*/
+unsigned long long process_start_time(pid_t pid) {
+    char path[64];
+    char line[1024];
+    unsigned long long start_time = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    FILE* file = fopen(path, "r");
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    // Fields after the command name, which may hold spaces. Start time
+    // is field 22, the 20th after the name.
+    if (fgets(line, sizeof(line), file) != NULL) {
+        char* field = strrchr(line, ')');
+
+        // An unreaped zombie has already exited.
+        if (field != NULL && field[1] == ' ' && field[2] == 'Z') {
+            field = NULL;
+        }
+
+        for (int i = 0; field != NULL && i < 20; i++) {
+            field = strchr(field + 1, ' ');
+        }
+
+        if (field != NULL) {
+            start_time = strtoull(field + 1, NULL, 10);
+        }
+    }
+
+    fclose(file);
+    return start_time;
+}
+
+
+/*
+* Function: open_capture_file.
+* Runs in a detached child. Sends standard output and error to
+* <state>/<pid>.out.
+*
+* Parameter: none.
+* Return: none.
+*/
+void open_capture_file() {
+    char path[4200];
+    char* directory = state_directory();
+
+    if (directory == NULL) {
+        printf("detach: no state directory\n");
+        fflush(stdout);
+        _exit(1);
+    }
+
+    snprintf(path, sizeof(path), "%s/%d.out", directory, getpid());
+
+    int capture_descriptor = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+
+    if (capture_descriptor == -1) {
+        printf("cannot open %s for output\n", path);
+        fflush(stdout);
+        _exit(1);
+    }
+
+    dup2(capture_descriptor, STDOUT_FILENO);
+    dup2(capture_descriptor, STDERR_FILENO);
+    close(capture_descriptor);
+}
+
+
+/*
+* Function: write_detached_record.
+* Writes <state>/<pid>.job with the pid, start time, and command.
+*
+* Parameter: pid (process id of the job)
+*            current_command (pointer to the structure)
+* Return: none.
+*/
+void write_detached_record(pid_t pid, struct command_line* current_command) {
+    char path[4200];
+    char* directory = state_directory();
+
+    if (directory == NULL) {
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/%d.job", directory, pid);
+
+    FILE* file = fopen(path, "w");
+
+    if (file == NULL) {
+        perror("detach");
+        return;
+    }
+
+    char* text = command_text(current_command);
+
+    fprintf(file, "pid %d\nstart %llu\ncommand %s\n", pid, process_start_time(pid), text);
+    fclose(file);
+    free(text);
+}
+
+
+/*
+* Function: finish_detached_record.
+* Appends the exit status of a detached job reaped by this shell.
+*
+* Parameter: pid (process id of the job)
+*            child_status (wait status)
+* Return: none.
+*/
+void finish_detached_record(pid_t pid, int child_status) {
+    char path[4200];
+    char* directory = state_directory();
+
+    if (directory == NULL) {
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/%d.job", directory, pid);
+
+    FILE* file = fopen(path, "a");
+
+    if (file != NULL) {
+        fprintf(file, "status %d\n", child_status);
+        fclose(file);
+    }
+}
+
+
+/*
+* Function: read_detached_record.
+* Reads <state>/<pid>.job.
+*
+* Parameter: pid (process id of the job)
+*            record (filled in)
+* Return: true if the record exists.
+*/
+bool read_detached_record(pid_t pid, struct detached_record* record) {
+    char path[4200];
+    char line[INPUT_LENGTH + 16];
+    char* directory = state_directory();
+
+    if (directory == NULL) {
+        return false;
+    }
+
+    snprintf(path, sizeof(path), "%s/%d.job", directory, pid);
+
+    FILE* file = fopen(path, "r");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    memset(record, 0, sizeof(*record));
+    record->pid = pid;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (strncmp(line, "start ", 6) == 0) {
+            record->start_time = strtoull(line + 6, NULL, 10);
+        } else if (strncmp(line, "command ", 8) == 0) {
+            snprintf(record->command, sizeof(record->command), "%.*s", INPUT_LENGTH - 1, line + 8);
+        } else if (strncmp(line, "status ", 7) == 0) {
+            record->has_status = true;
+            record->status = atoi(line + 7);
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+
+/*
+* Function: detached_is_running.
+* Checks that the recorded process still runs and its pid was not reused.
+*
+* Parameter: record (detached job record)
+* Return: true if the job is running.
+*/
+bool detached_is_running(struct detached_record* record) {
+    return !record->has_status && record->start_time != 0 &&
+           process_start_time(record->pid) == record->start_time;
+}
+
+
+/*
+* Function: list_detached_jobs.
+* Prints every detached job in the state directory with its state.
+*
+* Parameter: is_cleaning (remove records and output of finished jobs)
+* Return: none.
+*/
+void list_detached_jobs(bool is_cleaning) {
+    char* directory = state_directory();
+    DIR* state = directory != NULL ? opendir(directory) : NULL;
+
+    if (state == NULL) {
+        printf("jobs: no state directory\n");
+        fflush(stdout);
+        return;
+    }
+
+    struct dirent* entry;
+
+    while ((entry = readdir(state)) != NULL) {
+        struct detached_record record;
+        char* end;
+        pid_t pid = strtol(entry->d_name, &end, 10);
+
+        if (pid <= 0 || strcmp(end, ".job") != 0 || !read_detached_record(pid, &record)) {
+            continue;
+        }
+
+        if (detached_is_running(&record)) {
+            printf("detached %d  running  %s\n", pid, record.command);
+            continue;
+        }
+
+        if (record.has_status && WIFEXITED(record.status)) {
+            printf("detached %d  exit value %d  %s\n", pid,
+                   WEXITSTATUS(record.status), record.command);
+        } else if (record.has_status && WIFSIGNALED(record.status)) {
+            printf("detached %d  terminated by signal %d  %s\n", pid,
+                   WTERMSIG(record.status), record.command);
+
+        // Reaped after its shell exited. Status unknown.
+        } else {
+            printf("detached %d  finished  %s\n", pid, record.command);
+        }
+
+        if (is_cleaning) {
+            char path[4200];
+
+            snprintf(path, sizeof(path), "%s/%d.job", directory, pid);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s/%d.out", directory, pid);
+            unlink(path);
+        }
+    }
+
+    closedir(state);
+    fflush(stdout);
+}
+
+
+/*
+* Function: disown_command.
+* Built-in disown command. Keeps the given background jobs, or all of
+* them, running when the shell exits.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void disown_command(struct command_line* current_command) {
+    struct job_table* jobs = &background_jobs;
+
+    if (current_command->arg_count == 1) {
+        for (int i = 0; i < jobs->count; i++) {
+            jobs->states[i] |= JOB_DISOWNED;
+        }
+        return;
+    }
+
+    for (int i = 1; i < current_command->arg_count; i++) {
+        int job_index = find_background_job(atoi(current_command->arg_variables[i]));
+
+        if (job_index == -1) {
+            printf("disown: no background job %s\n", current_command->arg_variables[i]);
+            fflush(stdout);
+            continue;
+        }
+
+        jobs->states[job_index] |= JOB_DISOWNED;
+    }
+}
+
+
+/*
+* Function: copy_capture.
+* Copies new output from a capture file to standard output.
+*
+* Parameter: capture_fd (capture file, read from its current offset)
+* Return: false if standard output failed.
+*/
+bool copy_capture(int capture_fd) {
+    char buffer[65536];
+    ssize_t length;
+
+    while ((length = read(capture_fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t written = 0; written < length; ) {
+            ssize_t result = write(STDOUT_FILENO, buffer + written, length - written);
+
+            if (result == -1) {
+                return false;
+            }
+            written += result;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+* Function: attach_command.
+* Built-in attach command. Prints a detached job's output so far, then
+* follows it until the job exits or Enter is pressed. New output is
+* seen through inotify and the exit through a pidfd, so nothing polls
+* on a timer.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void attach_command(struct command_line* current_command) {
+    struct detached_record record;
+
+    if (current_command->arg_count != 2) {
+        printf("usage: attach PID\n");
+        fflush(stdout);
+        return;
+    }
+
+    pid_t pid = atoi(current_command->arg_variables[1]);
+
+    if (pid <= 0 || !read_detached_record(pid, &record)) {
+        printf("attach: no detached job %s\n", current_command->arg_variables[1]);
+        fflush(stdout);
+        return;
+    }
+
+    char path[4200];
+
+    snprintf(path, sizeof(path), "%s/%d.out", state_directory(), pid);
+
+    int capture_fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (capture_fd == -1) {
+        perror("attach");
+        return;
+    }
+
+    shell_flush();
+
+    // Watch before the first copy so no write falls between the two.
+    int notify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    int pid_fd = syscall(SYS_pidfd_open, pid, 0);
+
+    if (notify_fd != -1) {
+        inotify_add_watch(notify_fd, path, IN_MODIFY);
+    }
+
+    bool is_running = detached_is_running(&record) && pid_fd != -1 && notify_fd != -1;
+
+    copy_capture(capture_fd);
+
+    if (is_running) {
+        struct pollfd watched[3] = {
+            { .fd = notify_fd, .events = POLLIN },
+            { .fd = pid_fd, .events = POLLIN },
+            { .fd = isatty(STDIN_FILENO) ? STDIN_FILENO : -1, .events = POLLIN }
+        };
+
+        while (true) {
+            if (poll(watched, 3, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+
+            // New output. Empty the event queue and copy what was added.
+            if (watched[0].revents & POLLIN) {
+                char events[4096];
+
+                while (read(notify_fd, events, sizeof(events)) > 0) {
+                }
+
+                if (!copy_capture(capture_fd)) {
+                    break;
+                }
+            }
+
+            // Job exited. Pick up its last output.
+            if (watched[1].revents & POLLIN) {
+                copy_capture(capture_fd);
+                printf("detached pid %d has exited\n", pid);
+                break;
+            }
+
+            // Enter detaches and leaves the job running.
+            if (watched[2].revents & POLLIN) {
+                char line[INPUT_LENGTH];
+
+                read(STDIN_FILENO, line, sizeof(line));
+                break;
+            }
+        }
+
+    // Already finished. Report how, if known.
+    } else if (record.has_status && WIFEXITED(record.status)) {
+        printf("detached pid %d is done: exit value %d\n", pid, WEXITSTATUS(record.status));
+    } else if (record.has_status && WIFSIGNALED(record.status)) {
+        printf("detached pid %d is done: terminated by signal %d\n", pid,
+               WTERMSIG(record.status));
+    } else if (!detached_is_running(&record)) {
+        printf("detached pid %d is done\n", pid);
+    }
+
+    if (notify_fd != -1) {
+        close(notify_fd);
+    }
+    if (pid_fd != -1) {
+        close(pid_fd);
+    }
+    close(capture_fd);
+    fflush(stdout);
+}
+
+
+/*
+* Function: read_pressure.
+* Reads the "some avg10" stall percentage from /proc/pressure.
+*
+* Parameter: resource (PRESSURE_CPU, PRESSURE_MEMORY, or PRESSURE_IO)
+*            average (output percentage)
+* Return: true if the value was read. false otherwise.
+*/
+bool read_pressure(int resource, double* average) {
+    char path[64];
+    char buffer[256];
+
+    snprintf(path, sizeof(path), "/proc/pressure/%s", pressure_names[resource]);
+
+    int pressure_fd = open(path, O_RDONLY);
+
+    if (pressure_fd == -1) {
+        return false;
+    }
+
+    ssize_t bytes_read = read(pressure_fd, buffer, sizeof(buffer) - 1);
+    close(pressure_fd);
+
+    if (bytes_read <= 0) {
+        return false;
+    }
+
+    buffer[bytes_read] = '\0';
+    return sscanf(buffer, "some avg10=%lf", average) == 1;
+}
+
+
+/*
+* Function: under_pressure.
+* Checks PSI triggers and averages against the admission limits.
+*
+* Parameter: none.
+* Return: true if background launches should be delayed.
+*/
+bool under_pressure() {
+
+    // A trigger fired within the last window.
+    if (admission.triggered_at != 0 &&
+        monotonic_ms() - admission.triggered_at < PRESSURE_WINDOW_MS) {
+        return true;
+    }
+
+    for (int i = 0; i < PRESSURE_COUNT; i++) {
+        double average;
+
+        if (read_pressure(i, &average) && average > admission.limits[i]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/*
+* Function: open_pressure_triggers.
+* Registers PSI triggers so rising pressure wakes the event loop at once
+* instead of waiting for the 10 second averages to move.
+*
+* Parameter: none.
+* Return: none.
+*/
+void open_pressure_triggers() {
+    char path[64];
+    char trigger[64];
+
+    close_pressure_triggers();
+
+    for (int i = 0; i < PRESSURE_COUNT; i++) {
+        snprintf(path, sizeof(path), "/proc/pressure/%s", pressure_names[i]);
+        snprintf(trigger, sizeof(trigger), "some %lld %d",
+                 (long long) (admission.limits[i] / 100.0 * PRESSURE_WINDOW_MS * 1000),
+                 PRESSURE_WINDOW_MS * 1000);
+
+        int trigger_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+        // Triggers are optional. Averages are still checked every tick.
+        if (trigger_fd != -1 && write(trigger_fd, trigger, strlen(trigger) + 1) == -1) {
+            close(trigger_fd);
+            trigger_fd = -1;
+        }
+
+        if (trigger_fd != -1) {
+            events_watch(trigger_fd, POLLPRI, EVENT_PRESSURE);
+        }
+
+        admission.trigger_fds[i] = trigger_fd;
+    }
+}
+
+
+/*
+* Function: close_pressure_triggers.
+* Unregisters all PSI triggers.
+*
+* Parameter: none.
+* Return: none.
+*/
+void close_pressure_triggers() {
+
+    for (int i = 0; i < PRESSURE_COUNT; i++) {
+        if (admission.trigger_fds[i] != -1) {
+            events_unwatch(admission.trigger_fds[i]);
+            close(admission.trigger_fds[i]);
+            admission.trigger_fds[i] = -1;
+        }
+    }
+}
+
+
+/*
+* Function: admission_command.
+* Built-in admission command. Configures pressure limits for background
+* launches. Limits are "some avg10" stall percentages.
+*
+* Usage: admission [on | off] [cpu=PCT] [memory=PCT] [io=PCT] [burst=N]
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void admission_command(struct command_line* current_command) {
+
+    // No arguments. Show current settings.
+    if (current_command->arg_count == 1) {
+        printf("admission %s", admission.enabled ? "on" : "off");
+
+        for (int i = 0; i < PRESSURE_COUNT; i++) {
+            printf(" %s=%g%s", pressure_names[i], admission.limits[i],
+                   admission.trigger_fds[i] != -1 ? "*" : "");
+        }
+
+        printf(" burst=%d queued=%d\n", admission.burst, queued_job_count);
+        fflush(stdout);
+        return;
+    }
+
+    for (int i = 1; i < current_command->arg_count; i++) {
+        char* setting = current_command->arg_variables[i];
+        char* value = strchr(setting, '=');
+        bool matched = false;
+
+        if (strcmp(setting, "on") == 0) {
+            admission.enabled = true;
+            matched = true;
+        } else if (strcmp(setting, "off") == 0) {
+            admission.enabled = false;
+            matched = true;
+        } else if (value != NULL && strncmp(setting, "burst=", 6) == 0) {
+            admission.burst = atoi(value + 1) > 0 ? atoi(value + 1) : 1;
+            matched = true;
+        }
+
+        // Per resource limits.
+        for (int j = 0; value != NULL && j < PRESSURE_COUNT; j++) {
+            if (strncmp(setting, pressure_names[j], value - setting) == 0 &&
+                strlen(pressure_names[j]) == (size_t) (value - setting)) {
+                admission.limits[j] = atof(value + 1);
+                matched = true;
+            }
+        }
+
+        if (!matched) {
+            printf("admission: unknown setting %s\n", setting);
+            fflush(stdout);
+            return;
+        }
+    }
+
+    // Re-register triggers with the new limits.
+    if (admission.enabled) {
+        open_pressure_triggers();
+    } else {
+        close_pressure_triggers();
+    }
+}
+
+
+/*
+* Function: find_queue.
+* Looks up a job queue by name.
+*
+* Parameter: name (queue name. NULL selects the default queue)
+*            create (true to create a missing queue with weight 1)
+* Return: index of the queue. -1 if missing and not created.
+*/
+int find_queue(char* name, bool create) {
+
+    if (name == NULL) {
+        return DEFAULT_QUEUE;
+    }
+
+    for (int i = 0; i < job_queue_count; i++) {
+        if (strcmp(job_queues[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    // Table full. Use the default queue.
+    if (!create || job_queue_count == MAX_QUEUES) {
+        return create ? DEFAULT_QUEUE : -1;
+    }
+
+    struct job_queue* queue = &job_queues[job_queue_count];
+
+    memset(queue, 0, sizeof(struct job_queue));
+    queue->name = strdup(name);
+    queue->weight = 1;
+
+    return job_queue_count++;
+}
+
+
+/*
+* Function: queue_has_room.
+* Checks the queue and shell-wide concurrency caps.
+*
+* Parameter: queue_index (index of the queue)
+* Return: true if another job from the queue may start.
+*/
+bool queue_has_room(int queue_index) {
+    struct job_queue* queue = &job_queues[queue_index];
+
+    if (queue->max_running > 0 && queue->running >= queue->max_running) {
+        return false;
+    }
+
+    if (max_background_jobs > 0 && background_jobs.count >= max_background_jobs) {
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+* Function: enqueue_command.
+* Appends a background command to the tail of its queue.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void enqueue_command(struct command_line* current_command) {
+    struct job_queue* queue = &job_queues[current_command->queue_index];
+
+    current_command->next = NULL;
+
+    if (queue->tail != NULL) {
+        queue->tail->next = current_command;
+    } else {
+        queue->head = current_command;
+    }
+
+    queue->tail = current_command;
+    queue->depth++;
+    queued_job_count++;
+}
+
+
+/*
+* Function: dequeue_command.
+* Removes the next command from a queue. In FIFO order this is the head.
+* Otherwise it is the job with the shortest or longest predicted run time,
+* oldest first among equal predictions.
+*
+* Parameter: queue_index (index of the queue)
+* Return: the command. NULL if the queue is empty.
+*/
+struct command_line* dequeue_command(int queue_index) {
+    struct job_queue* queue = &job_queues[queue_index];
+    struct command_line* next_command = queue->head;
+    struct command_line* previous = NULL;
+
+    if (next_command == NULL) {
+        return NULL;
+    }
+
+    // Find the best prediction and the node before it.
+    if (queue_order != ORDER_FIFO) {
+        struct command_line* before = queue->head;
+
+        for (struct command_line* candidate = queue->head->next; candidate != NULL;
+             candidate = candidate->next) {
+
+            if ((queue_order == ORDER_SHORTEST &&
+                 candidate->predicted_ms < next_command->predicted_ms) ||
+                (queue_order == ORDER_LONGEST &&
+                 candidate->predicted_ms > next_command->predicted_ms)) {
+                next_command = candidate;
+                previous = before;
+            }
+
+            before = candidate;
+        }
+    }
+
+    // Unlink the chosen command.
+    if (previous != NULL) {
+        previous->next = next_command->next;
+    } else {
+        queue->head = next_command->next;
+    }
+
+    if (queue->tail == next_command) {
+        queue->tail = previous;
+    }
+
+    queue->depth--;
+    queued_job_count--;
+
+    return next_command;
+}
+
+
+/*
+* Function: schedule_jobs.
+* Launches queued jobs by deficit round-robin.
+* Each round a queue earns credit equal to its weight and spends one unit
+* per launch, so a bulk queue cannot starve the others. With admission
+* control on, at most admission.burst jobs start per call.
+*
+* Parameter: none.
+* Return: none.
+*/
+void schedule_jobs() {
+    int budget = admission.enabled ? admission.burst : queued_job_count;
+    bool launched = true;
+
+    while (budget > 0 && queued_job_count > 0 && launched) {
+        launched = false;
+
+        for (int visited = 0; visited < job_queue_count && budget > 0; visited++) {
+            int queue_index = next_queue;
+            struct job_queue* queue = &job_queues[queue_index];
+
+            next_queue = (next_queue + 1) % job_queue_count;
+
+            // Idle queues do not bank credit.
+            if (queue->depth == 0) {
+                queue->deficit = 0;
+                continue;
+            }
+
+            if (!queue_has_room(queue_index)) {
+                continue;
+            }
+
+            queue->deficit += queue->weight;
+
+            while (queue->deficit >= 1 && queue->depth > 0 && budget > 0 &&
+                   queue_has_room(queue_index)) {
+
+                if (admission.enabled && under_pressure()) {
+                    return;
+                }
+
+                struct command_line* next_command = dequeue_command(queue_index);
+
+                next_command->is_admitted = true;
+                exec_commands(next_command);
+
+                queue->deficit--;
+                budget--;
+                launched = true;
+            }
+        }
+    }
+}
+
+
+/*
+* Function: queue_command.
+* Built-in queue command. Creates and configures named job queues.
+* Background jobs pick a queue with the queue= prefix.
+*
+* Usage: queue
+*        queue NAME [weight=N] [max=N]
+*        queue max=N
+*        queue order=fifo|sjf|ljf
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void queue_command(struct command_line* current_command) {
+
+    // No arguments. Show all queues.
+    if (current_command->arg_count == 1) {
+        for (int i = 0; i < job_queue_count; i++) {
+            printf("%s weight=%d max=%d running=%d queued=%d\n",
+                   job_queues[i].name, job_queues[i].weight, job_queues[i].max_running,
+                   job_queues[i].running, job_queues[i].depth);
+        }
+
+        char* order_names[] = { "fifo", "sjf", "ljf" };
+
+        printf("total max=%d running=%d queued=%d order=%s\n", max_background_jobs,
+               background_jobs.count, queued_job_count, order_names[queue_order]);
+        fflush(stdout);
+        return;
+    }
+
+    // Launch order within each queue.
+    if (strncmp(current_command->arg_variables[1], "order=", 6) == 0) {
+        char* order = current_command->arg_variables[1] + 6;
+
+        if (strcmp(order, "fifo") == 0) {
+            queue_order = ORDER_FIFO;
+        } else if (strcmp(order, "sjf") == 0) {
+            queue_order = ORDER_SHORTEST;
+        } else if (strcmp(order, "ljf") == 0) {
+            queue_order = ORDER_LONGEST;
+        } else {
+            printf("queue: unknown order %s\n", order);
+            fflush(stdout);
+        }
+        return;
+    }
+
+    // Shell-wide cap on running background jobs.
+    if (strncmp(current_command->arg_variables[1], "max=", 4) == 0) {
+        max_background_jobs = atoi(current_command->arg_variables[1] + 4);
+        return;
+    }
+
+    int queue_index = find_queue(current_command->arg_variables[1], true);
+    struct job_queue* queue = &job_queues[queue_index];
+
+    if (strcmp(queue->name, current_command->arg_variables[1]) != 0) {
+        printf("queue: too many queues\n");
+        fflush(stdout);
+        return;
+    }
+
+    for (int i = 2; i < current_command->arg_count; i++) {
+        char* setting = current_command->arg_variables[i];
+
+        if (strncmp(setting, "weight=", 7) == 0 && atoi(setting + 7) > 0) {
+            queue->weight = atoi(setting + 7);
+        } else if (strncmp(setting, "max=", 4) == 0) {
+            queue->max_running = atoi(setting + 4);
+        } else {
+            printf("queue: invalid setting %s\n", setting);
+            fflush(stdout);
+            return;
+        }
+    }
+}
+
+
+/*
+* Function: duration_key.
+* Normalizes a command for the duration model. Options are kept as
+* written, numbers become N, and other arguments become A, so
+* "sort -n big.txt" and "sort -n small.txt" share one entry.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: heap allocated key. Caller frees.
+*/
+char* duration_key(struct command_line* current_command) {
+    char* key = command_text(current_command);
+    char* shape = key + strlen(current_command->arg_variables[0]);
+
+    for (int i = 1; i < current_command->arg_count; i++) {
+        char* arg = current_command->arg_variables[i];
+        char* end;
+
+        *shape++ = ' ';
+
+        // Option. Keep its text.
+        if (arg[0] == '-' && arg[1] != '\0' && (arg[1] < '0' || arg[1] > '9')) {
+            strcpy(shape, arg);
+            shape += strlen(arg);
+            continue;
+        }
+
+        strtod(arg, &end);
+        *shape++ = (*end == '\0') ? 'N' : 'A';
+    }
+
+    *shape = '\0';
+    return key;
+}
+
+
+/*
+* Function: find_duration_entry.
+* Looks up a key in the duration model through its hash buckets.
+*
+* Parameter: key (normalized command)
+*            create (true to add a missing key)
+* Return: index of the entry. -1 if missing and not created.
+*/
+int find_duration_entry(char* key, bool create) {
+
+    load_duration_model();
+
+    unsigned bucket = hash_text(key) % DURATION_BUCKETS;
+
+    for (int i = duration_buckets[bucket] - 1; i != -1; i = duration_entries[i].hash_next) {
+        if (strcmp(duration_entries[i].key, key) == 0) {
+            return i;
+        }
+    }
+
+    if (!create || duration_entry_count == MAX_DURATION_ENTRIES) {
+        return -1;
+    }
+
+    // Grow by doubling.
+    if (duration_entry_count == duration_entry_capacity) {
+        duration_entry_capacity = duration_entry_capacity ? duration_entry_capacity * 2 : 16;
+        duration_entries = realloc(duration_entries,
+                                   duration_entry_capacity * sizeof(struct duration_entry));
+    }
+
+    struct duration_entry* entry = &duration_entries[duration_entry_count];
+
+    memset(entry, 0, sizeof(struct duration_entry));
+    entry->key = strdup(key);
+
+    // Buckets hold index + 1 so zero means empty.
+    entry->hash_next = duration_buckets[bucket] - 1;
+    duration_buckets[bucket] = duration_entry_count + 1;
+
+    return duration_entry_count++;
+}
+
+
+/*
+* Function: predict_duration.
+* Attaches a model entry and a predicted run time to a command.
+* Commands never seen before are predicted at the model's average so
+* they are neither favored nor starved.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void predict_duration(struct command_line* current_command) {
+    char* key = duration_key(current_command);
+
+    current_command->model_index = find_duration_entry(key, true);
+    current_command->predicted_ms = 0;
+    current_command->is_predicted = false;
+    free(key);
+
+    if (current_command->model_index != -1 &&
+        duration_entries[current_command->model_index].runs > 0) {
+        current_command->predicted_ms = duration_entries[current_command->model_index].mean_ms;
+        current_command->is_predicted = true;
+        return;
+    }
+
+    // Unknown command. Order by the average of known entries, but do
+    // not score it as a prediction.
+    current_command->predicted_ms = duration_known_count ?
+                                    duration_mean_total / duration_known_count : 0;
+}
+
+
+/*
+* Function: record_duration.
+* Updates the model with a finished job's run time. Jobs killed by a
+* signal are skipped since their run time says nothing about the command.
+*
+* Parameter: model_index (entry of the job. -1 if none)
+*            predicted_ms (prediction made at launch)
+*            is_predicted (true if the prediction came from the entry's history)
+*            started_at (launch time in monotonic milliseconds)
+*            child_status (wait status of the job)
+* Return: none.
+*/
+void record_duration(int model_index, double predicted_ms, bool is_predicted,
+                     long long started_at, int child_status) {
+
+    if (model_index == -1 || !WIFEXITED(child_status)) {
+        return;
+    }
+
+    struct duration_entry* entry = &duration_entries[model_index];
+    double actual_ms = monotonic_ms() - started_at;
+
+    // Score predictions made from this entry's own history.
+    if (is_predicted) {
+        double error = actual_ms - predicted_ms;
+
+        entry->predictions++;
+        entry->error_ms += error < 0 ? -error : error;
+        entry->actual_ms += actual_ms;
+    }
+
+    // Keep the running total of means used for unknown commands.
+    if (entry->runs == 0) {
+        duration_known_count++;
+    } else {
+        duration_mean_total -= entry->mean_ms;
+    }
+
+    entry->runs++;
+    entry->mean_ms += (actual_ms - entry->mean_ms) /
+                      (entry->runs < DURATION_WINDOW ? entry->runs : DURATION_WINDOW);
+    duration_mean_total += entry->mean_ms;
+    duration_model_changed = true;
+}
+
+
+/*
+* Function: duration_file_path.
+* Location of the persistent duration table. SMALLSH_DURATIONS overrides
+* the default of ~/.smallsh_durations.
+*
+* Parameter: none.
+* Return: path string. NULL if no location is known.
+*/
+char* duration_file_path() {
+    static char path[4096];
+    char* override = getenv("SMALLSH_DURATIONS");
+    char* home = getenv("HOME");
+
+    if (override != NULL) {
+        return override;
+    }
+
+    if (home == NULL) {
+        return NULL;
+    }
+
+    snprintf(path, sizeof(path), "%s/.smallsh_durations", home);
+    return path;
+}
+
+
+/*
+* Function: load_duration_model.
+* Reads the persistent duration table once per shell.
+* Each line holds: runs mean_ms predictions error_ms actual_ms key.
+*
+* Parameter: none.
+* Return: none.
+*/
+void load_duration_model() {
+    char line[INPUT_LENGTH + 128];
+
+    if (duration_model_loaded) {
+        return;
+    }
+
+    duration_model_loaded = true;
+
+    char* path = duration_file_path();
+    FILE* table = path ? fopen(path, "r") : NULL;
+
+    if (table == NULL) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), table) != NULL) {
+        struct duration_entry entry = {0};
+        int key_offset = 0;
+
+        if (line[0] == '#' ||
+            sscanf(line, "%ld %lf %ld %lf %lf %n", &entry.runs, &entry.mean_ms,
+                   &entry.predictions, &entry.error_ms, &entry.actual_ms,
+                   &key_offset) != 5 || key_offset == 0) {
+            continue;
+        }
+
+        line[strcspn(line, "\n")] = '\0';
+
+        int index = find_duration_entry(line + key_offset, true);
+
+        if (index != -1) {
+            entry.key = duration_entries[index].key;
+            entry.hash_next = duration_entries[index].hash_next;
+            duration_entries[index] = entry;
+
+            if (entry.runs > 0) {
+                duration_mean_total += entry.mean_ms;
+                duration_known_count++;
+            }
+        }
+    }
+
+    fclose(table);
+}
+
+
+/*
+* Function: save_duration_model.
+* Writes the duration table if it changed. Replaces the file atomically
+* so concurrent shells never read half a table.
+*
+* Parameter: none.
+* Return: none.
+*/
+void save_duration_model() {
+    char temp_path[4200];
+    char* path = duration_file_path();
+
+    if (!duration_model_changed || path == NULL) {
+        return;
+    }
+
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, getpid());
+
+    FILE* table = fopen(temp_path, "w");
+
+    if (table == NULL) {
+        return;
+    }
+
+    fprintf(table, "# smallsh durations: runs mean_ms predictions error_ms actual_ms key\n");
+
+    for (int i = 0; i < duration_entry_count; i++) {
+        struct duration_entry* entry = &duration_entries[i];
+
+        if (entry->runs > 0) {
+            fprintf(table, "%ld %.1f %ld %.1f %.1f %s\n", entry->runs, entry->mean_ms,
+                    entry->predictions, entry->error_ms, entry->actual_ms, entry->key);
+        }
+    }
+
+    if (fclose(table) == 0) {
+        rename(temp_path, path);
+    } else {
+        unlink(temp_path);
+    }
+
+    duration_model_changed = false;
+}
+
+
+/*
+* Function: durations_command.
+* Built-in durations command. Shows learned run times and how well
+* they predicted actual run times.
+*
+* Usage: durations [reset]
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void durations_command(struct command_line* current_command) {
+    long predictions = 0;
+    double error_ms = 0;
+    double actual_ms = 0;
+
+    load_duration_model();
+
+    // Forget all history.
+    if (current_command->arg_count > 1 &&
+        strcmp(current_command->arg_variables[1], "reset") == 0) {
+        for (int i = 0; i < duration_entry_count; i++) {
+            char* key = duration_entries[i].key;
+            int hash_next = duration_entries[i].hash_next;
+
+            memset(&duration_entries[i], 0, sizeof(struct duration_entry));
+            duration_entries[i].key = key;
+            duration_entries[i].hash_next = hash_next;
+        }
+
+        duration_mean_total = 0;
+        duration_known_count = 0;
+        duration_model_changed = true;
+        return;
+    }
+
+    for (int i = 0; i < duration_entry_count; i++) {
+        struct duration_entry* entry = &duration_entries[i];
+
+        if (entry->runs == 0) {
+            continue;
+        }
+
+        printf("%10.1f ms  %5ld runs  %s\n", entry->mean_ms, entry->runs, entry->key);
+
+        predictions += entry->predictions;
+        error_ms += entry->error_ms;
+        actual_ms += entry->actual_ms;
+    }
+
+    // Mean absolute error, and error relative to total run time.
+    if (predictions > 0) {
+        printf("%ld predictions, mean absolute error %.1f ms (%.1f%% of actual)\n",
+               predictions, error_ms / predictions,
+               actual_ms > 0 ? 100.0 * error_ms / actual_ms : 0.0);
+    } else {
+        printf("no predictions scored yet\n");
+    }
+
+    fflush(stdout);
+}
+
+
+/*
+* Function: parse_limit_value.
+* Parses a limit value. Accepts "unlimited" and K, M, or G suffixes,
+* which override the default unit.
+*
+* Parameter: text (value to parse)
+*            unit (multiplier for plain numbers)
+*            value (output limit)
+* Return: true if the value is valid. false otherwise.
+*/
+bool parse_limit_value(char* text, rlim_t unit, rlim_t* value) {
+    char* end;
+
+    if (strcmp(text, "unlimited") == 0) {
+        *value = RLIM_INFINITY;
+        return true;
+    }
+
+    if (text[0] < '0' || text[0] > '9') {
+        return false;
+    }
+
+    unsigned long long number = strtoull(text, &end, 10);
+
+    // Size suffixes are in bytes.
+    if (*end == 'K' || *end == 'k') {
+        unit = 1ULL << 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        unit = 1ULL << 20;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        unit = 1ULL << 30;
+        end++;
+    }
+
+    if (*end != '\0') {
+        return false;
+    }
+
+    *value = number * unit;
+    return true;
+}
+
+
+/*
+* Function: parse_limits.
+* Parses a comma separated list of NAME:VALUE limits, such as
+* "as:2G,nofile:256,cpu:60". Memory sizes without a suffix are bytes.
+*
+* Parameter: limits (pointer to the structure to fill)
+*            list (limit list)
+* Return: true if every item is valid. false otherwise.
+*/
+bool parse_limits(struct job_limits* limits, char* list) {
+    char* copy = strdup(list);
+    char* saved;
+    bool is_valid = copy[0] != '\0';
+
+    for (char* item = strtok_r(copy, ",", &saved); item != NULL && is_valid;
+         item = strtok_r(NULL, ",", &saved)) {
+
+        char* value = strchr(item, ':');
+        is_valid = false;
+
+        if (value == NULL) {
+            break;
+        }
+
+        *value++ = '\0';
+
+        for (int i = 0; limit_names[i].name != NULL; i++) {
+            if (strcmp(item, limit_names[i].name) == 0 &&
+                parse_limit_value(value, 1, &limits->values[limit_names[i].resource])) {
+                limits->is_set[limit_names[i].resource] = true;
+                is_valid = true;
+            }
+        }
+    }
+
+    free(copy);
+
+    if (!is_valid) {
+        printf("limits: invalid list %s\n", list);
+        fflush(stdout);
+    }
+
+    return is_valid;
+}
+
+
+/*
+* Function: apply_limits.
+* Applies resource limits in the child before exec. Limits from the
+* command's prefix win over the shell defaults. Limits above the current
+* hard limit are clamped to it, since raising it needs privilege.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void apply_limits(struct command_line* current_command) {
+
+    for (int resource = 0; resource < RLIM_NLIMITS; resource++) {
+        struct rlimit limit;
+        rlim_t value;
+
+        if (current_command->limits.is_set[resource]) {
+            value = current_command->limits.values[resource];
+        } else if (default_limits.is_set[resource]) {
+            value = default_limits.values[resource];
+        } else {
+            continue;
+        }
+
+        getrlimit(resource, &limit);
+
+        if (limit.rlim_max != RLIM_INFINITY &&
+            (value == RLIM_INFINITY || value > limit.rlim_max)) {
+            value = limit.rlim_max;
+        }
+
+        limit.rlim_cur = value;
+        limit.rlim_max = value;
+
+        if (setrlimit(resource, &limit) == -1) {
+            perror("limits");
+        }
+    }
+}
+
+
+/*
+* Function: ulimit_command.
+* Built-in ulimit command. Sets resource limits applied to every job
+* the shell starts. The shell's own limits are not changed.
+*
+* Usage: ulimit [-a]
+*        ulimit -X [VALUE | unlimited]
+*        ulimit reset
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void ulimit_command(struct command_line* current_command) {
+    char* option = current_command->arg_variables[1];
+
+    // Forget all defaults.
+    if (option != NULL && strcmp(option, "reset") == 0) {
+        memset(&default_limits, 0, sizeof(default_limits));
+        return;
+    }
+
+    // No option. List every limit jobs will get.
+    if (option == NULL || strcmp(option, "-a") == 0) {
+        for (int i = 0; limit_names[i].name != NULL; i++) {
+            int resource = limit_names[i].resource;
+            struct rlimit limit;
+
+            getrlimit(resource, &limit);
+
+            rlim_t value = default_limits.is_set[resource] ?
+                           default_limits.values[resource] : limit.rlim_cur;
+
+            printf("-%c %-24s ", limit_names[i].option, limit_names[i].description);
+
+            if (value == RLIM_INFINITY) {
+                printf("unlimited");
+            } else {
+                printf("%llu", (unsigned long long) (value / limit_names[i].unit));
+            }
+
+            printf("%s\n", default_limits.is_set[resource] ? "" : " (inherited)");
+        }
+
+        fflush(stdout);
+        return;
+    }
+
+    for (int i = 0; limit_names[i].name != NULL; i++) {
+        if (option[0] != '-' || option[1] != limit_names[i].option || option[2] != '\0') {
+            continue;
+        }
+
+        int resource = limit_names[i].resource;
+        char* text = current_command->arg_variables[2];
+
+        // Show one limit.
+        if (text == NULL) {
+            struct rlimit limit;
+            getrlimit(resource, &limit);
+
+            rlim_t value = default_limits.is_set[resource] ?
+                           default_limits.values[resource] : limit.rlim_cur;
+
+            if (value == RLIM_INFINITY) {
+                printf("unlimited\n");
+            } else {
+                printf("%llu\n", (unsigned long long) (value / limit_names[i].unit));
+            }
+
+            fflush(stdout);
+            return;
+        }
+
+        // Set one limit, in the unit shown by ulimit -a.
+        if (!parse_limit_value(text, limit_names[i].unit, &default_limits.values[resource])) {
+            printf("ulimit: invalid value %s\n", text);
+            fflush(stdout);
+            return;
+        }
+
+        default_limits.is_set[resource] = true;
+        return;
+    }
+
+    printf("ulimit: unknown option %s\n", option);
+    fflush(stdout);
+}
+
+
+/*
+* Function: uring_setup.
+* Creates an io_uring and maps its submission and completion rings.
+*
+* Parameter: ring (pointer to the structure to fill)
+*            entries (submission queue size)
+* Return: true on success. false if io_uring is unavailable.
+*/
+bool uring_setup(struct uring* ring, unsigned entries) {
+    struct io_uring_params params = {0};
+
+    memset(ring, 0, sizeof(struct uring));
+    ring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+
+    if (ring->ring_fd == -1) {
+        return false;
+    }
+
+    fcntl(ring->ring_fd, F_SETFD, FD_CLOEXEC);
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Kernels with a single mapping share one region for both rings.
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+
+    char* sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->ring_fd, IORING_OFF_SQ_RING);
+    char* cq_ring = sq_ring;
+
+    if (sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ring = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->ring_fd, IORING_OFF_CQ_RING);
+    }
+
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->ring_fd);
+        ring->ring_fd = -1;
+        return false;
+    }
+
+    ring->sq_head = (unsigned*) (sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned*) (cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq_ring + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    ring->features = params.features;
+
+    return true;
+}
+
+
+/*
+* Function: uring_get_sqe.
+* Reserves the next submission queue entry. Submits queued entries
+* first if the queue is full.
+*
+* Parameter: ring (pointer to the structure)
+* Return: zeroed entry to fill in.
+*/
+struct io_uring_sqe* uring_get_sqe(struct uring* ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->queued;
+
+    if (tail - head >= ring->entries) {
+        uring_enter(ring, 0, 0);
+        tail = *ring->sq_tail + ring->queued;
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->queued++;
+
+    return sqe;
+}
+
+
+/*
+* Function: uring_enter.
+* Submits all queued entries and optionally waits for completions,
+* in a single system call.
+*
+* Parameter: ring (pointer to the structure)
+*            wait_count (completions to wait for. 0 to only submit)
+*            timeout_ms (wait limit. -1 waits forever)
+* Return: result of io_uring_enter. -1 with errno set on error.
+*/
+int uring_enter(struct uring* ring, unsigned wait_count, int timeout_ms) {
+    struct __kernel_timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L
+    };
+    struct io_uring_getevents_arg wait_arg = {
+        .ts = timeout_ms >= 0 ? (unsigned long long) (uintptr_t) &timeout : 0
+    };
+    unsigned flags = wait_count > 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+    unsigned submitted = ring->queued;
+
+    // Publish queued entries to the kernel.
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+    ring->queued = 0;
+
+    int result = syscall(__NR_io_uring_enter, ring->ring_fd, submitted, wait_count, flags,
+                         wait_count > 0 ? &wait_arg : NULL, sizeof(wait_arg));
+
+    // A timeout with nothing completed is not an error.
+    if (result == -1 && errno == ETIME) {
+        return 0;
+    }
+
+    return result;
+}
+
+
+/*
+* Function: uring_peek_cqe.
+* Returns the next completion without consuming it.
+*
+* Parameter: ring (pointer to the structure)
+* Return: completion entry. NULL if none are ready.
+*/
+struct io_uring_cqe* uring_peek_cqe(struct uring* ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+
+/*
+* Function: uring_advance_cqe.
+* Consumes the completion returned by uring_peek_cqe.
+*
+* Parameter: ring (pointer to the structure)
+* Return: none.
+*/
+void uring_advance_cqe(struct uring* ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+* Function: events_init.
+* Picks the event loop backend and watches standard input.
+* SMALLSH_EVENTS=epoll or uring forces a backend. By default io_uring
+* is used when the kernel supports waiting with a timeout argument.
+*
+* Parameter: none.
+* Return: none.
+*/
+void events_init() {
+    char* choice = getenv("SMALLSH_EVENTS");
+
+    event_loop.backend = EVENTS_EPOLL;
+
+    if ((choice == NULL || strcmp(choice, "epoll") != 0) &&
+        uring_setup(&event_loop.ring, URING_ENTRIES)) {
+
+        if (event_loop.ring.features & IORING_FEAT_EXT_ARG) {
+            event_loop.backend = EVENTS_URING;
+        } else {
+            close(event_loop.ring.ring_fd);
+            event_loop.ring.ring_fd = -1;
+        }
+    }
+
+    // Fallback backend.
+    if (event_loop.backend == EVENTS_EPOLL) {
+        event_loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    events_watch(STDIN_FILENO, POLLIN, EVENT_INPUT);
+}
+
+
+/*
+* Function: events_watch.
+* Adds a level-triggered watch on a file descriptor.
+*
+* Parameter: fd (file descriptor to watch)
+*            events (poll events such as POLLIN or POLLPRI)
+*            tag (event source reported back by events_wait)
+* Return: none.
+*/
+void events_watch(int fd, int events, int tag) {
+
+    if (event_loop.watch_count == MAX_WATCHES) {
+        return;
+    }
+
+    struct event_watch* watch = &event_loop.watches[event_loop.watch_count++];
+
+    watch->fd = fd;
+    watch->events = events;
+    watch->tag = tag;
+    watch->is_armed = false;
+    watch->is_failed = false;
+
+    // Never zero, which marks completions of cancel requests.
+    if (++event_loop.generation == 0) {
+        event_loop.generation = 1;
+    }
+    watch->generation = event_loop.generation;
+
+    if (event_loop.backend == EVENTS_EPOLL) {
+        struct epoll_event epoll_event = { .events = events, .data.fd = fd };
+
+        // Files that cannot be polled, such as regular files, are always ready.
+        if (epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_ADD, fd, &epoll_event) == -1) {
+            watch->is_armed = true;
+        }
+    }
+}
+
+
+/*
+* Function: events_unwatch.
+* Removes the watch on a file descriptor. Call before closing it.
+*
+* Parameter: fd (file descriptor to forget)
+* Return: none.
+*/
+void events_unwatch(int fd) {
+
+    for (int i = 0; i < event_loop.watch_count; i++) {
+        struct event_watch* watch = &event_loop.watches[i];
+
+        if (watch->fd != fd) {
+            continue;
+        }
+
+        if (event_loop.backend == EVENTS_EPOLL) {
+            epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+        // Cancel an armed poll at once so it releases the file.
+        } else if (watch->is_armed) {
+            struct io_uring_sqe* sqe = uring_get_sqe(&event_loop.ring);
+
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->addr = (unsigned long long) watch->generation << 32 | (unsigned) fd;
+            uring_enter(&event_loop.ring, 0, 0);
+        }
+
+        event_loop.watches[i] = event_loop.watches[--event_loop.watch_count];
+        return;
+    }
+}
+
+
+/*
+* Function: events_wait.
+* Waits for watched file descriptors to become ready.
+*
+* Parameter: ready (array to fill with ready events)
+*            max_events (size of ready)
+*            timeout_ms (wait limit. -1 waits forever)
+* Return: number of ready events. -1 with errno set on error.
+*/
+int events_wait(struct shell_event* ready, int max_events, int timeout_ms) {
+    int ready_count = 0;
+
+    event_loop.waits++;
+
+    // epoll backend. One epoll_wait per wake up.
+    if (event_loop.backend == EVENTS_EPOLL) {
+        struct epoll_event epoll_events[MAX_EVENTS];
+
+        // Unpollable files are reported ready without waiting.
+        for (int i = 0; i < event_loop.watch_count && ready_count < max_events; i++) {
+            if (event_loop.watches[i].is_armed) {
+                ready[ready_count].fd = event_loop.watches[i].fd;
+                ready[ready_count].tag = event_loop.watches[i].tag;
+                ready[ready_count++].revents = event_loop.watches[i].events;
+                timeout_ms = 0;
+            }
+        }
+
+        int count = epoll_wait(event_loop.epoll_fd, epoll_events,
+                               max_events - ready_count, timeout_ms);
+
+        for (int i = 0; i < count; i++) {
+            for (int j = 0; j < event_loop.watch_count; j++) {
+                if (event_loop.watches[j].fd == epoll_events[i].data.fd) {
+                    ready[ready_count].fd = epoll_events[i].data.fd;
+                    ready[ready_count].tag = event_loop.watches[j].tag;
+                    ready[ready_count++].revents = epoll_events[i].events;
+                }
+            }
+        }
+
+        event_loop.delivered += ready_count;
+        return count == -1 && ready_count == 0 ? -1 : ready_count;
+    }
+
+    // io_uring backend. Re-arm one-shot polls and wait in one call.
+    for (int i = 0; i < event_loop.watch_count; i++) {
+        struct event_watch* watch = &event_loop.watches[i];
+
+        if (!watch->is_armed && !watch->is_failed) {
+            struct io_uring_sqe* sqe = uring_get_sqe(&event_loop.ring);
+
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = watch->fd;
+            sqe->poll32_events = watch->events;
+            sqe->user_data = (unsigned long long) watch->generation << 32 | (unsigned) watch->fd;
+            watch->is_armed = true;
+        }
+    }
+
+    if (uring_peek_cqe(&event_loop.ring) == NULL &&
+        uring_enter(&event_loop.ring, 1, timeout_ms) == -1) {
+        return -1;
+    }
+
+    // Drain completions from shared memory without further system calls.
+    struct io_uring_cqe* cqe;
+
+    while (ready_count < max_events && (cqe = uring_peek_cqe(&event_loop.ring)) != NULL) {
+        unsigned generation = cqe->user_data >> 32;
+        int fd = (int) (cqe->user_data & 0xffffffff);
+
+        for (int i = 0; i < event_loop.watch_count; i++) {
+            struct event_watch* watch = &event_loop.watches[i];
+
+            // Skip completions of cancelled polls, including those of an
+            // earlier watch on the same descriptor number.
+            if (watch->fd != fd || watch->generation != generation || cqe->user_data == 0) {
+                continue;
+            }
+
+            watch->is_armed = false;
+
+            // A poll that failed, such as on a closed descriptor, is
+            // reported as epoll would report it.
+            if (cqe->res < 0) {
+                watch->is_failed = true;
+                ready[ready_count].fd = fd;
+                ready[ready_count].tag = watch->tag;
+                ready[ready_count++].revents = cqe->res == -EBADF ? POLLNVAL : POLLERR;
+            } else if (cqe->res > 0) {
+                ready[ready_count].fd = fd;
+                ready[ready_count].tag = watch->tag;
+                ready[ready_count++].revents = cqe->res;
+            }
+        }
+
+        uring_advance_cqe(&event_loop.ring);
+    }
+
+    event_loop.delivered += ready_count;
+    return ready_count;
+}
+
+
+/*
+* Function: events_command.
+* Built-in events command. Shows the event loop backend and how many
+* wake ups and events it has handled, for comparing backends.
+*
+* Parameter: none.
+* Return: none.
+*/
+void events_command() {
+    printf("events %s, %d watches, %lld waits, %lld events\n",
+           event_loop.backend == EVENTS_URING ? "io_uring" : "epoll",
+           event_loop.watch_count, event_loop.waits, event_loop.delivered);
+    fflush(stdout);
+}
+
+
+/*
+* Function: child_events_init.
+* Routes SIGCHLD through a signalfd watched by the event loop, so
+* finished background jobs are reaped the moment they exit.
+*
+* Parameter: none.
+* Return: none.
+*/
+void child_events_init() {
+    sigset_t child_signals;
+
+    sigemptyset(&child_signals);
+    sigaddset(&child_signals, SIGCHLD);
+
+    // SIGCHLD must be blocked to be read from a signalfd.
+    sigprocmask(SIG_BLOCK, &child_signals, NULL);
+
+    int signal_fd = signalfd(-1, &child_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (signal_fd != -1) {
+        events_watch(signal_fd, POLLIN, EVENT_CHILD);
+    }
+}
+
+
+/*
+* Function: drain_child_events.
+* Empties the SIGCHLD signalfd. Several exits may share one signal, so
+* callers reap with waitpid until nothing is left.
+*
+* Parameter: signal_fd (SIGCHLD signalfd)
+* Return: none.
+*/
+void drain_child_events(int signal_fd) {
+    struct signalfd_siginfo info[16];
+
+    while (read(signal_fd, info, sizeof(info)) > 0) {
+    }
+}
+
+
+/*
+* Function: editor_init.
+* Enables the line editor when standard input is a terminal.
+*
+* Parameter: none.
+* Return: none.
+*/
+void editor_init() {
+
+    if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &editor.saved_mode) == 0) {
+        editor.is_terminal = true;
+        atexit(editor_restore);
+    }
+}
+
+
+/*
+* Function: editor_raw_mode.
+* Switches the terminal between key-at-a-time input for the prompt and
+* its normal line mode for commands. Signals from ^C and ^Z still work.
+*
+* Parameter: is_raw (true for prompt input)
+* Return: none.
+*/
+void editor_raw_mode(bool is_raw) {
+
+    if (!editor.is_terminal || editor.is_raw == is_raw) {
+        return;
+    }
+
+    struct termios mode = editor.saved_mode;
+
+    if (is_raw) {
+        mode.c_lflag &= ~(ICANON | ECHO);
+        mode.c_cc[VMIN] = 1;
+        mode.c_cc[VTIME] = 0;
+    }
+
+    tcsetattr(STDIN_FILENO, TCSANOW, &mode);
+    editor.is_raw = is_raw;
+}
+
+
+/*
+* Function: editor_restore.
+* Restores the terminal mode on exit.
+*
+* Parameter: none.
+* Return: none.
+*/
+void editor_restore() {
+    editor_raw_mode(false);
+}
+
+
+/*
+* Function: editor_key.
+* Applies one key to the edit line and echoes it. Supports erase,
+* word erase, line kill, and ^D at an empty line. Escape sequences
+* such as arrow keys are ignored.
+*
+* Parameter: key (byte read from the terminal)
+* Return: true when Enter completes the line. false otherwise.
+*/
+bool editor_key(char key) {
+    cc_t* keys = editor.saved_mode.c_cc;
+    unsigned char byte = key;
+
+    // Skip the rest of an escape sequence.
+    if (editor.escape_state == 1) {
+        editor.escape_state = (byte == '[' || byte == 'O') ? 2 : 0;
+        return false;
+    }
+
+    if (editor.escape_state == 2) {
+        if (byte >= 0x40 && byte <= 0x7e) {
+            editor.escape_state = 0;
+        }
+        return false;
+    }
+
+    if (byte == 0x1b) {
+        editor.escape_state = 1;
+        return false;
+    }
+
+    // Enter.
+    if (byte == '\n' || byte == '\r') {
+        write(STDOUT_FILENO, "\n", 1);
+        return true;
+    }
+
+    // End of input on an empty line.
+    if (byte == keys[VEOF]) {
+        if (editor.length == 0) {
+            write(STDOUT_FILENO, "\n", 1);
+            input_closed = true;
+        }
+        return false;
+    }
+
+    // Erase one character, including all bytes of a UTF-8 sequence.
+    if ((byte == keys[VERASE] || byte == 0x08 || byte == 0x7f) && editor.length > 0) {
+        while (editor.length > 1 && (editor.line[editor.length - 1] & 0xc0) == 0x80) {
+            editor.length--;
+        }
+
+        editor.length--;
+        write(STDOUT_FILENO, "\b \b", 3);
+        return false;
+    }
+
+    // Erase the last word or the whole line.
+    if (byte == keys[VWERASE] || byte == keys[VKILL]) {
+        bool is_word = byte == keys[VWERASE];
+
+        while (editor.length > 0 && is_word && editor.line[editor.length - 1] == ' ') {
+            editor.length--;
+            write(STDOUT_FILENO, "\b \b", 3);
+        }
+
+        while (editor.length > 0 && (!is_word || editor.line[editor.length - 1] != ' ')) {
+            if ((editor.line[editor.length - 1] & 0xc0) != 0x80) {
+                write(STDOUT_FILENO, "\b \b", 3);
+            }
+            editor.length--;
+        }
+
+        return false;
+    }
+
+    // Printable text and tabs. Other control keys are ignored.
+    if ((byte >= 0x20 && byte != 0x7f) || byte == '\t') {
+        if (editor.length < INPUT_LENGTH - 2) {
+            editor.line[editor.length++] = key;
+            write(STDOUT_FILENO, &key, 1);
+        }
+    }
+
+    return false;
+}
+
+
+/*
+* Function: begin_notice.
+* Called before printing a message while the prompt is showing. On a
+* terminal the prompt and edit line are cleared so the message gets a
+* line of its own.
+*
+* Parameter: none.
+* Return: none.
+*/
+void begin_notice() {
+
+    if (!editor.prompt_active || !editor.is_terminal || editor.notice_open) {
+        return;
+    }
+
+    shell_append("\r\033[K", 4, false);
+    editor.notice_open = true;
+}
+
+
+/*
+* Function: end_notice.
+* Redraws the prompt and the partly typed line after messages.
+* The edit line is referenced, not copied, so flush before editing it.
+*
+* Parameter: none.
+* Return: none.
+*/
+void end_notice() {
+
+    if (!editor.notice_open) {
+        return;
+    }
+
+    shell_append(": ", 2, false);
+    shell_append(editor.line, editor.length, false);
+    editor.notice_open = false;
+}
+
+
+/*
+* Function: shell_printf.
+* Formats a shell message into the output buffer.
+*
+* Parameter: format (printf format string) and its arguments.
+* Return: none.
+*/
+void shell_printf(const char* format, ...) {
+    va_list arguments;
+
+    // Flush a full segment list before formatting, since the flush
+    // restarts the text area under the new message.
+    if (shell_output.segment_count == OUTPUT_SEGMENTS) {
+        shell_flush();
+    }
+
+    int space = OUTPUT_BYTES - shell_output.text_length;
+
+    va_start(arguments, format);
+    int length = vsnprintf(shell_output.text + shell_output.text_length, space,
+                           format, arguments);
+    va_end(arguments);
+
+    // Not enough room. Flush and format again.
+    if (length >= space) {
+        shell_flush();
+
+        va_start(arguments, format);
+        length = vsnprintf(shell_output.text, OUTPUT_BYTES, format, arguments);
+        va_end(arguments);
+
+        length = length < OUTPUT_BYTES ? length : OUTPUT_BYTES - 1;
+    }
+
+    if (length > 0) {
+        shell_append(shell_output.text + shell_output.text_length, length, false);
+        shell_output.text_length += length;
+    }
+}
+
+
+/*
+* Function: shell_append.
+* Adds bytes to the output buffer as a writev segment. Adjacent bytes
+* extend the previous segment instead of adding one.
+*
+* Parameter: data (bytes to write)
+*            length (number of bytes)
+*            is_copied (true to copy data into the buffer. false to
+*                       reference it until the next flush)
+* Return: none.
+*/
+void shell_append(const char* data, int length, bool is_copied) {
+
+    if (length <= 0) {
+        return;
+    }
+
+    // Make room for a segment before copying, since a flush restarts
+    // the text area.
+    if (shell_output.segment_count == OUTPUT_SEGMENTS) {
+        shell_flush();
+    }
+
+    // Copy into the text area if requested.
+    if (is_copied) {
+        if (length > OUTPUT_BYTES - shell_output.text_length) {
+            shell_flush();
+        }
+
+        if (length > OUTPUT_BYTES) {
+            write(STDOUT_FILENO, data, length);
+            return;
+        }
+
+        memcpy(shell_output.text + shell_output.text_length, data, length);
+        data = shell_output.text + shell_output.text_length;
+        shell_output.text_length += length;
+    }
+
+    struct iovec* last = shell_output.segment_count ?
+                         &shell_output.segments[shell_output.segment_count - 1] : NULL;
+
+    if (last != NULL && (char*) last->iov_base + last->iov_len == data) {
+        last->iov_len += length;
+        return;
+    }
+
+    shell_output.segments[shell_output.segment_count].iov_base = (void*) data;
+    shell_output.segments[shell_output.segment_count].iov_len = length;
+    shell_output.segment_count++;
+}
+
+
+/*
+* Function: shell_flush.
+* Writes all buffered messages with one writev. Anything already in
+* stdio's buffer is written first to keep messages in order.
+*
+* Parameter: none.
+* Return: none.
+*/
+void shell_flush() {
+    struct iovec* segment = shell_output.segments;
+    int remaining = shell_output.segment_count;
+
+    fflush(stdout);
+
+    while (remaining > 0) {
+        ssize_t written = writev(STDOUT_FILENO, segment, remaining);
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        // Partial write. Skip what was written and retry the rest.
+        while (remaining > 0 && (size_t) written >= segment->iov_len) {
+            written -= segment->iov_len;
+            segment++;
+            remaining--;
+        }
+
+        if (remaining > 0) {
+            segment->iov_base = (char*) segment->iov_base + written;
+            segment->iov_len -= written;
+        }
+    }
+
+    shell_output.text_length = 0;
+    shell_output.segment_count = 0;
+}
+
+
+/*
+* Function: detect_hash_acceleration.
+* Checks once for the SSE4.2 CRC32 instruction and the SHA extensions,
+* and builds the table for software CRC32C.
+*
+* Parameter: none.
+* Return: none.
+*/
+void detect_hash_acceleration() {
+
+    if (is_hash_detected) {
+        return;
+    }
+    is_hash_detected = true;
+
+    // Reflected Castagnoli polynomial.
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+
+#if defined(__x86_64__)
+    unsigned eax, ebx, ecx, edx;
+
+    has_crc32c_instruction = __builtin_cpu_supports("sse4.2");
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        has_sha_instructions = (ebx >> 29) & 1 && __builtin_cpu_supports("sse4.1");
+    }
+#endif
+}
+
+
+/*
+* Function: crc32c_software.
+* CRC32C one byte at a time from a table.
+*
+* Parameter: crc (running value, inverted)
+*            data (bytes)
+*            length (byte count)
+* Return: new running value.
+*/
+uint32_t crc32c_software(uint32_t crc, const unsigned char* data, size_t length) {
+
+    for (size_t i = 0; i < length; i++) {
+        crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+
+#if defined(__x86_64__)
+/*
+* Function: crc32c_hardware.
+* CRC32C eight bytes per SSE4.2 crc32 instruction.
+*
+* Parameter: crc (running value, inverted)
+*            data (bytes)
+*            length (byte count)
+* Return: new running value.
+*/
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hardware(uint32_t crc, const unsigned char* data, size_t length) {
+    uint64_t value = crc;
+
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+
+        memcpy(&word, data, 8);
+        value = _mm_crc32_u64(value, word);
+    }
+
+    crc = value;
+
+    for (; length > 0; data++, length--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+
+    return crc;
+}
+#else
+uint32_t crc32c_hardware(uint32_t crc, const unsigned char* data, size_t length) {
+    return crc32c_software(crc, data, length);
+}
+#endif
+
+
+/*
+* Function: xxh64.
+* XXH64 with seed 0.
+*
+* Parameter: data (bytes)
+*            length (byte count)
+* Return: hash.
+*/
+uint64_t xxh64(const unsigned char* data, size_t length) {
+    const uint64_t prime1 = 11400714785074694791ULL;
+    const uint64_t prime2 = 14029467366897019727ULL;
+    const uint64_t prime3 = 1609587929392839161ULL;
+    const uint64_t prime4 = 9650029242287828579ULL;
+    const uint64_t prime5 = 2870177450012600261ULL;
+    const unsigned char* end = data + length;
+    uint64_t hash;
+
+    #define XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+    #define XXH_ROUND(acc, input) XXH_ROTL((acc) + (input) * prime2, 31) * prime1
+
+    if (length >= 32) {
+        uint64_t lanes[4] = { prime1 + prime2, prime2, 0, -prime1 };
+
+        for (; end - data >= 32; data += 32) {
+            for (int i = 0; i < 4; i++) {
+                uint64_t word;
+
+                memcpy(&word, data + 8 * i, 8);
+                lanes[i] = XXH_ROUND(lanes[i], word);
+            }
+        }
+
+        hash = XXH_ROTL(lanes[0], 1) + XXH_ROTL(lanes[1], 7) +
+               XXH_ROTL(lanes[2], 12) + XXH_ROTL(lanes[3], 18);
+
+        for (int i = 0; i < 4; i++) {
+            hash = (hash ^ XXH_ROUND(0, lanes[i])) * prime1 + prime4;
+        }
+    } else {
+        hash = prime5;
+    }
+
+    hash += length;
+
+    for (; end - data >= 8; data += 8) {
+        uint64_t word;
+
+        memcpy(&word, data, 8);
+        hash = XXH_ROTL(hash ^ XXH_ROUND(0, word), 27) * prime1 + prime4;
+    }
+
+    if (end - data >= 4) {
+        uint32_t word;
+
+        memcpy(&word, data, 4);
+        hash = XXH_ROTL(hash ^ (word * prime1), 23) * prime2 + prime3;
+        data += 4;
+    }
+
+    for (; data < end; data++) {
+        hash = XXH_ROTL(hash ^ (*data * prime5), 11) * prime1;
+    }
+
+    #undef XXH_ROUND
+    #undef XXH_ROTL
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    return hash ^ (hash >> 32);
+}
+
+
+/*
+* Function: murmur3_128.
+* MurmurHash3 x64 128-bit with seed 0.
+*
+* Parameter: data (bytes)
+*            length (byte count)
+*            high (first 64-bit half, h1)
+*            low (second 64-bit half, h2)
+* Return: none.
+*/
+void murmur3_128(const unsigned char* data, size_t length, uint64_t* high, uint64_t* low) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    size_t blocks = length / 16;
+
+    #define MM_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+    #define MM_FMIX(k) ((k) ^= (k) >> 33, (k) *= 0xff51afd7ed558ccdULL, (k) ^= (k) >> 33, \
+                        (k) *= 0xc4ceb9fe1a85ec53ULL, (k) ^= (k) >> 33)
+
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t k1;
+        uint64_t k2;
+
+        memcpy(&k1, data + 16 * i, 8);
+        memcpy(&k2, data + 16 * i + 8, 8);
+
+        h1 ^= MM_ROTL(k1 * c1, 31) * c2;
+        h1 = (MM_ROTL(h1, 27) + h2) * 5 + 0x52dce729;
+        h2 ^= MM_ROTL(k2 * c2, 33) * c1;
+        h2 = (MM_ROTL(h2, 31) + h1) * 5 + 0x38495ab5;
+    }
+
+    // Up to 15 trailing bytes, little endian.
+    const unsigned char* tail = data + 16 * blocks;
+    size_t remaining = length & 15;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+
+    for (size_t i = remaining; i > 8; i--) {
+        k2 ^= (uint64_t) tail[i - 1] << (8 * (i - 9));
+    }
+
+    for (size_t i = remaining < 8 ? remaining : 8; i > 0; i--) {
+        k1 ^= (uint64_t) tail[i - 1] << (8 * (i - 1));
+    }
+
+    if (remaining > 8) {
+        h2 ^= MM_ROTL(k2 * c2, 33) * c1;
+    }
+
+    if (remaining > 0) {
+        h1 ^= MM_ROTL(k1 * c1, 31) * c2;
+    }
+
+    h1 ^= length;
+    h2 ^= length;
+    h1 += h2;
+    h2 += h1;
+    MM_FMIX(h1);
+    MM_FMIX(h2);
+    h1 += h2;
+    h2 += h1;
+
+    #undef MM_FMIX
+    #undef MM_ROTL
+
+    *high = h1;
+    *low = h2;
+}
+
+
+/*
+* Function: sha256_blocks_software.
+* SHA-256 compression of whole 64 byte blocks.
+*
+* Parameter: state (eight word state)
+*            data (blocks)
+*            blocks (block count)
+* Return: none.
+*/
+void sha256_blocks_software(uint32_t* state, const unsigned char* data, size_t blocks) {
+
+    #define SHA_ROTR(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+    for (; blocks > 0; blocks--, data += 64) {
+        uint32_t w[64];
+        uint32_t v[8];
+
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t) data[4 * i] << 24 | data[4 * i + 1] << 16 |
+                   data[4 * i + 2] << 8 | data[4 * i + 3];
+        }
+
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = SHA_ROTR(w[i - 15], 7) ^ SHA_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = SHA_ROTR(w[i - 2], 17) ^ SHA_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        memcpy(v, state, sizeof(v));
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = SHA_ROTR(v[4], 6) ^ SHA_ROTR(v[4], 11) ^ SHA_ROTR(v[4], 25);
+            uint32_t choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+            uint32_t t1 = v[7] + s1 + choice + sha256_k[i] + w[i];
+            uint32_t s0 = SHA_ROTR(v[0], 2) ^ SHA_ROTR(v[0], 13) ^ SHA_ROTR(v[0], 22);
+            uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+
+            memmove(v + 1, v, 7 * sizeof(uint32_t));
+            v[4] += t1;
+            v[0] = t1 + s0 + majority;
+        }
+
+        for (int i = 0; i < 8; i++) {
+            state[i] += v[i];
+        }
+    }
+
+    #undef SHA_ROTR
+}
+
+
+#if defined(__x86_64__)
+/*
+* Function: sha256_blocks_hardware.
+* SHA-256 compression with the SHA extensions. The state is kept as
+* ABEF and CDGH halves, and each sha256rnds2 does two rounds.
+*
+* Parameter: state (eight word state)
+*            data (blocks)
+*            blocks (block count)
+* Return: none.
+*/
+__attribute__((target("sha,sse4.1")))
+void sha256_blocks_hardware(uint32_t* state, const unsigned char* data, size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i low = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[0]), 0xb1);
+    __m128i high = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[4]), 0x1b);
+    __m128i abef = _mm_alignr_epi8(low, high, 8);
+    __m128i cdgh = _mm_blend_epi16(high, low, 0xf0);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i saved_abef = abef;
+        __m128i saved_cdgh = cdgh;
+        __m128i w[4];
+
+        // Four rounds per step. Words 16 on are built from the last 16.
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16 * i)),
+                                        byte_swap);
+            } else {
+                __m128i sum = _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]),
+                                            _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+
+                w[i & 3] = _mm_sha256msg2_epu32(sum, w[(i + 3) & 3]);
+            }
+
+            __m128i message = _mm_add_epi32(w[i & 3],
+                                            _mm_loadu_si128((const __m128i*) &sha256_k[4 * i]));
+
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(message, 0x0e));
+        }
+
+        abef = _mm_add_epi32(abef, saved_abef);
+        cdgh = _mm_add_epi32(cdgh, saved_cdgh);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+
+    _mm_storeu_si128((__m128i*) &state[0], _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128((__m128i*) &state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+#else
+void sha256_blocks_hardware(uint32_t* state, const unsigned char* data, size_t blocks) {
+    sha256_blocks_software(state, data, blocks);
+}
+#endif
+
+
+/*
+* Function: sha256.
+* SHA-256 of a buffer.
+*
+* Parameter: data (bytes)
+*            length (byte count)
+*            digest (32 byte result)
+* Return: none.
+*/
+void sha256(const unsigned char* data, size_t length, unsigned char* digest) {
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    void (*blocks)(uint32_t*, const unsigned char*, size_t) =
+        has_sha_instructions ? sha256_blocks_hardware : sha256_blocks_software;
+    unsigned char last[128] = {0};
+    size_t whole = length / 64;
+    size_t remaining = length % 64;
+
+    blocks(state, data, whole);
+
+    // Pad with 0x80, zeros, and the bit length, in one or two blocks.
+    size_t last_length = remaining < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t) length * 8;
+
+    memcpy(last, data + 64 * whole, remaining);
+    last[remaining] = 0x80;
+
+    for (int i = 0; i < 8; i++) {
+        last[last_length - 1 - i] = bits >> (8 * i);
+    }
+
+    blocks(state, last, last_length / 64);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = state[i] >> 24;
+        digest[4 * i + 1] = state[i] >> 16;
+        digest[4 * i + 2] = state[i] >> 8;
+        digest[4 * i + 3] = state[i];
+    }
+}
+
+
+/*
+* Function: hash_buffer.
+* Hashes a buffer with the chosen algorithm. Digests are stored big
+* endian, so printing the bytes in order gives the usual hex form.
+*
+* Parameter: algorithm (HASH_CRC32C, HASH_XXH64, HASH_MURMUR3, or HASH_SHA256)
+*            data (bytes)
+*            length (byte count)
+*            digest (room for HASH_MAX_DIGEST bytes)
+* Return: digest length in bytes.
+*/
+int hash_buffer(int algorithm, const unsigned char* data, size_t length,
+                unsigned char* digest) {
+    uint64_t words[2];
+    int count;
+
+    if (algorithm == HASH_SHA256) {
+        sha256(data, length, digest);
+        return 32;
+    }
+
+    if (algorithm == HASH_CRC32C) {
+        words[0] = ~(has_crc32c_instruction ? crc32c_hardware(~0u, data, length) :
+                                              crc32c_software(~0u, data, length));
+        words[0] &= 0xffffffff;
+        count = 4;
+    } else if (algorithm == HASH_XXH64) {
+        words[0] = xxh64(data, length);
+        count = 8;
+    } else {
+        murmur3_128(data, length, &words[0], &words[1]);
+        count = 16;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int word = i / 8;
+        int shift = (word == 0 ? count < 8 ? count : 8 : 8) - 1 - i % 8;
+
+        digest[i] = words[word] >> (8 * shift);
+    }
+
+    return count;
+}
+
+
+/*
+* Function: tree_hash_worker.
+* Thread body. Hashes unclaimed chunks until none are left.
+*
+* Parameter: argument (struct tree_hash)
+* Return: NULL.
+*/
+void* tree_hash_worker(void* argument) {
+    struct tree_hash* tree = argument;
+    size_t chunk;
+
+    while ((chunk = __atomic_fetch_add(&tree->next_chunk, 1, __ATOMIC_RELAXED)) <
+           tree->chunk_count) {
+        size_t offset = chunk * tree->chunk_size;
+        size_t length = tree->length - offset < tree->chunk_size ?
+                        tree->length - offset : tree->chunk_size;
+
+        hash_buffer(tree->algorithm, tree->data + offset, length,
+                    tree->digests + chunk * HASH_MAX_DIGEST);
+    }
+
+    return NULL;
+}
+
+
+/*
+* Function: tree_hash.
+* Hashes fixed size chunks on several threads, then hashes the chunk
+* digests, in order, with the same algorithm. The result depends on the
+* chunk size but not on the thread count.
+*
+* Parameter: algorithm (hash algorithm)
+*            data (bytes)
+*            length (byte count)
+*            chunk_size (bytes per chunk)
+*            threads (threads to use, including the caller)
+*            digest (room for HASH_MAX_DIGEST bytes)
+* Return: digest length in bytes.
+*/
+int tree_hash(int algorithm, const unsigned char* data, size_t length, size_t chunk_size,
+              int threads, unsigned char* digest) {
+    struct tree_hash tree = {
+        .algorithm = algorithm, .data = data, .length = length, .chunk_size = chunk_size,
+        .chunk_count = length == 0 ? 1 : (length + chunk_size - 1) / chunk_size
+    };
+    pthread_t workers[TREE_MAX_THREADS];
+    bool is_started[TREE_MAX_THREADS] = { false };
+    unsigned char sample[HASH_MAX_DIGEST];
+    int digest_length = hash_buffer(algorithm, NULL, 0, sample);
+
+    tree.digests = malloc(tree.chunk_count * HASH_MAX_DIGEST);
+
+    for (int i = 1; i < threads && (size_t) i < tree.chunk_count; i++) {
+        is_started[i] = start_thread(&workers[i], tree_hash_worker, &tree);
+    }
+
+    // The shell thread hashes chunks too.
+    tree_hash_worker(&tree);
+
+    for (int i = 1; i < threads && (size_t) i < tree.chunk_count; i++) {
+        if (is_started[i]) {
+            pthread_join(workers[i], NULL);
+        }
+    }
+
+    // Pack the chunk digests and hash them.
+    for (size_t i = 1; i < tree.chunk_count; i++) {
+        memmove(tree.digests + i * digest_length, tree.digests + i * HASH_MAX_DIGEST,
+                digest_length);
+    }
+
+    hash_buffer(algorithm, tree.digests, tree.chunk_count * digest_length, digest);
+    free(tree.digests);
+    return digest_length;
+}
+
+
+/*
+* Function: checksum_file.
+* Maps a file and prints its digest and name. Files that cannot be
+* mapped, such as pipes, are read into memory. Directories and other
+* files without contents are refused.
+*
+* Parameter: path (file name)
+*            algorithm (hash algorithm)
+*            is_tree (tree hash rather than a plain hash)
+*            chunk_size (tree chunk size)
+*            threads (tree threads)
+* Return: false if the file could not be read.
+*/
+bool checksum_file(char* path, int algorithm, bool is_tree, size_t chunk_size, int threads) {
+    struct stat status;
+    unsigned char digest[HASH_MAX_DIGEST];
+    unsigned char* data = NULL;
+    size_t length = 0;
+    bool is_mapped = false;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd != -1 && fstat(fd, &status) == -1) {
+        close(fd);
+        fd = -1;
+    }
+
+    // Only files with contents. Reading a directory would hash nothing.
+    if (fd != -1 && !S_ISREG(status.st_mode) && !S_ISFIFO(status.st_mode) &&
+        !S_ISCHR(status.st_mode) && !S_ISBLK(status.st_mode)) {
+        errno = S_ISDIR(status.st_mode) ? EISDIR : EINVAL;
+        close(fd);
+        fd = -1;
+    }
+
+    if (fd == -1) {
+        printf("checksum: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if (S_ISREG(status.st_mode) && status.st_size > 0) {
+        length = status.st_size;
+        data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        is_mapped = data != MAP_FAILED;
+
+        if (is_mapped) {
+            madvise(data, length, is_tree ? MADV_WILLNEED : MADV_SEQUENTIAL);
+        } else {
+            data = NULL;
+            length = 0;
+        }
+    }
+
+    // Not mappable, or a file such as those in /proc that reports no size.
+    if (!is_mapped) {
+        size_t capacity = 0;
+        ssize_t bytes_read = 1;
+
+        while (bytes_read > 0) {
+            if (length == capacity) {
+                capacity = capacity ? capacity * 2 : 65536;
+                data = realloc(data, capacity);
+            }
+
+            bytes_read = read(fd, data + length, capacity - length);
+            length += bytes_read > 0 ? bytes_read : 0;
+        }
+
+        // A partial read must not pass for the file's digest.
+        if (bytes_read == -1) {
+            printf("checksum: %s: %s\n", path, strerror(errno));
+            free(data);
+            close(fd);
+            return false;
+        }
+    }
+
+    int digest_length = is_tree ?
+                        tree_hash(algorithm, data, length, chunk_size, threads, digest) :
+                        hash_buffer(algorithm, data, length, digest);
+
+    for (int i = 0; i < digest_length; i++) {
+        printf("%02x", digest[i]);
+    }
+    printf("  %s\n", path);
+
+    if (is_mapped) {
+        munmap(data, length);
+    } else {
+        free(data);
+    }
+    close(fd);
+    return true;
+}
+
+
+/*
+* Function: checksum_command.
+* Built-in checksum command.
+* checksum [-t] [-j N] [-s SIZE] crc32c|xxh64|murmur3|sha256 FILE...
+* -t hashes chunks of SIZE bytes (default 4M) on N threads (default one
+* per core) and prints the hash of the chunk digests. With no
+* arguments, shows the algorithms and which use CPU instructions.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void checksum_command(struct command_line* current_command) {
+    bool is_tree = false;
+    size_t chunk_size = TREE_CHUNK;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores < 1 ? 1 : cores > TREE_MAX_THREADS ? TREE_MAX_THREADS : cores;
+    int algorithm = -1;
+    int i = 1;
+
+    detect_hash_acceleration();
+
+    for (; i < current_command->arg_count; i++) {
+        char* argument = current_command->arg_variables[i];
+        bool has_value = i + 1 < current_command->arg_count;
+        rlim_t value;
+
+        if (strcmp(argument, "-t") == 0) {
+            is_tree = true;
+        } else if (strcmp(argument, "-j") == 0 && has_value) {
+            threads = atoi(current_command->arg_variables[++i]);
+            threads = threads < 1 ? 1 : threads > TREE_MAX_THREADS ? TREE_MAX_THREADS : threads;
+        } else if (strcmp(argument, "-s") == 0 && has_value &&
+                   parse_limit_value(current_command->arg_variables[++i], 1, &value) &&
+                   value > 0 && value != RLIM_INFINITY) {
+            chunk_size = value;
+        } else {
+            break;
+        }
+    }
+
+    for (int j = 0; i < current_command->arg_count && j < HASH_COUNT; j++) {
+        if (strcmp(current_command->arg_variables[i], hash_names[j]) == 0) {
+            algorithm = j;
+        }
+    }
+
+    if (algorithm == -1 || i + 1 >= current_command->arg_count) {
+        printf("usage: checksum [-t] [-j N] [-s SIZE] crc32c|xxh64|murmur3|sha256 FILE...\n");
+        printf("crc32c %s, sha256 %s\n",
+               has_crc32c_instruction ? "uses sse4.2" : "in software",
+               has_sha_instructions ? "uses sha extensions" : "in software");
+        fflush(stdout);
+        return;
+    }
+
+    bool is_ok = true;
+
+    for (i++; i < current_command->arg_count; i++) {
+        if (!checksum_file(current_command->arg_variables[i], algorithm, is_tree, chunk_size,
+                           threads)) {
+            is_ok = false;
+        }
+    }
+
+    fflush(stdout);
+    latest_status = is_ok ? 0 : 1 << 8;
+}
+
+
+/*
+* Function: read_directory.
+* Reads a batch of entries with getdents64.
+*
+* Parameter: dir_fd (open directory)
+*            buffer (room for entries)
+*            size (buffer size)
+* Return: bytes of entries, 0 at the end, or -1 on error.
+*/
+int read_directory(int dir_fd, char* buffer, size_t size) {
+    return syscall(SYS_getdents64, dir_fd, buffer, size);
+}
+
+
+/*
+* Function: entry_type.
+* File type of a directory entry. Most file systems fill in d_type, so
+* only the rest need a stat.
+*
+* Parameter: dir_fd (directory holding the entry)
+*            entry (directory entry)
+* Return: DT_ type, or DT_UNKNOWN if it cannot be found.
+*/
+int entry_type(int dir_fd, struct linux_dirent64* entry) {
+    struct statx status;
+
+    if (entry->d_type != DT_UNKNOWN) {
+        return entry->d_type;
+    }
+
+    if (statx(dir_fd, entry->d_name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &status) == -1) {
+        return DT_UNKNOWN;
+    }
+
+    return IFTODT(status.stx_mode);
+}
+
+
+/*
+* Function: join_path.
+* Joins a directory and a name with one slash.
+*
+* Parameter: directory (directory path)
+*            name (entry name)
+* Return: new string. Caller frees.
+*/
+char* join_path(const char* directory, const char* name) {
+    size_t length = strlen(directory);
+    char* path = malloc(length + strlen(name) + 2);
+
+    sprintf(path, length > 0 && directory[length - 1] == '/' ? "%s%s" : "%s/%s",
+            directory, name);
+    return path;
+}
+
+
+/*
+* Function: copy_file_data.
+* Copies the rest of a file in the kernel with copy_file_range, or with
+* read and write where the file systems do not support it.
+*
+* Parameter: source_fd (file to read)
+*            target_fd (file to write)
+* Return: false on error, with errno set.
+*/
+bool copy_file_data(int source_fd, int target_fd) {
+    bool has_copied = false;
+    ssize_t result;
+
+    while ((result = copy_file_range(source_fd, NULL, target_fd, NULL, 1 << 30, 0)) != 0) {
+        if (result > 0) {
+            has_copied = true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (!has_copied && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                                   errno == EOPNOTSUPP)) {
+            break;
+        } else {
+            return false;
+        }
+    }
+
+    if (result == 0) {
+        return true;
+    }
+
+    char* buffer = malloc(1 << 20);
+    size_t bytes_read = 1;
+    bool is_copied = true;
+
+    while (is_copied && bytes_read > 0) {
+        is_copied = read_full(source_fd, buffer, 1 << 20, &bytes_read) &&
+                    write_full(target_fd, buffer, bytes_read);
+    }
+
+    free(buffer);
+    return is_copied;
+}
+
+
+/*
+* Function: copy_error.
+* Reports a failed copy. Called from workers too.
+*
+* Parameter: pool (copy in progress)
+*            path (file that failed)
+* Return: none.
+*/
+void copy_error(struct copy_pool* pool, const char* path) {
+    printf("pcp: %s: %s\n", path, strerror(errno));
+    fflush(stdout);
+    __atomic_fetch_add(&pool->errors, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+* Function: copy_file.
+* Copies one regular file with its mode and times. A reflink is tried
+* first, so file systems that share extents copy no data at all.
+*
+* Parameter: pool (copy in progress)
+*            source (file to copy)
+*            target (new file)
+* Return: none.
+*/
+void copy_file(struct copy_pool* pool, char* source, char* target) {
+    struct statx status;
+    int source_fd = open(source, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (source_fd == -1 ||
+        statx(source_fd, "", AT_EMPTY_PATH, STATX_MODE | STATX_SIZE | STATX_ATIME |
+              STATX_MTIME, &status) == -1) {
+        copy_error(pool, source);
+        if (source_fd != -1) {
+            close(source_fd);
+        }
+        return;
+    }
+
+    int target_fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (target_fd == -1) {
+        copy_error(pool, target);
+        close(source_fd);
+        return;
+    }
+
+    if (ioctl(target_fd, FICLONE, source_fd) == 0) {
+        __atomic_fetch_add(&pool->reflinked, 1, __ATOMIC_RELAXED);
+    } else if (!copy_file_data(source_fd, target_fd)) {
+        copy_error(pool, target);
+        close(source_fd);
+        close(target_fd);
+        return;
+    }
+
+    struct timespec times[2] = {
+        { status.stx_atime.tv_sec, status.stx_atime.tv_nsec },
+        { status.stx_mtime.tv_sec, status.stx_mtime.tv_nsec }
+    };
+
+    if (fchmod(target_fd, status.stx_mode & 07777) == -1 || futimens(target_fd, times) == -1) {
+        copy_error(pool, target);
+    }
+
+    __atomic_fetch_add(&pool->files, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool->bytes, status.stx_size, __ATOMIC_RELAXED);
+    close(source_fd);
+    close(target_fd);
+}
+
+
+/*
+* Function: copy_worker.
+* Thread body. Copies queued files until the walk is over and the
+* queue is empty.
+*
+* Parameter: argument (struct copy_pool)
+* Return: NULL.
+*/
+void* copy_worker(void* argument) {
+    struct copy_pool* pool = argument;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+
+        while (pool->next == pool->count && !pool->is_walked) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+
+        if (pool->next == pool->count) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+
+        char* source = pool->sources[pool->next];
+        char* target = pool->targets[pool->next];
+
+        pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        copy_file(pool, source, target);
+        free(source);
+        free(target);
+    }
+}
+
+
+/*
+* Function: queue_copy.
+* Hands a file to the workers.
+*
+* Parameter: pool (copy in progress)
+*            source (file to copy, taken over)
+*            target (new file, taken over)
+* Return: none.
+*/
+void queue_copy(struct copy_pool* pool, char* source, char* target) {
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->count == pool->capacity) {
+        pool->capacity = pool->capacity ? pool->capacity * 2 : 1024;
+        pool->sources = realloc(pool->sources, pool->capacity * sizeof(char*));
+        pool->targets = realloc(pool->targets, pool->capacity * sizeof(char*));
+    }
+
+    pool->sources[pool->count] = source;
+    pool->targets[pool->count] = target;
+    pool->count++;
+
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+* Function: copy_tree.
+* Walks a source with getdents64. Regular files go to the workers.
+* Directories, symbolic links, and FIFOs are made here, so each
+* directory exists before any file inside it is queued.
+*
+* Parameter: pool (copy in progress)
+*            source (path to copy, taken over)
+*            target (path to create, taken over)
+*            type (DT_ type from the parent's entry, or DT_UNKNOWN)
+* Return: none.
+*/
+void copy_tree(struct copy_pool* pool, char* source, char* target, int type) {
+    struct statx status;
+
+    // Regular files need no stat here. The worker stats the open file.
+    if (type == DT_REG) {
+        queue_copy(pool, source, target);
+        return;
+    }
+
+    if (statx(AT_FDCWD, source, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_MODE | STATX_ATIME |
+              STATX_MTIME, &status) == -1) {
+        copy_error(pool, source);
+        free(source);
+        free(target);
+        return;
+    }
+
+    struct timespec times[2] = {
+        { status.stx_atime.tv_sec, status.stx_atime.tv_nsec },
+        { status.stx_mtime.tv_sec, status.stx_mtime.tv_nsec }
+    };
+    mode_t mode = status.stx_mode & 07777;
+
+    if (S_ISREG(status.stx_mode)) {
+        queue_copy(pool, source, target);
+        return;
+    }
+
+    if (S_ISLNK(status.stx_mode)) {
+        char link[PATH_MAX];
+        ssize_t length = readlink(source, link, sizeof(link) - 1);
+
+        if (length == -1) {
+            copy_error(pool, source);
+        } else {
+            link[length] = '\0';
+
+            if (symlink(link, target) == -1 ||
+                utimensat(AT_FDCWD, target, times, AT_SYMLINK_NOFOLLOW) == -1) {
+                copy_error(pool, target);
+            }
+        }
+    } else if (S_ISFIFO(status.stx_mode)) {
+        if (mkfifo(target, mode) == -1 || utimensat(AT_FDCWD, target, times, 0) == -1) {
+            copy_error(pool, target);
+        }
+    } else if (!S_ISDIR(status.stx_mode)) {
+        printf("pcp: %s: skipped, not a file, directory, or link\n", source);
+        fflush(stdout);
+    }
+
+    if (!S_ISDIR(status.stx_mode)) {
+        free(source);
+        free(target);
+        return;
+    }
+
+    // Owner access until the walk is done, so read-only sources copy.
+    int dir_fd = open(source, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (dir_fd == -1 || (mkdir(target, 0700) == -1 && errno != EEXIST)) {
+        copy_error(pool, dir_fd == -1 ? source : target);
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+        free(source);
+        free(target);
+        return;
+    }
+
+    if (pool->directory_count == pool->directory_capacity) {
+        pool->directory_capacity = pool->directory_capacity ? pool->directory_capacity * 2 : 64;
+        pool->directories = realloc(pool->directories,
+                                    pool->directory_capacity * sizeof(struct copy_directory));
+    }
+
+    struct copy_directory* directory = &pool->directories[pool->directory_count++];
+
+    directory->target = target;
+    directory->mode = mode;
+    memcpy(directory->times, times, sizeof(times));
+
+    char* buffer = malloc(DIRENT_BUFFER);
+    int length;
+
+    while ((length = read_directory(dir_fd, buffer, DIRENT_BUFFER)) > 0) {
+        for (int offset = 0; offset < length;) {
+            struct linux_dirent64* entry = (struct linux_dirent64*) (buffer + offset);
+
+            offset += entry->d_reclen;
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+
+            copy_tree(pool, join_path(source, entry->d_name), join_path(target, entry->d_name),
+                      entry->d_type);
+        }
+    }
+
+    if (length == -1) {
+        copy_error(pool, source);
+    }
+
+    free(buffer);
+    close(dir_fd);
+    free(source);
+}
+
+
+/*
+* Function: pcp_command.
+* Built-in parallel recursive copy.
+* pcp [-v] [-j N] SOURCE... DEST
+* Copies like cp -r with modes and times kept. If DEST is a directory,
+* each SOURCE is copied into it. -j sets the number of copy threads
+* (default one per core). -v prints totals.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: none.
+*/
+void pcp_command(struct command_line* current_command) {
+    bool is_verbose = false;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores < 1 ? 1 : cores > COPY_MAX_THREADS ? COPY_MAX_THREADS : cores;
+    int first = 1;
+
+    for (; first < current_command->arg_count; first++) {
+        char* argument = current_command->arg_variables[first];
+
+        if (strcmp(argument, "-v") == 0) {
+            is_verbose = true;
+        } else if (strcmp(argument, "-j") == 0 && first + 1 < current_command->arg_count) {
+            threads = atoi(current_command->arg_variables[++first]);
+            threads = threads < 1 ? 1 : threads > COPY_MAX_THREADS ? COPY_MAX_THREADS : threads;
+        } else {
+            break;
+        }
+    }
+
+    int last = current_command->arg_count - 1;
+
+    if (last - first < 1) {
+        printf("usage: pcp [-v] [-j N] SOURCE... DEST\n");
+        fflush(stdout);
+        return;
+    }
+
+    char* destination = current_command->arg_variables[last];
+    struct stat destination_status;
+    bool is_into = stat(destination, &destination_status) == 0 &&
+                   S_ISDIR(destination_status.st_mode);
+
+    if (!is_into && last - first > 1) {
+        printf("pcp: %s: not a directory\n", destination);
+        fflush(stdout);
+        return;
+    }
+
+    // Where copies land, to refuse copying a directory into itself.
+    char* parent = strdup(destination);
+    char* slash = strrchr(parent, '/');
+
+    if (!is_into) {
+        if (slash == NULL) {
+            strcpy(parent, ".");
+        } else {
+            slash[slash == parent ? 1 : 0] = '\0';
+        }
+    }
+
+    char* resolved_parent = realpath(parent, NULL);
+
+    free(parent);
+
+    struct copy_pool pool = {
+        .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER
+    };
+    pthread_t workers[COPY_MAX_THREADS];
+    int started = 0;
+    long long started_at = monotonic_ms();
+
+    for (int i = 0; i < threads; i++) {
+        if (start_thread(&workers[started], copy_worker, &pool)) {
+            started++;
+        }
+    }
+
+    for (int i = first; i < last; i++) {
+        char* source = current_command->arg_variables[i];
+        char* resolved_source = realpath(source, NULL);
+        size_t source_length = resolved_source ? strlen(resolved_source) : 0;
+
+        if (resolved_source != NULL && resolved_parent != NULL &&
+            strncmp(resolved_parent, resolved_source, source_length) == 0 &&
+            (resolved_parent[source_length] == '\0' || resolved_parent[source_length] == '/' ||
+             source_length == 1)) {
+            struct stat source_status;
+
+            if (stat(source, &source_status) == 0 && S_ISDIR(source_status.st_mode)) {
+                printf("pcp: %s: cannot copy a directory into itself\n", source);
+                fflush(stdout);
+                free(resolved_source);
+                pool.errors++;
+                continue;
+            }
+        }
+
+        free(resolved_source);
+
+        // Copies go into DEST under the source's last name.
+        char* name = strdup(source);
+        size_t length = strlen(name);
+
+        while (length > 1 && name[length - 1] == '/') {
+            name[--length] = '\0';
+        }
+
+        char* base = strrchr(name, '/');
+        char* target = is_into ? join_path(destination, base && base[1] ? base + 1 : name) :
+                                 strdup(destination);
+
+        copy_tree(&pool, strdup(source), target, DT_UNKNOWN);
+        free(name);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.is_walked = true;
+    pthread_cond_broadcast(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    // No worker started. Copy here.
+    if (started == 0) {
+        copy_worker(&pool);
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // Innermost directories last in the walk, so set them first.
+    for (size_t i = pool.directory_count; i > 0; i--) {
+        struct copy_directory* directory = &pool.directories[i - 1];
+
+        if (chmod(directory->target, directory->mode) == -1 ||
+            utimensat(AT_FDCWD, directory->target, directory->times, 0) == -1) {
+            copy_error(&pool, directory->target);
+        }
+        free(directory->target);
+    }
+
+    if (is_verbose) {
+        double seconds = (monotonic_ms() - started_at) / 1000.0;
+
+        printf("pcp: %zu files (%zu reflinked), %zu directories, %.1f MiB in %.2f s, "
+               "%d threads\n", pool.files, pool.reflinked, pool.directory_count,
+               pool.bytes / 1048576.0, seconds, started ? started : 1);
+    }
+
+    fflush(stdout);
+    free(pool.directories);
+    free(pool.sources);
+    free(pool.targets);
+    free(resolved_parent);
+}
+
+
+/*
+* Function: walk_push.
+* Adds a directory to the newest end of a queue.
+*
+* Parameter: queue (worker's queue)
+*            directory (directory to walk)
+* Return: none.
+*/
+void walk_push(struct walk_queue* queue, struct walk_directory* directory) {
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->tail == queue->capacity) {
+        if (queue->head > 0) {
+            memmove(queue->items, queue->items + queue->head,
+                    (queue->tail - queue->head) * sizeof(struct walk_directory*));
+            queue->tail -= queue->head;
+            queue->head = 0;
+        } else {
+            queue->capacity = queue->capacity ? queue->capacity * 2 : 256;
+            queue->items = realloc(queue->items,
+                                   queue->capacity * sizeof(struct walk_directory*));
+        }
+    }
+
+    queue->items[queue->tail++] = directory;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+
+/*
+* Function: walk_take.
+* Takes a directory from a queue.
+*
+* Parameter: queue (worker's queue)
+*            is_stealing (take the oldest rather than the newest)
+* Return: directory, or NULL if the queue is empty.
+*/
+struct walk_directory* walk_take(struct walk_queue* queue, bool is_stealing) {
+    struct walk_directory* directory = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->head < queue->tail) {
+        directory = is_stealing ? queue->items[queue->head++] : queue->items[--queue->tail];
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return directory;
+}
+
+
+/*
+* Function: walk_error.
+* Reports a failed removal or stat. Called from workers.
+*
+* Parameter: pool (walk in progress)
+*            path (path, or the directory holding name)
+*            name (entry name, or NULL)
+* Return: none.
+*/
+void walk_error(struct walk_pool* pool, const char* path, const char* name) {
+    printf("%s: %s%s%s: %s\n", pool->name, path, name ? "/" : "",
+           name ? name : "", strerror(errno));
+    fflush(stdout);
+    __atomic_fetch_add(&pool->errors, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+* Function: first_link.
+* Records a file with several links so it is counted once.
+*
+* Parameter: pool (walk in progress)
+*            device (file's device)
+*            inode (file's inode)
+* Return: true the first time the file is seen.
+*/
+bool first_link(struct walk_pool* pool, uint64_t device, uint64_t inode) {
+    bool is_first = true;
+
+    pthread_mutex_lock(&pool->link_lock);
+
+    // Open addressing on pairs. Rehash when half full.
+    if (pool->link_count * 2 >= pool->link_capacity) {
+        size_t old_capacity = pool->link_capacity;
+        uint64_t* old_links = pool->links;
+
+        pool->link_capacity = old_capacity ? old_capacity * 2 : 1024;
+        pool->links = calloc(pool->link_capacity * 2, sizeof(uint64_t));
+        pool->link_count = 0;
+
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_links[2 * i + 1] != 0) {
+                size_t slot = (old_links[2 * i] * 31 + old_links[2 * i + 1]) &
+                              (pool->link_capacity - 1);
+
+                while (pool->links[2 * slot + 1] != 0) {
+                    slot = (slot + 1) & (pool->link_capacity - 1);
+                }
+                pool->links[2 * slot] = old_links[2 * i];
+                pool->links[2 * slot + 1] = old_links[2 * i + 1];
+                pool->link_count++;
+            }
+        }
+        free(old_links);
+    }
+
+    size_t slot = (device * 31 + inode) & (pool->link_capacity - 1);
+
+    while (pool->links[2 * slot + 1] != 0) {
+        if (pool->links[2 * slot] == device && pool->links[2 * slot + 1] == inode) {
+            is_first = false;
+            break;
+        }
+        slot = (slot + 1) & (pool->link_capacity - 1);
+    }
+
+    if (is_first) {
+        pool->links[2 * slot] = device;
+        pool->links[2 * slot + 1] = inode;
+        pool->link_count++;
+    }
+
+    pthread_mutex_unlock(&pool->link_lock);
+    return is_first;
+}
+
+
+/*
+* Function: finish_walk_directory.
+* Drops one reference to a directory. The last one closes it, for prm
+* removes it, and passes the reference on to its parent.
+*
+* Parameter: pool (walk in progress)
+*            directory (scanned directory, or one whose child finished)
+* Return: none.
+*/
+void finish_walk_directory(struct walk_pool* pool, struct walk_directory* directory) {
+
+    while (directory != NULL && __atomic_sub_fetch(&directory->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct walk_directory* parent = directory->parent;
+
+        if (directory->fd != -1) {
+            close(directory->fd);
+        }
+
+        if (pool->is_removing &&
+            unlinkat(directory->parent_fd, directory->name, AT_REMOVEDIR) == -1) {
+            walk_error(pool, directory->path, NULL);
+        }
+
+        free(directory->path);
+        free(directory->name);
+        free(directory);
+        directory = parent;
+    }
+}
+
+
+/*
+* Function: walk_scan.
+* Reads one directory with getdents64. Subdirectories are queued for
+* any worker, to be opened relative to this one, so a directory swapped
+* for a symlink mid-walk is not followed. prm unlinks everything else
+* relative to the directory;
+* pdu adds up allocated blocks from a statx asking only for what it
+* needs.
+*
+* Parameter: worker (worker doing the scan)
+*            directory (directory to read)
+* Return: none.
+*/
+void walk_scan(struct walk_worker* worker, struct walk_directory* directory) {
+    struct walk_pool* pool = worker->pool;
+    struct statx status;
+    int dir_fd = openat(directory->parent_fd, directory->name,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+    directory->fd = dir_fd;
+
+    if (dir_fd == -1) {
+        walk_error(pool, directory->path, NULL);
+        finish_walk_directory(pool, directory);
+        return;
+    }
+
+    if (!pool->is_removing &&
+        statx(dir_fd, "", AT_EMPTY_PATH | AT_STATX_DONT_SYNC, STATX_BLOCKS, &status) == 0) {
+        __atomic_fetch_add(&pool->blocks[directory->root], status.stx_blocks, __ATOMIC_RELAXED);
+    }
+
+    char* buffer = malloc(DIRENT_BUFFER);
+    size_t files = 0;
+    int length;
+
+    while ((length = read_directory(dir_fd, buffer, DIRENT_BUFFER)) > 0) {
+        for (int offset = 0; offset < length;) {
+            struct linux_dirent64* entry = (struct linux_dirent64*) (buffer + offset);
+            char* name = entry->d_name;
+
+            offset += entry->d_reclen;
+
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+
+            if (entry_type(dir_fd, entry) == DT_DIR) {
+                struct walk_directory* child = malloc(sizeof(struct walk_directory));
+
+                child->path = join_path(directory->path, name);
+                child->name = strdup(name);
+                child->parent_fd = dir_fd;
+                child->fd = -1;
+                child->parent = directory;
+                child->pending = 1;
+                child->root = directory->root;
+
+                __atomic_fetch_add(&directory->pending, 1, __ATOMIC_RELAXED);
+
+                __atomic_fetch_add(&pool->outstanding, 1, __ATOMIC_RELEASE);
+                walk_push(&pool->queues[worker->index], child);
+                continue;
+            }
+
+            if (pool->is_removing) {
+                if (unlinkat(dir_fd, name, 0) == -1) {
+                    walk_error(pool, directory->path, name);
+                    continue;
+                }
+            } else {
+                if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                          STATX_BLOCKS | STATX_NLINK | STATX_INO, &status) == -1) {
+                    walk_error(pool, directory->path, name);
+                    continue;
+                }
+
+                uint64_t device = (uint64_t) status.stx_dev_major << 32 | status.stx_dev_minor;
+
+                if (status.stx_nlink > 1 && !first_link(pool, device, status.stx_ino)) {
+                    continue;
+                }
+
+                __atomic_fetch_add(&pool->blocks[directory->root], status.stx_blocks,
+                                   __ATOMIC_RELAXED);
+            }
+
+            files++;
+        }
+    }
+
+    if (length == -1) {
+        walk_error(pool, directory->path, NULL);
+    }
+
+    free(buffer);
+    __atomic_fetch_add(&pool->files, files, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool->directories, 1, __ATOMIC_RELAXED);
+    finish_walk_directory(pool, directory);
+}
+
+
+/*
+* Function: walk_worker.
+* Thread body. Walks directories from its own queue, then steals from
+* the others, until no directory is queued or being scanned.
+*
+* Parameter: argument (struct walk_worker)
+* Return: NULL.
+*/
+void* walk_worker(void* argument) {
+    struct walk_worker* worker = argument;
+    struct walk_pool* pool = worker->pool;
+    int misses = 0;
+
+    while (__atomic_load_n(&pool->outstanding, __ATOMIC_ACQUIRE) > 0) {
+        struct walk_directory* directory = walk_take(&pool->queues[worker->index], false);
+
+        for (int i = 1; directory == NULL && i < pool->threads; i++) {
+            directory = walk_take(&pool->queues[(worker->index + i) % pool->threads], true);
+        }
+
+        // Others are still scanning and may queue more.
+        if (directory == NULL) {
+            if (++misses < 64) {
+                sched_yield();
+            } else {
+                poll(NULL, 0, 1);
+            }
+            continue;
+        }
+
+        misses = 0;
+        walk_scan(worker, directory);
+        __atomic_fetch_sub(&pool->outstanding, 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+
+/*
+* Function: walk_command.
+* Built-in prm and pdu.
+* prm [-j N] PATH... removes files and directory trees like rm -rf.
+* pdu [-j N] PATH... prints the KiB used by each path like du -s.
+* N threads (default one per core) walk directories, stealing work
+* from each other. Both report entries per second when done.
+*
+* Parameter: current_command (pointer to the structure)
+*            is_removing (prm rather than pdu)
+* Return: none.
+*/
+void walk_command(struct command_line* current_command, bool is_removing) {
+    char* name = is_removing ? "prm" : "pdu";
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores < 1 ? 1 : cores > WALK_MAX_THREADS ? WALK_MAX_THREADS : cores;
+    int first = 1;
+
+    if (first + 1 < current_command->arg_count &&
+        strcmp(current_command->arg_variables[first], "-j") == 0) {
+        threads = atoi(current_command->arg_variables[first + 1]);
+        threads = threads < 1 ? 1 : threads > WALK_MAX_THREADS ? WALK_MAX_THREADS : threads;
+        first += 2;
+    }
+
+    if (first >= current_command->arg_count) {
+        printf("usage: %s [-j N] PATH...\n", name);
+        fflush(stdout);
+        return;
+    }
+
+    walk_paths(name, current_command->arg_variables + first, current_command->arg_count - first,
+               threads, is_removing, false, false);
+}
+
+
+/*
+* Function: walk_paths.
+* Removes or sizes paths on a pool of walk workers. The shell thread
+* is worker 0.
+*
+* Parameter: name (command name for messages)
+*            paths (files and directories)
+*            path_count (number of paths)
+*            threads (workers, including the shell thread)
+*            is_removing (remove rather than size)
+*            is_quiet (print no totals)
+*            is_forced (ignore missing paths)
+* Return: number of errors.
+*/
+size_t walk_paths(char* name, char** paths, int path_count, int threads, bool is_removing,
+                  bool is_quiet, bool is_forced) {
+    struct walk_pool pool = {
+        .name = name, .is_removing = is_removing, .is_forced = is_forced, .threads = threads,
+        .link_lock = PTHREAD_MUTEX_INITIALIZER
+    };
+    struct walk_worker workers[WALK_MAX_THREADS];
+    pthread_t thread_ids[WALK_MAX_THREADS];
+    bool is_started[WALK_MAX_THREADS] = { false };
+    long long started_at = monotonic_ms();
+
+    pool.blocks = calloc(path_count, sizeof(unsigned long long));
+
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        workers[i].pool = &pool;
+        workers[i].index = i;
+    }
+
+    // Files are handled here. Directories are spread over the queues.
+    for (int i = 0; i < path_count; i++) {
+        char* path = paths[i];
+        char base[INPUT_LENGTH];
+        struct statx status;
+
+        last_component(path, base);
+
+        if (is_removing && (strcmp(base, ".") == 0 || strcmp(base, "..") == 0 ||
+                            strcmp(base, "/") == 0)) {
+            printf("%s: %s: refusing to remove\n", name, path);
+            pool.errors++;
+            continue;
+        }
+
+        if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_BLOCKS, &status) ==
+            -1) {
+            if (!is_forced || errno != ENOENT) {
+                walk_error(&pool, path, NULL);
+            }
+            continue;
+        }
+
+        if (S_ISDIR(status.stx_mode)) {
+            struct walk_directory* directory = malloc(sizeof(struct walk_directory));
+
+            directory->path = strdup(path);
+            directory->name = strdup(path);
+            directory->parent_fd = AT_FDCWD;
+            directory->fd = -1;
+            directory->parent = NULL;
+            directory->pending = 1;
+            directory->root = i;
+            pool.outstanding++;
+            walk_push(&pool.queues[i % threads], directory);
+        } else if (is_removing && unlink(path) == -1) {
+            walk_error(&pool, path, NULL);
+        } else {
+            pool.blocks[i] += status.stx_blocks;
+            pool.files++;
+        }
+    }
+
+    // The shell thread is worker 0.
+    for (int i = 1; i < threads; i++) {
+        is_started[i] = start_thread(&thread_ids[i], walk_worker, &workers[i]);
+    }
+
+    walk_worker(&workers[0]);
+
+    for (int i = 1; i < threads; i++) {
+        if (is_started[i]) {
+            pthread_join(thread_ids[i], NULL);
+        }
+    }
+
+    double seconds = (monotonic_ms() - started_at) / 1000.0;
+    size_t entries = pool.files + pool.directories;
+
+    if (!is_removing) {
+        for (int i = 0; i < path_count; i++) {
+            printf("%llu\t%s\n", pool.blocks[i] / 2, paths[i]);
+        }
+    }
+
+    if (!is_quiet) {
+        printf("%s: %zu files, %zu directories in %.2f s (%.0f entries/s, %d threads)\n", name,
+               pool.files, pool.directories, seconds, seconds > 0 ? entries / seconds : 0.0,
+               threads);
+    }
+    fflush(stdout);
+
+    for (int i = 0; i < threads; i++) {
+        free(pool.queues[i].items);
+        pthread_mutex_destroy(&pool.queues[i].lock);
+    }
+    free(pool.blocks);
+    free(pool.links);
+    return pool.errors;
+}
+
+
+/*
+* Function: last_component.
+* Last name in a path, ignoring trailing slashes. "/" stays "/".
+*
+* Parameter: path (path)
+*            name (room for INPUT_LENGTH bytes)
+* Return: none.
+*/
+void last_component(const char* path, char* name) {
+    size_t length = strlen(path);
+
+    while (length > 1 && path[length - 1] == '/') {
+        length--;
+    }
+
+    size_t start = length;
+
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+
+    if (start == length) {
+        start = length > 0 ? length - 1 : 0;
+    }
+
+    length -= start;
+    length = length < INPUT_LENGTH ? length : INPUT_LENGTH - 1;
+    memcpy(name, path + start, length);
+    name[length] = '\0';
+}
+
+
+/*
+* Function: cached_directory.
+* Opens a directory for *at() calls, or reuses one this command has
+* already opened.
+*
+* Parameter: cache (command's directories)
+*            path (directory path)
+* Return: descriptor, AT_FDCWD for ".", or -1 on error.
+*/
+int cached_directory(struct dir_cache* cache, const char* path) {
+
+    if (strcmp(path, ".") == 0) {
+        return AT_FDCWD;
+    }
+
+    for (int i = 0; i < cache->count; i++) {
+        if (strcmp(cache->paths[i], path) == 0) {
+            cache->last = i;
+            return cache->fds[i];
+        }
+    }
+
+    int fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int slot;
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    // Replace entries in turn once the cache is full.
+    if (cache->count < DIR_CACHE_SIZE) {
+        slot = cache->count++;
+    } else {
+        slot = cache->next++ % DIR_CACHE_SIZE;
+
+        while (cache->batch != NULL && cache->batch->in_flight > 0) {
+            batch_reap(cache->batch, 1);
+        }
+
+        if (slot == cache->last) {
+            slot = cache->next++ % DIR_CACHE_SIZE;
+        }
+
+        close(cache->fds[slot]);
+        free(cache->paths[slot]);
+    }
+
+    cache->paths[slot] = strdup(path);
+    cache->fds[slot] = fd;
+    cache->last = slot;
+    return fd;
+}
+
+
+/*
+* Function: parent_directory.
+* Splits a path into its directory, opened through the cache, and its
+* last name.
+*
+* Parameter: cache (command's directories)
+*            path (path)
+*            name (room for INPUT_LENGTH bytes, receives the last name)
+* Return: directory descriptor, AT_FDCWD, or -1 on error.
+*/
+int parent_directory(struct dir_cache* cache, const char* path, char* name) {
+    char parent[INPUT_LENGTH];
+    size_t length = strlen(path);
+
+    while (length > 1 && path[length - 1] == '/') {
+        length--;
+    }
+
+    if (length >= INPUT_LENGTH) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memcpy(parent, path, length);
+    parent[length] = '\0';
+
+    char* slash = strrchr(parent, '/');
+
+    // A bare name, or "/" itself.
+    if (slash == NULL || slash[1] == '\0') {
+        strcpy(name, parent);
+        return AT_FDCWD;
+    }
+
+    strcpy(name, slash + 1);
+    slash[slash == parent ? 1 : 0] = '\0';
+    return cached_directory(cache, parent);
+}
+
+
+/*
+* Function: close_dir_cache.
+* Closes the directories a command opened.
+*
+* Parameter: cache (command's directories)
+* Return: none.
+*/
+void close_dir_cache(struct dir_cache* cache) {
+
+    for (int i = 0; i < cache->count; i++) {
+        close(cache->fds[i]);
+        free(cache->paths[i]);
+    }
+
+    cache->count = 0;
+    cache->next = 0;
+}
+
+
+/*
+* Function: parse_file_options.
+* Reads single letter options, grouped or not, up to the first operand
+* or "--". A letter followed by ':' in options takes a value.
+*
+* Parameter: current_command (pointer to the structure)
+*            options (accepted letters, as for getopt)
+*            flags (128 entries, set for each letter seen)
+*            value (value of the option that takes one, or NULL)
+*            first (receives the index of the first operand)
+* Return: false on an option the built-in does not handle.
+*/
+bool parse_file_options(struct command_line* current_command, const char* options,
+                        bool* flags, char** value, int* first) {
+    int i = 1;
+
+    for (; i < current_command->arg_count; i++) {
+        char* argument = current_command->arg_variables[i];
+
+        if (strcmp(argument, "--") == 0) {
+            i++;
+            break;
+        }
+
+        if (argument[0] != '-' || argument[1] == '\0') {
+            break;
+        }
+
+        for (char* letter = argument + 1; *letter != '\0'; letter++) {
+            char* option = strchr(options, *letter);
+
+            if (option == NULL || *letter == ':' || (unsigned char) *letter >= 128) {
+                return false;
+            }
+
+            flags[(int) *letter] = true;
+
+            // The value is the rest of this argument or the next one.
+            if (option[1] == ':') {
+                if (letter[1] != '\0') {
+                    *value = letter + 1;
+                } else if (i + 1 < current_command->arg_count) {
+                    *value = current_command->arg_variables[++i];
+                } else {
+                    return false;
+                }
+                break;
+            }
+        }
+    }
+
+    *first = i;
+    return true;
+}
+
+
+/*
+* Function: parse_mode.
+* Reads an octal mode or a symbolic one such as u+x,go-w or a=rX.
+* Without u, g, o, or a, the umask limits which bits change.
+*
+* Parameter: text (mode)
+*            old_mode (current mode, for symbolic changes)
+*            is_directory (whether X applies)
+*            mode (result)
+* Return: false if text is not a mode.
+*/
+bool parse_mode(const char* text, mode_t old_mode, bool is_directory, mode_t* mode) {
+    size_t length = strlen(text);
+
+    if (length > 0 && length <= 4 && strspn(text, "01234567") == length) {
+        *mode = strtol(text, NULL, 8);
+        return true;
+    }
+
+    mode_t mask = umask(0);
+    mode_t result = old_mode & 07777;
+    const char* letter = text;
+
+    umask(mask);
+
+    while (true) {
+        mode_t who = 0;
+
+        for (; *letter != '\0' && strchr("ugoa", *letter) != NULL; letter++) {
+            who |= *letter == 'u' ? 04700 : *letter == 'g' ? 02070 : *letter == 'o' ? 01007 : 07777;
+        }
+
+        mode_t affected = who ? who : 07777 & ~mask;
+
+        if (*letter == '\0' || strchr("+-=", *letter) == NULL) {
+            return false;
+        }
+
+        while (*letter != '\0' && strchr("+-=", *letter) != NULL) {
+            char operation = *letter++;
+            mode_t bits = 0;
+
+            // Copy another class's bits, as in g=u.
+            if (*letter != '\0' && strchr("ugo", *letter) != NULL) {
+                int shift = *letter == 'u' ? 6 : *letter == 'g' ? 3 : 0;
+
+                bits = ((result >> shift) & 7) * 0111;
+                letter++;
+            }
+
+            for (; *letter != '\0' && strchr("rwxXst", *letter) != NULL; letter++) {
+                bits |= *letter == 'r' ? 0444 : *letter == 'w' ? 0222 : *letter == 'x' ? 0111 :
+                        *letter == 's' ? 06000 : *letter == 't' ? 01000 :
+                        is_directory || (old_mode & 0111) ? 0111 : 0;
+            }
+
+            if (operation == '+') {
+                result |= bits & affected;
+            } else if (operation == '-') {
+                result &= ~(bits & affected);
+            } else {
+                result = (result & ~(who ? who : 07777)) | (bits & affected);
+            }
+        }
+
+        if (*letter == '\0') {
+            break;
+        }
+
+        if (*letter++ != ',') {
+            return false;
+        }
+    }
+
+    *mode = result;
+    return true;
+}
+
+
+/*
+* Function: file_error.
+* Reports a failed file command on one path.
+*
+* Parameter: command (command name)
+*            path (path that failed)
+* Return: none.
+*/
+void file_error(const char* command, const char* path) {
+    printf("%s: %s: %s\n", command, path, strerror(errno));
+    fflush(stdout);
+}
+
+
+/*
+* Function: make_directory.
+* Creates a directory with mkdirat relative to its cached parent. With
+* is_parents, missing parents are made first and existing directories
+* are not an error.
+*
+* Parameter: cache (command's directories)
+*            path (directory to create)
+*            mode (mode to create it with)
+*            is_exact (set mode regardless of the umask)
+*            is_parents (as mkdir -p)
+* Return: false on error, after reporting it.
+*/
+bool make_directory(struct dir_cache* cache, const char* path, mode_t mode, bool is_exact,
+                    bool is_parents) {
+    char name[INPUT_LENGTH];
+    int dir_fd = parent_directory(cache, path, name);
+
+    if (dir_fd == -1 && errno == ENOENT && is_parents) {
+        char parent[INPUT_LENGTH];
+        size_t length = strlen(path);
+
+        while (length > 1 && path[length - 1] == '/') {
+            length--;
+        }
+
+        memcpy(parent, path, length);
+        parent[length] = '\0';
+        *strrchr(parent, '/') = '\0';
+
+        if (!make_directory(cache, parent, 0777, false, true)) {
+            return false;
+        }
+
+        dir_fd = parent_directory(cache, path, name);
+    }
+
+    if (dir_fd != -1 && mkdirat(dir_fd, name, mode) == 0) {
+        if (is_exact && fchmodat(dir_fd, name, mode, 0) == -1) {
+            file_error("mkdir", path);
+            return false;
+        }
+        return true;
+    }
+
+    if (dir_fd != -1 && is_parents && errno == EEXIST) {
+        struct stat status;
+
+        if (fstatat(dir_fd, name, &status, 0) == 0 && S_ISDIR(status.st_mode)) {
+            return true;
+        }
+        errno = EEXIST;
+    }
+
+    file_error("mkdir", path);
+    return false;
+}
+
+
+/*
+* Function: mkdir_command.
+* Built-in mkdir [-p] [-m MODE] DIR...
+*
+* Parameter: current_command (pointer to the structure)
+* Return: false if the command should run externally.
+*/
+bool mkdir_command(struct command_line* current_command) {
+    bool flags[128] = { false };
+    char* mode_text = NULL;
+    mode_t mode = 0777;
+    int first;
+
+    if (!parse_file_options(current_command, "pm:", flags, &mode_text, &first) ||
+        first >= current_command->arg_count ||
+        (mode_text != NULL && !parse_mode(mode_text, 0777, true, &mode))) {
+        return false;
+    }
+
+    struct dir_cache cache = {0};
+    struct file_batch batch;
+    bool is_batched = batch_begin(&batch, &cache, current_command, "mkdir", IORING_OP_MKDIRAT,
+                                  flags, current_command->arg_count - first);
+    bool is_ok = true;
+
+    for (int i = first; i < current_command->arg_count; i++) {
+        if (is_batched) {
+            struct batch_slot* slot = batch_slot(&batch, i);
+            struct io_uring_sqe* sqe;
+
+            slot->dir_fd = parent_directory(&cache, current_command->arg_variables[i],
+                                            slot->name);
+            batch.mode = mode;
+            batch.is_exact = mode_text != NULL;
+
+            if ((sqe = batch_prepare(&batch, slot)) != NULL) {
+                sqe->len = mode;
+            }
+            continue;
+        }
+
+        is_ok &= make_directory(&cache, current_command->arg_variables[i], mode,
+                                mode_text != NULL, flags['p']);
+    }
+
+    // Missing parents, possibly made by the same command, one at a time.
+    if (is_batched) {
+        bool* retry = batch.retry;
+
+        is_ok = batch_finish(&batch);
+
+        for (int i = first; i < current_command->arg_count; i++) {
+            if (retry[i]) {
+                is_ok &= make_directory(&cache, current_command->arg_variables[i], mode,
+                                        mode_text != NULL, flags['p']);
+            }
+        }
+        free(retry);
+    }
+
+    close_dir_cache(&cache);
+    latest_status = is_ok ? 0 : 1 << 8;
+    return true;
+}
+
+
+/*
+* Function: touch_command.
+* Built-in touch [-c] FILE... Sets times with utimensat, and creates
+* missing files with openat unless -c is given.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: false if the command should run externally.
+*/
+bool touch_command(struct command_line* current_command) {
+    bool flags[128] = { false };
+    char* value = NULL;
+    int first;
+
+    if (!parse_file_options(current_command, "c", flags, &value, &first) ||
+        first >= current_command->arg_count) {
+        return false;
+    }
+
+    struct dir_cache cache = {0};
+    struct file_batch batch;
+    bool is_batched = !flags['c'] &&
+                      batch_begin(&batch, &cache, current_command, "touch", IORING_OP_OPENAT,
+                                  flags, current_command->arg_count - first);
+    bool is_ok = true;
+
+    for (int i = first; i < current_command->arg_count; i++) {
+        char* path = current_command->arg_variables[i];
+        char name[INPUT_LENGTH];
+        int dir_fd = parent_directory(&cache, path, name);
+
+        // io_uring cannot set times, so existing files take one call here.
+        if (dir_fd != -1 && utimensat(dir_fd, name, NULL, 0) == 0) {
+            continue;
+        }
+
+        if (dir_fd != -1 && errno == ENOENT) {
+            if (flags['c']) {
+                continue;
+            }
+
+            // Only missing files are created in the batch.
+            if (is_batched) {
+                struct batch_slot* slot = batch_slot(&batch, i);
+                struct io_uring_sqe* sqe;
+
+                slot->dir_fd = dir_fd;
+                strcpy(slot->name, name);
+
+                if ((sqe = batch_prepare(&batch, slot)) != NULL) {
+                    sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_NOCTTY | O_NONBLOCK |
+                                      O_CLOEXEC;
+                    sqe->len = 0666;
+                }
+                continue;
+            }
+
+            int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_NOCTTY | O_NONBLOCK | O_CLOEXEC,
+                            0666);
+
+            if (fd != -1) {
+                close(fd);
+                continue;
+            }
+        }
+
+        file_error("touch", path);
+        is_ok = false;
+    }
+
+    if (is_batched) {
+        is_ok = batch_finish(&batch);
+    }
+
+    close_dir_cache(&cache);
+    latest_status = is_ok ? 0 : 1 << 8;
+    return true;
+}
+
+
+/*
+* Function: mv_command.
+* Built-in mv [-f] [-n] SOURCE... DEST with renameat2. Moves between
+* file systems need a copy, so those run externally.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: false if the command should run externally.
+*/
+bool mv_command(struct command_line* current_command) {
+    bool flags[128] = { false };
+    char* value = NULL;
+    int first;
+
+    if (!parse_file_options(current_command, "fn", flags, &value, &first) ||
+        current_command->arg_count - first < 2) {
+        return false;
+    }
+
+    int last = current_command->arg_count - 1;
+    char* destination = current_command->arg_variables[last];
+    struct stat destination_status;
+    bool is_into = stat(destination, &destination_status) == 0 &&
+                   S_ISDIR(destination_status.st_mode);
+    struct dir_cache cache = {0};
+    struct statx status;
+    char name[INPUT_LENGTH];
+
+    if (!is_into && last - first > 1) {
+        return false;
+    }
+
+    // Renames stay within one mount. Moves out of it need a copy. Bind
+    // mounts share a device, so mounts are compared where known.
+    int target_fd = is_into ? cached_directory(&cache, destination) :
+                              parent_directory(&cache, destination, name);
+
+    if (target_fd == -1 ||
+        statx(target_fd, "", AT_EMPTY_PATH, STATX_MNT_ID, &status) == -1) {
+        close_dir_cache(&cache);
+        return false;
+    }
+
+    struct statx target_status = status;
+
+    for (int i = first; i < last; i++) {
+        if (statx(AT_FDCWD, current_command->arg_variables[i], AT_SYMLINK_NOFOLLOW,
+                  STATX_MNT_ID, &status) == 0 &&
+            (status.stx_dev_major != target_status.stx_dev_major ||
+             status.stx_dev_minor != target_status.stx_dev_minor ||
+             (status.stx_mask & target_status.stx_mask & STATX_MNT_ID &&
+              status.stx_mnt_id != target_status.stx_mnt_id))) {
+            close_dir_cache(&cache);
+            return false;
+        }
+    }
+
+    struct file_batch batch;
+    bool is_batched = batch_begin(&batch, &cache, current_command, "mv", IORING_OP_RENAMEAT,
+                                  flags, last - first);
+    bool is_ok = true;
+
+    for (int i = first; i < last; i++) {
+        char* source = current_command->arg_variables[i];
+
+        // Only moves into a directory have enough sources to batch.
+        if (is_batched) {
+            struct batch_slot* slot = batch_slot(&batch, i);
+            struct io_uring_sqe* sqe;
+
+            slot->dir_fd = parent_directory(&cache, source, slot->name);
+            slot->target_fd = cached_directory(&cache, destination);
+
+            if ((sqe = batch_prepare(&batch, slot)) != NULL) {
+                sqe->len = slot->target_fd;
+                sqe->addr2 = (uintptr_t) slot->name;
+                sqe->rename_flags = flags['n'] ? RENAME_NOREPLACE : 0;
+            }
+            continue;
+        }
+
+        int source_fd = parent_directory(&cache, source, name);
+        char target_name[INPUT_LENGTH];
+
+        target_fd = is_into ? cached_directory(&cache, destination) :
+                              parent_directory(&cache, destination, target_name);
+
+        if (is_into) {
+            strcpy(target_name, name);
+        }
+
+        if (source_fd == -1 || target_fd == -1 ||
+            renameat2(source_fd, name, target_fd, target_name,
+                      flags['n'] ? RENAME_NOREPLACE : 0) == -1) {
+            if (flags['n'] && errno == EEXIST) {
+                continue;
+            }
+
+            // Still across mounts. The external mv gets the sources not
+            // yet handled.
+            if (errno == EXDEV) {
+                char** arguments = current_command->arg_variables;
+
+                for (int j = first; j < i; j++) {
+                    free(arguments[j]);
+                }
+
+                memmove(&arguments[first], &arguments[i],
+                        (current_command->arg_count - i + 1) * sizeof(char*));
+                current_command->arg_count -= i - first;
+                close_dir_cache(&cache);
+                return false;
+            }
+
+            file_error("mv", source);
+            is_ok = false;
+        }
+    }
+
+    if (is_batched) {
+        is_ok = batch_finish(&batch);
+    }
+
+    close_dir_cache(&cache);
+    latest_status = is_ok ? 0 : 1 << 8;
+    return true;
+}
+
+
+/*
+* Function: ln_command.
+* Built-in ln [-s] [-f] TARGET [LINK], or TARGET... DIR, with linkat or
+* symlinkat. -f replaces an existing link.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: false if the command should run externally.
+*/
+bool ln_command(struct command_line* current_command) {
+    bool flags[128] = { false };
+    char* value = NULL;
+    int first;
+
+    if (!parse_file_options(current_command, "sf", flags, &value, &first) ||
+        first >= current_command->arg_count) {
+        return false;
+    }
+
+    int operands = current_command->arg_count - first;
+    int last = current_command->arg_count - 1;
+    char* destination = operands == 1 ? "." : current_command->arg_variables[last];
+    struct stat status;
+    bool is_into = stat(destination, &status) == 0 && S_ISDIR(status.st_mode);
+    int target_count = operands == 1 ? 1 : operands - 1;
+
+    if (!is_into && target_count > 1) {
+        return false;
+    }
+
+    struct dir_cache cache = {0};
+    struct file_batch batch;
+    bool is_batched = batch_begin(&batch, &cache, current_command, "ln",
+                                  flags['s'] ? IORING_OP_SYMLINKAT : IORING_OP_LINKAT, flags,
+                                  target_count);
+    bool is_ok = true;
+
+    for (int i = first; i < first + target_count; i++) {
+        char* target = current_command->arg_variables[i];
+
+        // Only links into a directory have enough targets to batch.
+        if (is_batched) {
+            struct batch_slot* slot = batch_slot(&batch, i);
+            struct io_uring_sqe* sqe;
+
+            last_component(target, slot->name);
+            slot->dir_fd = cached_directory(&cache, destination);
+
+            if ((sqe = batch_prepare(&batch, slot)) != NULL) {
+                sqe->addr = (uintptr_t) target;
+                sqe->addr2 = (uintptr_t) slot->name;
+
+                if (!flags['s']) {
+                    sqe->fd = AT_FDCWD;
+                    sqe->len = slot->dir_fd;
+                }
+            }
+            continue;
+        }
+
+        char name[INPUT_LENGTH];
+        int dir_fd;
+
+        if (is_into) {
+            last_component(target, name);
+            dir_fd = cached_directory(&cache, destination);
+        } else {
+            dir_fd = parent_directory(&cache, destination, name);
+        }
+
+        int result = -1;
+
+        for (int attempt = 0; dir_fd != -1 && attempt < 2; attempt++) {
+            result = flags['s'] ? symlinkat(target, dir_fd, name) :
+                                  linkat(AT_FDCWD, target, dir_fd, name, 0);
+
+            // With -f, an existing entry is replaced once.
+            if (result == 0 || errno != EEXIST || !flags['f'] || attempt > 0 ||
+                unlinkat(dir_fd, name, 0) == -1) {
+                break;
+            }
+        }
+
+        if (result == -1) {
+            file_error("ln", target);
+            is_ok = false;
+        }
+    }
+
+    if (is_batched) {
+        is_ok = batch_finish(&batch);
+    }
+
+    close_dir_cache(&cache);
+    latest_status = is_ok ? 0 : 1 << 8;
+    return true;
+}
+
+
+/*
+* Function: chmod_command.
+* Built-in chmod MODE FILE... with fchmodat. Octal modes need no stat.
+* Symbolic ones, including -w style, read the current mode first.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: false if the command should run externally.
+*/
+bool chmod_command(struct command_line* current_command) {
+    int first = current_command->arg_count > 1 &&
+                strcmp(current_command->arg_variables[1], "--") == 0 ? 2 : 1;
+    mode_t mode;
+
+    // Options such as -R are not modes and run externally.
+    if (current_command->arg_count - first < 2 ||
+        !parse_mode(current_command->arg_variables[first], 0, false, &mode)) {
+        return false;
+    }
+
+    char* mode_text = current_command->arg_variables[first];
+    bool is_octal = strspn(mode_text, "01234567") == strlen(mode_text);
+    bool flags[128] = { false };
+    struct dir_cache cache = {0};
+    struct file_batch batch;
+
+    // There is no io_uring chmod, so only the stats of symbolic modes batch.
+    bool is_batched = !is_octal &&
+                      batch_begin(&batch, &cache, current_command, "chmod", IORING_OP_STATX,
+                                  flags, current_command->arg_count - first - 1);
+    bool is_ok = true;
+
+    for (int i = first + 1; i < current_command->arg_count; i++) {
+        char* path = current_command->arg_variables[i];
+
+        if (is_batched) {
+            struct batch_slot* slot = batch_slot(&batch, i);
+            struct io_uring_sqe* sqe;
+
+            slot->dir_fd = parent_directory(&cache, path, slot->name);
+            batch.mode_text = mode_text;
+
+            if ((sqe = batch_prepare(&batch, slot)) != NULL) {
+                sqe->len = STATX_TYPE | STATX_MODE;
+                sqe->addr2 = (uintptr_t) &slot->status;
+            }
+            continue;
+        }
+
+        char name[INPUT_LENGTH];
+        struct stat status;
+        int dir_fd = parent_directory(&cache, path, name);
+
+        if (dir_fd == -1 ||
+            (!is_octal && (fstatat(dir_fd, name, &status, 0) == -1 ||
+                           !parse_mode(mode_text, status.st_mode, S_ISDIR(status.st_mode),
+                                       &mode))) ||
+            fchmodat(dir_fd, name, mode, 0) == -1) {
+            file_error("chmod", path);
+            is_ok = false;
+        }
+    }
+
+    if (is_batched) {
+        is_ok = batch_finish(&batch);
+    }
+
+    close_dir_cache(&cache);
+    latest_status = is_ok ? 0 : 1 << 8;
+    return true;
+}
+
+
+/*
+* Function: rm_command.
+* Built-in rm [-f] [-r] FILE... Files are unlinked relative to their
+* cached directory. -r removes trees on the prm walker. Without -f on a
+* terminal, rm asks before removing write-protected files, so those
+* commands, and -r, whose trees are not checked, run externally.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: false if the command should run externally.
+*/
+bool rm_command(struct command_line* current_command) {
+    bool flags[128] = { false };
+    char* value = NULL;
+    int first;
+
+    if (!parse_file_options(current_command, "frR", flags, &value, &first) ||
+        (first >= current_command->arg_count && !flags['f'])) {
+        return false;
+    }
+
+    bool is_asking = !flags['f'] && isatty(STDIN_FILENO);
+
+    if (is_asking && (flags['r'] || flags['R'])) {
+        return false;
+    }
+
+    for (int i = first; is_asking && i < current_command->arg_count; i++) {
+        if (faccessat(AT_FDCWD, current_command->arg_variables[i], W_OK,
+                      AT_SYMLINK_NOFOLLOW) == -1 && errno != ENOENT) {
+            return false;
+        }
+    }
+
+    bool is_ok = true;
+
+    if (flags['r'] || flags['R']) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        int threads = cores < 1 ? 1 : cores > WALK_MAX_THREADS ? WALK_MAX_THREADS : cores;
+
+        is_ok = walk_paths("rm", current_command->arg_variables + first,
+                           current_command->arg_count - first, threads, true, true,
+                           flags['f']) == 0;
+        latest_status = is_ok ? 0 : 1 << 8;
+        return true;
+    }
+
+    struct dir_cache cache = {0};
+    struct file_batch batch;
+    bool is_batched = batch_begin(&batch, &cache, current_command, "rm", IORING_OP_UNLINKAT,
+                                  flags, current_command->arg_count - first);
+
+    for (int i = first; i < current_command->arg_count; i++) {
+        char* path = current_command->arg_variables[i];
+
+        if (is_batched) {
+            struct batch_slot* slot = batch_slot(&batch, i);
+
+            slot->dir_fd = parent_directory(&cache, path, slot->name);
+            batch_prepare(&batch, slot);
+            continue;
+        }
+
+        char name[INPUT_LENGTH];
+        int dir_fd = parent_directory(&cache, path, name);
+
+        if (dir_fd == -1 || unlinkat(dir_fd, name, 0) == -1) {
+            if (flags['f'] && errno == ENOENT) {
+                continue;
+            }
+            file_error("rm", path);
+            is_ok = false;
+        }
+    }
+
+    if (is_batched) {
+        is_ok = batch_finish(&batch);
+    }
+
+    close_dir_cache(&cache);
+    latest_status = is_ok ? 0 : 1 << 8;
+    return true;
+}
+
+
+/*
+* Function: file_command.
+* Runs mkdir, touch, mv, ln, chmod, rm, and ls in the shell. Redirected,
+* background, or prefixed commands, and options the built-ins lack, are
+* left to the external programs.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: true if the command ran here.
+*/
+bool file_command(struct command_line* current_command) {
+    char* name = current_command->arg_variables[0];
+    struct job_priority no_priority = {0};
+    struct job_limits no_limits = {0};
+
+    if (current_command->is_background || current_command->is_detached ||
+        current_command->input_file != NULL || current_command->output_file != NULL) {
+        return false;
+    }
+
+    // Placement, priority, and limits only apply to a forked job.
+    if (current_command->affinity_policy != AFFINITY_UNSET ||
+        current_command->queue_name != NULL ||
+        memcmp(&current_command->priority, &no_priority, sizeof(no_priority)) != 0 ||
+        memcmp(&current_command->limits, &no_limits, sizeof(no_limits)) != 0) {
+        return false;
+    }
+
+    if (strcmp(name, "mkdir") == 0) {
+        return mkdir_command(current_command);
+    }
+
+    if (strcmp(name, "touch") == 0) {
+        return touch_command(current_command);
+    }
+
+    if (strcmp(name, "mv") == 0) {
+        return mv_command(current_command);
+    }
+
+    if (strcmp(name, "ln") == 0) {
+        return ln_command(current_command);
+    }
+
+    if (strcmp(name, "chmod") == 0) {
+        return chmod_command(current_command);
+    }
+
+    if (strcmp(name, "rm") == 0) {
+        return rm_command(current_command);
+    }
+
+    if (strcmp(name, "ls") == 0) {
+        return ls_command(current_command);
+    }
+
+    return false;
+}
+
+
+/*
+* Function: file_ring_ready.
+* Sets up the ring for batched file commands on first use and asks the
+* kernel which operations it supports.
+*
+* Parameter: opcode (IORING_OP_ operation wanted)
+* Return: true if the operation can be batched.
+*/
+bool file_ring_ready(int opcode) {
+
+    if (file_ring_state == 0) {
+        file_ring_state = -1;
+
+        // Waiting for completions needs the extended enter argument.
+        if (uring_setup(&file_ring, FILE_RING_ENTRIES) &&
+            (file_ring.features & IORING_FEAT_EXT_ARG)) {
+            struct io_uring_probe* probe = calloc(1, sizeof(struct io_uring_probe) +
+                                                  256 * sizeof(struct io_uring_probe_op));
+
+            if (syscall(__NR_io_uring_register, file_ring.ring_fd, IORING_REGISTER_PROBE, probe,
+                        256) == 0) {
+                for (int i = 0; i < probe->ops_len; i++) {
+                    file_ring_ops[i] = probe->ops[i].flags & IO_URING_OP_SUPPORTED;
+                }
+                file_ring_state = 1;
+            }
+            free(probe);
+        }
+
+        if (file_ring_state == -1 && file_ring.ring_fd != -1) {
+            close(file_ring.ring_fd);
+            file_ring.ring_fd = -1;
+        }
+    }
+
+    return file_ring_state == 1 && opcode >= 0 && opcode < 256 && file_ring_ops[opcode];
+}
+
+
+/*
+* Function: batch_begin.
+* Starts batching a file command if it has enough arguments and the
+* kernel supports the operation.
+*
+* Parameter: batch (filled in)
+*            cache (command's directories)
+*            current_command (pointer to the structure)
+*            command (command name for messages)
+*            opcode (IORING_OP_ operation)
+*            flags (command's options)
+*            count (operations the command will make)
+* Return: false if the command should run one call at a time.
+*/
+bool batch_begin(struct file_batch* batch, struct dir_cache* cache,
+                 struct command_line* current_command, char* command, int opcode, bool* flags,
+                 int count) {
+
+    if (count <= BATCH_THRESHOLD || !file_ring_ready(opcode)) {
+        return false;
+    }
+
+    memset(batch, 0, sizeof(struct file_batch));
+    batch->command = command;
+    batch->opcode = opcode;
+    batch->flags = flags;
+    batch->current_command = current_command;
+    batch->cache = cache;
+    batch->slots = malloc(BATCH_DEPTH * sizeof(struct batch_slot));
+    batch->retry = opcode == IORING_OP_MKDIRAT ? calloc(current_command->arg_count, sizeof(bool)) :
+                                                 NULL;
+    batch->is_ok = true;
+
+    for (int i = 0; i < BATCH_DEPTH; i++) {
+        batch->free_slots[i] = BATCH_DEPTH - 1 - i;
+    }
+    batch->free_count = BATCH_DEPTH;
+
+    cache->batch = batch;
+    return true;
+}
+
+
+/*
+* Function: batch_slot.
+* Takes a free slot for an argument, waiting for completions if all
+* slots are in flight.
+*
+* Parameter: batch (batch in progress)
+*            argument (index of the argument)
+* Return: slot to fill in.
+*/
+struct batch_slot* batch_slot(struct file_batch* batch, int argument) {
+
+    while (batch->free_count == 0) {
+        batch_reap(batch, 1);
+    }
+
+    struct batch_slot* slot = &batch->slots[batch->free_slots[--batch->free_count]];
+
+    slot->argument = argument;
+    slot->dir_fd = -1;
+    slot->target_fd = -1;
+    return slot;
+}
+
+
+/*
+* Function: batch_prepare.
+* Queues the operation for a filled in slot, on its directory and
+* name. If the directory could not be opened, the slot completes at
+* once with that error.
+*
+* Parameter: batch (batch in progress)
+*            slot (slot with dir_fd and name set)
+* Return: entry for any further fields, or NULL if it completed.
+*/
+struct io_uring_sqe* batch_prepare(struct file_batch* batch, struct batch_slot* slot) {
+    int slot_index = slot - batch->slots;
+
+    if (slot->dir_fd == -1 || (batch->opcode == IORING_OP_RENAMEAT && slot->target_fd == -1)) {
+        batch->in_flight++;
+        batch_complete(batch, slot_index, -errno);
+        return NULL;
+    }
+
+    struct io_uring_sqe* sqe = uring_get_sqe(&file_ring);
+
+    sqe->opcode = batch->opcode;
+    sqe->fd = slot->dir_fd;
+    sqe->addr = (uintptr_t) slot->name;
+    sqe->user_data = slot_index;
+    batch->in_flight++;
+    return sqe;
+}
+
+
+/*
+* Function: batch_complete.
+* Handles one finished operation and frees its slot. Errors are
+* reported as the one-call-at-a-time commands report them.
+*
+* Parameter: batch (batch in progress)
+*            slot_index (slot, or BATCH_CLOSE for a close)
+*            result (operation result, negative errno on error)
+* Return: none.
+*/
+void batch_complete(struct file_batch* batch, int slot_index, int result) {
+    batch->in_flight--;
+
+    if (slot_index == BATCH_CLOSE) {
+        return;
+    }
+
+    struct batch_slot* slot = &batch->slots[slot_index];
+    char* path = batch->current_command->arg_variables[slot->argument];
+    bool* flags = batch->flags;
+    struct stat status;
+    mode_t mode;
+
+    batch->free_slots[batch->free_count++] = slot_index;
+    errno = -result;
+
+    switch (batch->opcode) {
+        case IORING_OP_UNLINKAT:
+            if (result == 0 || (flags['f'] && result == -ENOENT)) {
+                return;
+            }
+            break;
+
+        // A parent may be made later in the same command. Retry those after.
+        case IORING_OP_MKDIRAT:
+            if (result == 0) {
+                if (!batch->is_exact || fchmodat(slot->dir_fd, slot->name, batch->mode, 0) == 0) {
+                    return;
+                }
+            } else if (result == -ENOENT) {
+                batch->retry[slot->argument] = true;
+                return;
+            } else if (result == -EEXIST && flags['p'] &&
+                       fstatat(slot->dir_fd, slot->name, &status, 0) == 0 &&
+                       S_ISDIR(status.st_mode)) {
+                return;
+            } else {
+                errno = -result;
+            }
+            break;
+
+        // Created here, so close it. A file made by someone else since
+        // touch found it missing only needs new times.
+        case IORING_OP_OPENAT:
+            if (result >= 0) {
+                struct io_uring_sqe* sqe = uring_get_sqe(&file_ring);
+
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = result;
+                sqe->user_data = BATCH_CLOSE;
+                batch->in_flight++;
+                return;
+            }
+
+            if (result == -EEXIST && utimensat(slot->dir_fd, slot->name, NULL, 0) == 0) {
+                return;
+            }
+            break;
+
+        case IORING_OP_RENAMEAT:
+            if (result == 0 || (flags['n'] && result == -EEXIST)) {
+                return;
+            }
+            break;
+
+        // With -f, an existing entry is replaced once.
+        case IORING_OP_SYMLINKAT:
+        case IORING_OP_LINKAT:
+            if (result == 0 ||
+                (result == -EEXIST && flags['f'] && unlinkat(slot->dir_fd, slot->name, 0) == 0 &&
+                 (flags['s'] ? symlinkat(path, slot->dir_fd, slot->name) :
+                               linkat(AT_FDCWD, path, slot->dir_fd, slot->name, 0)) == 0)) {
+                return;
+            }
+            break;
+
+        case IORING_OP_STATX:
+            if (result == 0 &&
+                parse_mode(batch->mode_text, slot->status.stx_mode,
+                           S_ISDIR(slot->status.stx_mode), &mode) &&
+                fchmodat(slot->dir_fd, slot->name, mode, 0) == 0) {
+                return;
+            }
+            break;
+    }
+
+    file_error(batch->command, path);
+    batch->is_ok = false;
+}
+
+
+/*
+* Function: batch_reap.
+* Submits queued operations and handles every completion that is
+* ready, in one io_uring_enter.
+*
+* Parameter: batch (batch in progress)
+*            wait_count (completions to wait for)
+* Return: none.
+*/
+void batch_reap(struct file_batch* batch, unsigned wait_count) {
+    struct io_uring_cqe* cqe;
+
+    if (uring_enter(&file_ring, wait_count, -1) == -1 && errno != EINTR) {
+        perror("io_uring_enter");
+    }
+
+    while ((cqe = uring_peek_cqe(&file_ring)) != NULL) {
+        int slot_index = cqe->user_data;
+        int result = cqe->res;
+
+        uring_advance_cqe(&file_ring);
+        batch_complete(batch, slot_index, result);
+    }
+}
+
+
+/*
+* Function: batch_finish.
+* Waits for every operation, including closes, to complete.
+*
+* Parameter: batch (batch in progress)
+* Return: false if any operation failed.
+*/
+bool batch_finish(struct file_batch* batch) {
+
+    while (batch->in_flight > 0) {
+        batch_reap(batch, 1);
+    }
+
+    batch->cache->batch = NULL;
+    free(batch->slots);
+    return batch->is_ok;
+}
+
+
+/*
+* Function: listing_printf.
+* Appends formatted text to the ls output.
+*
+* Parameter: output (ls output)
+*            format (printf format)
+* Return: none.
+*/
+void listing_printf(struct listing_output* output, const char* format, ...) {
+    va_list arguments;
+
+    while (true) {
+        size_t room = output->capacity - output->length;
+
+        va_start(arguments, format);
+        int length = vsnprintf(output->data + output->length, room, format, arguments);
+        va_end(arguments);
+
+        if (length < 0) {
+            return;
+        }
+
+        if ((size_t) length < room) {
+            output->length += length;
+            return;
+        }
+
+        output->capacity = output->capacity * 2 + length + 1;
+        output->data = realloc(output->data, output->capacity);
+    }
+}
+
+
+/*
+* Function: radix_sort.
+* Most significant byte first radix sort of names that share their
+* first depth bytes. Byte order, as in the C locale, so no locale
+* comparison runs per pair. Small groups use insertion sort.
+*
+* Parameter: names (names to sort)
+*            scratch (room for count names)
+*            count (number of names)
+*            depth (bytes already equal)
+* Return: none.
+*/
+void radix_sort(char** names, char** scratch, size_t count, size_t depth) {
+
+    if (count < 32) {
+        for (size_t i = 1; i < count; i++) {
+            char* name = names[i];
+            size_t j = i;
+
+            for (; j > 0 && strcmp(names[j - 1] + depth, name + depth) > 0; j--) {
+                names[j] = names[j - 1];
+            }
+            names[j] = name;
+        }
+        return;
+    }
+
+    // Bucket 0 holds names that end here.
+    size_t starts[257] = {0};
+
+    for (size_t i = 0; i < count; i++) {
+        starts[(unsigned char) names[i][depth] + 1]++;
+    }
+
+    for (int i = 1; i < 257; i++) {
+        starts[i] += starts[i - 1];
+    }
+
+    size_t positions[256];
+
+    memcpy(positions, starts, sizeof(positions));
+
+    for (size_t i = 0; i < count; i++) {
+        scratch[positions[(unsigned char) names[i][depth]]++] = names[i];
+    }
+
+    memcpy(names, scratch, count * sizeof(char*));
+
+    for (int i = 1; i < 256; i++) {
+        if (starts[i + 1] - starts[i] > 1) {
+            radix_sort(names + starts[i], scratch, starts[i + 1] - starts[i], depth + 1);
+        }
+    }
+}
+
+
+/*
+* Function: read_entries.
+* Reads a whole directory with getdents64 into one buffer, grown as
+* needed, and collects the names to show.
+*
+* Parameter: dir_fd (open directory)
+*            is_all (show . and .. and hidden names, as -a)
+*            is_almost_all (show hidden names, as -A)
+*            count (receives the number of names)
+*            storage (receives the buffer holding the names. Caller frees)
+* Return: names, or NULL on a read error. Caller frees.
+*/
+char** read_entries(int dir_fd, bool is_all, bool is_almost_all, size_t* count,
+                    char** storage) {
+    size_t capacity = LISTING_BUFFER;
+    size_t used = 0;
+    char* buffer = malloc(capacity);
+    int length;
+
+    while ((length = read_directory(dir_fd, buffer + used, capacity - used)) > 0) {
+        used += length;
+
+        if (capacity - used < DIRENT_BUFFER) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+    }
+
+    if (length == -1) {
+        free(buffer);
+        return NULL;
+    }
+
+    size_t total = 0;
+    size_t name_capacity = 256;
+    char** names = malloc(name_capacity * sizeof(char*));
+
+    for (size_t offset = 0; offset < used;) {
+        struct linux_dirent64* entry = (struct linux_dirent64*) (buffer + offset);
+        char* name = entry->d_name;
+
+        offset += entry->d_reclen;
+
+        if (name[0] == '.' && !is_all &&
+            (!is_almost_all || name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+
+        if (total == name_capacity) {
+            name_capacity *= 2;
+            names = realloc(names, name_capacity * sizeof(char*));
+        }
+        names[total++] = name;
+    }
+
+    *count = total;
+    *storage = buffer;
+    return names;
+}
+
+
+/*
+* Function: stat_entries.
+* Gets the fields ls -l shows for each name. Large directories submit
+* the statx calls to io_uring with at most BATCH_DEPTH in flight.
+*
+* Parameter: dir_fd (directory holding the names, or AT_FDCWD)
+*            names (names to stat)
+*            count (number of names)
+*            status (receives one result per name)
+*            has_status (receives whether each stat worked)
+* Return: none.
+*/
+void stat_entries(int dir_fd, char** names, size_t count, struct statx* status, bool* has_status) {
+    unsigned mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID |
+                    STATX_SIZE | STATX_MTIME | STATX_BLOCKS;
+
+    if (count <= BATCH_THRESHOLD || !file_ring_ready(IORING_OP_STATX)) {
+        for (size_t i = 0; i < count; i++) {
+            has_status[i] = statx(dir_fd, names[i], AT_SYMLINK_NOFOLLOW, mask, &status[i]) == 0;
+
+            if (!has_status[i]) {
+                file_error("ls", names[i]);
+            }
+        }
+        return;
+    }
+
+    size_t submitted = 0;
+    size_t completed = 0;
+
+    while (completed < count) {
+        for (; submitted < count && submitted - completed < BATCH_DEPTH; submitted++) {
+            struct io_uring_sqe* sqe = uring_get_sqe(&file_ring);
+
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dir_fd;
+            sqe->addr = (uintptr_t) names[submitted];
+            sqe->len = mask;
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            sqe->addr2 = (uintptr_t) &status[submitted];
+            sqe->user_data = submitted;
+        }
+
+        if (uring_enter(&file_ring, 1, -1) == -1 && errno != EINTR) {
+            perror("io_uring_enter");
+        }
+
+        struct io_uring_cqe* cqe;
+
+        while ((cqe = uring_peek_cqe(&file_ring)) != NULL) {
+            size_t index = cqe->user_data;
+
+            has_status[index] = cqe->res == 0;
+
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                file_error("ls", names[index]);
+            }
+
+            uring_advance_cqe(&file_ring);
+            completed++;
+        }
+    }
+}
+
+
+/*
+* Function: owner_name.
+* Name of a user or group, remembering recent ones since a directory
+* usually has few owners.
+*
+* Parameter: id (user or group id)
+*            is_group (look up a group rather than a user)
+* Return: name, or the id as text. Valid until the next call.
+*/
+char* owner_name(unsigned id, bool is_group) {
+    static unsigned ids[2][OWNER_CACHE_SIZE];
+    static char names[2][OWNER_CACHE_SIZE][64];
+    static int counts[2];
+    int kind = is_group ? 1 : 0;
+
+    for (int i = 0; i < counts[kind]; i++) {
+        if (ids[kind][i] == id) {
+            return names[kind][i];
+        }
+    }
+
+    int slot = counts[kind] < OWNER_CACHE_SIZE ? counts[kind]++ : id % OWNER_CACHE_SIZE;
+    struct passwd* user = is_group ? NULL : getpwuid(id);
+    struct group* group = is_group ? getgrgid(id) : NULL;
+
+    ids[kind][slot] = id;
+
+    if (user != NULL || group != NULL) {
+        snprintf(names[kind][slot], 64, "%s", user ? user->pw_name : group->gr_name);
+    } else {
+        snprintf(names[kind][slot], 64, "%u", id);
+    }
+
+    return names[kind][slot];
+}
+
+
+/*
+* Function: display_width.
+* Columns a UTF-8 name takes, counting one per character.
+*
+* Parameter: name (file name)
+* Return: width.
+*/
+int display_width(const char* name) {
+    int width = 0;
+
+    for (; *name != '\0'; name++) {
+        width += ((unsigned char) *name & 0xc0) != 0x80;
+    }
+
+    return width;
+}
+
+
+/*
+* Function: format_long.
+* Appends names in the ls -l format: mode, links, owner, group, size,
+* modification time, and name, with link targets after symlinks.
+*
+* Parameter: output (ls output)
+*            dir_fd (directory holding the names, or AT_FDCWD)
+*            names (sorted names)
+*            count (number of names)
+*            is_total (start with the total of 1K blocks)
+* Return: none.
+*/
+void format_long(struct listing_output* output, int dir_fd, char** names, size_t count,
+                 bool is_total) {
+    struct statx* status = malloc((count ? count : 1) * sizeof(struct statx));
+    bool* has_status = malloc((count ? count : 1) * sizeof(bool));
+    int widths[4] = {0};
+    unsigned long long blocks = 0;
+    char field[64];
+
+    stat_entries(dir_fd, names, count, status, has_status);
+
+    // Column widths: links, owner, group, size.
+    for (size_t i = 0; i < count; i++) {
+        if (!has_status[i]) {
+            continue;
+        }
+
+        struct statx* entry = &status[i];
+        int lengths[4];
+
+        lengths[0] = snprintf(field, sizeof(field), "%u", entry->stx_nlink);
+        lengths[1] = strlen(owner_name(entry->stx_uid, false));
+        lengths[2] = strlen(owner_name(entry->stx_gid, true));
+        lengths[3] = S_ISCHR(entry->stx_mode) || S_ISBLK(entry->stx_mode) ?
+                     snprintf(field, sizeof(field), "%u, %u", entry->stx_rdev_major,
+                              entry->stx_rdev_minor) :
+                     snprintf(field, sizeof(field), "%llu", (unsigned long long) entry->stx_size);
+
+        for (int j = 0; j < 4; j++) {
+            widths[j] = lengths[j] > widths[j] ? lengths[j] : widths[j];
+        }
+
+        blocks += (entry->stx_blocks + 1) / 2;
+    }
+
+    if (is_total) {
+        listing_printf(output, "total %llu\n", blocks);
+    }
+
+    time_t now = time(NULL);
+
+    for (size_t i = 0; i < count; i++) {
+        struct statx* entry = &status[i];
+
+        if (!has_status[i]) {
+            listing_printf(output, "?????????? ? ? ? ? ? %s\n", names[i]);
+            continue;
+        }
+
+        mode_t mode = entry->stx_mode;
+        char permissions[11] = "----------";
+        const char* types = "?pc?d?b?-?l?s";
+
+        permissions[0] = types[(mode & S_IFMT) >> 12];
+
+        for (int j = 0; j < 9; j++) {
+            if (mode & (0400 >> j)) {
+                permissions[1 + j] = "rwx"[j % 3];
+            }
+        }
+
+        if (mode & S_ISUID) {
+            permissions[3] = mode & S_IXUSR ? 's' : 'S';
+        }
+        if (mode & S_ISGID) {
+            permissions[6] = mode & S_IXGRP ? 's' : 'S';
+        }
+        if (mode & S_ISVTX) {
+            permissions[9] = mode & S_IXOTH ? 't' : 'T';
+        }
+
+        // Recent files show the time, older or future ones the year.
+        time_t modified = entry->stx_mtime.tv_sec;
+        struct tm local;
+        char date[32];
+
+        localtime_r(&modified, &local);
+        strftime(date, sizeof(date),
+                 modified > now - 15778476 && modified <= now + 3600 ? "%b %e %H:%M" :
+                                                                         "%b %e  %Y", &local);
+
+        if (S_ISCHR(mode) || S_ISBLK(mode)) {
+            snprintf(field, sizeof(field), "%u, %u", entry->stx_rdev_major,
+                     entry->stx_rdev_minor);
+        } else {
+            snprintf(field, sizeof(field), "%llu", (unsigned long long) entry->stx_size);
+        }
+
+        listing_printf(output, "%s %*u %-*s %-*s %*s %s %s", permissions, widths[0],
+                       entry->stx_nlink, widths[1], owner_name(entry->stx_uid, false),
+                       widths[2], owner_name(entry->stx_gid, true), widths[3], field, date,
+                       names[i]);
+
+        if (S_ISLNK(mode)) {
+            char target[PATH_MAX];
+            ssize_t length = readlinkat(dir_fd, names[i], target, sizeof(target) - 1);
+
+            if (length >= 0) {
+                target[length] = '\0';
+                listing_printf(output, " -> %s", target);
+            }
+        }
+
+        listing_printf(output, "\n");
+    }
+
+    free(status);
+    free(has_status);
+}
+
+
+/*
+* Function: format_columns.
+* Appends names one per line, or in columns filled top to bottom that
+* fit the terminal, as ls does on a terminal.
+*
+* Parameter: output (ls output)
+*            names (sorted names)
+*            count (number of names)
+*            is_columns (use columns rather than one per line)
+* Return: none.
+*/
+void format_columns(struct listing_output* output, char** names, size_t count, bool is_columns) {
+    struct winsize window;
+    int terminal_width = 80;
+
+    if (!is_columns || count == 0) {
+        for (size_t i = 0; i < count; i++) {
+            listing_printf(output, "%s\n", names[i]);
+        }
+        return;
+    }
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_col > 0) {
+        terminal_width = window.ws_col;
+    }
+
+    int* widths = malloc(count * sizeof(int));
+    int* column_widths = malloc(count * sizeof(int));
+    size_t rows = count;
+
+    for (size_t i = 0; i < count; i++) {
+        widths[i] = display_width(names[i]);
+    }
+
+    // The most columns that fit, with two spaces between columns.
+    for (size_t columns = count; columns > 1; columns--) {
+        size_t try_rows = (count + columns - 1) / columns;
+        size_t used_columns = (count + try_rows - 1) / try_rows;
+        int total = 0;
+
+        for (size_t column = 0; column < used_columns && total <= terminal_width; column++) {
+            int widest = 0;
+
+            for (size_t row = 0; row < try_rows && column * try_rows + row < count; row++) {
+                int width = widths[column * try_rows + row];
+
+                widest = width > widest ? width : widest;
+            }
+
+            column_widths[column] = widest;
+            total += widest + (column + 1 < used_columns ? 2 : 0);
+        }
+
+        if (total <= terminal_width) {
+            rows = try_rows;
+            break;
+        }
+    }
+
+    // One column needs no widths.
+    if (rows == count) {
+        column_widths[0] = 0;
+    }
+
+    size_t used_columns = (count + rows - 1) / rows;
+
+    for (size_t row = 0; row < rows; row++) {
+        for (size_t column = 0; column < used_columns; column++) {
+            size_t index = column * rows + row;
+
+            if (index >= count) {
+                break;
+            }
+
+            bool is_last = column + 1 == used_columns || index + rows >= count;
+
+            listing_printf(output, "%s%*s", names[index],
+                           is_last ? 0 : column_widths[column] - widths[index] + 2, "");
+        }
+        listing_printf(output, "\n");
+    }
+
+    free(widths);
+    free(column_widths);
+}
+
+
+/*
+* Function: ls_command.
+* Built-in ls [-a] [-A] [-l] [-1] [PATH...]. Names come from getdents64
+* and need no stat unless -l is given. They are sorted by byte value,
+* as in the C locale, and the whole listing is written at once.
+*
+* Parameter: current_command (pointer to the structure)
+* Return: false if the command should run externally.
+*/
+bool ls_command(struct command_line* current_command) {
+    bool flags[128] = { false };
+    char* value = NULL;
+    int first;
+
+    if (!parse_file_options(current_command, "aAl1", flags, &value, &first)) {
+        return false;
+    }
+
+    bool is_columns = !flags['l'] && !flags['1'] && isatty(STDOUT_FILENO);
+    int operand_count = current_command->arg_count - first;
+    char* current = ".";
+    char** operands = operand_count > 0 ? current_command->arg_variables + first : &current;
+    struct listing_output output = {0};
+    bool is_ok = true;
+
+    operand_count = operand_count > 0 ? operand_count : 1;
+
+    // Files first, then each directory. ls -l shows links to directories as links.
+    char** files = malloc(operand_count * sizeof(char*));
+    char** directories = malloc(operand_count * sizeof(char*));
+    char** scratch = malloc(operand_count * sizeof(char*));
+    size_t file_count = 0;
+    size_t directory_count = 0;
+
+    for (int i = 0; i < operand_count; i++) {
+        struct statx status;
+
+        if (statx(AT_FDCWD, operands[i], flags['l'] ? AT_SYMLINK_NOFOLLOW : 0, STATX_TYPE,
+                  &status) == -1) {
+            file_error("ls", operands[i]);
+            is_ok = false;
+        } else if (S_ISDIR(status.stx_mode)) {
+            directories[directory_count++] = operands[i];
+        } else {
+            files[file_count++] = operands[i];
+        }
+    }
+
+    radix_sort(files, scratch, file_count, 0);
+    radix_sort(directories, scratch, directory_count, 0);
+
+    if (flags['l']) {
+        format_long(&output, AT_FDCWD, files, file_count, false);
+    } else {
+        format_columns(&output, files, file_count, is_columns);
+    }
+
+    for (size_t i = 0; i < directory_count; i++) {
+        int dir_fd = open(directories[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        char* storage = NULL;
+        size_t count = 0;
+        char** names = dir_fd == -1 ? NULL :
+                       read_entries(dir_fd, flags['a'], flags['A'], &count, &storage);
+
+        if (names == NULL) {
+            file_error("ls", directories[i]);
+            is_ok = false;
+            if (dir_fd != -1) {
+                close(dir_fd);
+            }
+            continue;
+        }
+
+        if (file_count > 0 || i > 0) {
+            listing_printf(&output, "\n");
+        }
+
+        if (operand_count > 1) {
+            listing_printf(&output, "%s:\n", directories[i]);
+        }
+
+        char** name_scratch = malloc((count ? count : 1) * sizeof(char*));
+
+        radix_sort(names, name_scratch, count, 0);
+
+        if (flags['l']) {
+            format_long(&output, dir_fd, names, count, true);
+        } else {
+            format_columns(&output, names, count, is_columns);
+        }
+
+        free(name_scratch);
+        free(names);
+        free(storage);
+        close(dir_fd);
+    }
+
+    // Messages first, then the listing in one write.
+    fflush(stdout);
+
+    if (output.length > 0 && !write_full(STDOUT_FILENO, output.data, output.length)) {
+        perror("ls");
+    }
+
+    free(output.data);
+    free(files);
+    free(directories);
+    free(scratch);
+    latest_status = is_ok ? 0 : 1 << 8;
+    return true;
+}